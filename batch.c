@@ -0,0 +1,476 @@
+/*
+ * Batch compiles - HS
+ * Every line of the manifest is a cmc command line (input files, -o
+ * output and options) that is compiled as a job of its own. The jobs
+ * are shared out evenly between the workers up front. A worker takes
+ * its own jobs off the back of its queue, and once that is empty it
+ * steals from the front of the other queues.
+ *
+ * With --io threads or --io uring a worker takes its jobs a group at a
+ * time, reads the input files of the whole group in one go, compiles
+ * them, and writes all the midi files in one go, so with io_uring the
+ * file system calls of up to IO_GROUP jobs are in flight together.
+ */
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stream.h"
+#include "util.h"
+#include "cmc.h"
+#include "cache.h"
+#include "io.h"
+
+#define IO_GROUP 64            /* jobs a worker reads and writes together */
+
+struct job_t
+{
+	int line;              /* line of the manifest */
+	char ** argv;
+	double latency;        /* seconds */
+	char * error;          /* NULL if the job went through */
+};
+
+/* the jobs [head,tail) still waiting for a worker */
+struct queue_t
+{
+	pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+};
+
+/* a job of a group, compiled with its files read in bulk */
+struct group_job_t
+{
+	struct job_t * job;
+	OPTIONS opt;
+	size_t first;          /* its input files in the worker's */
+	STREAM * output;       /* kept for the next group */
+	size_t write;          /* its output file in the worker's */
+};
+
+struct worker_t
+{
+	pthread_t thread;
+	size_t id;
+	struct batch_t * batch;
+	struct queue_t queue;
+	STREAM * output;       /* scratch streams reused for every job */
+	STREAM * scratch;
+	char * tracks[MAX_TRACK_COUNT];
+	BAIL_HANDLER handler;
+	IO_ENGINE * io;        /* NULL to read and write each job with stdio */
+	struct group_job_t group[IO_GROUP];
+	IO_FILE * inputs;      /* the streams of these are kept for the next group */
+	size_t input_count;
+	size_t input_size;
+	IO_FILE outputs[IO_GROUP];
+};
+
+struct batch_t
+{
+	OPTIONS * opt;         /* the options every job starts out with */
+	char * manifest;       /* the words of the jobs point into this */
+	struct job_t * jobs;
+	size_t job_count;
+	struct worker_t * workers;
+	size_t worker_count;
+	CACHE * cache;         /* NULL unless the jobs share a cache */
+};
+
+typedef struct job_t    JOB;
+typedef struct group_job_t GROUP_JOB;
+typedef struct queue_t  QUEUE;
+typedef struct worker_t WORKER;
+typedef struct batch_t  BATCH;
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/* one job for every line of the manifest that isn't blank */
+static void load_manifest (BATCH * b, char * file)
+{
+	STREAM * s;
+	char * p;
+	size_t lines = 1;
+	int line = 0;
+
+	s = stream_load_from_file (file);
+	if (!s)
+		bail ("Unable to open file:%s\n",file);
+	stream_add_char (s, '\0');
+	b->manifest = stream_copy_buffer (s);
+	stream_free (s);
+	for (p=b->manifest;*p;p++)
+		if (*p == '\n')
+			lines++;
+	b->jobs = xmalloc (lines*sizeof(JOB));
+	b->job_count = 0;
+
+	for (p=b->manifest;p;) {
+		char * next = strchr (p, '\n');
+		size_t n;
+		if (next)
+			*next++ = '\0';
+		line++;
+		n = split_words (p, NULL);
+		if (n) {
+			JOB * j = b->jobs + b->job_count++;
+			j->line = line;
+			j->argv = xmalloc ((n+1)*sizeof(char *));
+			split_words (p, j->argv);
+			j->error = NULL;
+			j->latency = 0;
+		}
+		p = next;
+	}
+}
+
+static void parse_job (WORKER * w, JOB * j, OPTIONS * opt)
+{
+	*opt = *w->batch->opt;
+	if (!parse_args (opt, j->argv))
+		bail ("Nothing to compile\n");
+	if (opt->batch_file != w->batch->opt->batch_file)
+		bail ("A batch can't run another batch\n");
+	if (!opt->file_count)
+		bail ("No input files\n");
+	if (!opt->output_file)
+		bail ("No output file\n");
+}
+
+/* compile one job. Anything that goes wrong is kept in the job */
+static void run_job (WORKER * w, JOB * j)
+{
+	OPTIONS opt;
+	int i, count;
+	double start = now ();
+	for (i=0;i<MAX_TRACK_COUNT;i++)
+		w->tracks[i] = NULL;
+	if (setjmp (w->handler.env)) {
+		bail_catch (NULL);
+		j->error = xstrdup (w->handler.message);
+	} else {
+		bail_catch (&w->handler);
+		parse_job (w, j, &opt);
+		count = load_tracks (&opt, w->tracks);
+		if (w->batch->cache)
+			cache_compile (w->batch->cache, &opt, w->tracks, count, w->output, w->scratch);
+		else {
+			encode_file (&opt, w->tracks, count, w->output, w->scratch);
+			if (!stream_write_to_file (w->output, opt.output_file))
+				bail ("Unable to write file:%s\n",opt.output_file);
+		}
+		bail_catch (NULL);
+	}
+	if (w->handler.warnings[0])
+		fprintf (stderr, "%s:%i: %s", w->batch->opt->batch_file, j->line, w->handler.warnings);
+	for (i=0;i<MAX_TRACK_COUNT;i++)
+		if (w->tracks[i])
+			free (w->tracks[i]);
+	j->latency = now () - start;
+}
+
+static int take_job (QUEUE * q, int back, size_t * job)
+{
+	int found = 0;
+	pthread_mutex_lock (&q->lock);
+	if (q->head < q->tail) {
+		*job = back ? --q->tail : q->head++;
+		found = 1;
+	}
+	pthread_mutex_unlock (&q->lock);
+	return found;
+}
+
+static JOB * next_job (WORKER * w)
+{
+	BATCH * b = w->batch;
+	size_t i, job;
+	if (take_job (&w->queue, 1, &job))
+		return b->jobs + job;
+	/* no jobs are ever added, so one pass over the others will do */
+	for (i=1;i<b->worker_count;i++)
+		if (take_job (&b->workers[(w->id+i)%b->worker_count].queue, 0, &job))
+			return b->jobs + job;
+	return NULL;
+}
+
+/* the input files of a job go in the same order as load_tracks puts them */
+static void group_parse (WORKER * w, GROUP_JOB * g)
+{
+	unsigned int n;
+	parse_job (w, g->job, &g->opt);
+	g->first = w->input_count;
+	for (n=g->opt.file_count;n--;) {
+		IO_FILE * f;
+		if (w->input_count == w->input_size) {
+			size_t size = w->input_size ? w->input_size*2 : IO_GROUP;
+			w->inputs = xrealloc (w->inputs, size*sizeof(IO_FILE));
+			/* the buffers stay with the worker, even if the job bails */
+			while (w->input_size < size) {
+				f = w->inputs + w->input_size;
+				f->data = stream_create (4096);
+				bail_drop (f->data);
+				w->input_size++;
+			}
+		}
+		f = w->inputs + w->input_count++;
+		f->path = g->opt.in_files[n];
+		stream_write_reset (f->data);
+	}
+}
+
+static void group_compile (WORKER * w, GROUP_JOB * g)
+{
+	unsigned int i;
+	for (i=0;i<g->opt.file_count;i++) {
+		IO_FILE * f = w->inputs + g->first + i;
+		if (f->error == ENOMEM)
+			bail ("Out of memory reading file:%s\n",f->path);
+		if (f->error)
+			bail ("Unable to open file:%s\n",f->path);
+		stream_add_char (f->data, '\0');
+		w->tracks[i] = f->data->buffer;
+	}
+	stream_write_reset (g->output);
+	if (w->batch->cache)
+		cache_compile (w->batch->cache, &g->opt, w->tracks, g->opt.file_count, g->output, w->scratch);
+	else
+		encode_file (&g->opt, w->tracks, g->opt.file_count, g->output, w->scratch);
+}
+
+/* a step of a job of the group. Anything that goes wrong is kept in the job */
+static void group_step (WORKER * w, GROUP_JOB * g, void (*step) (WORKER *, GROUP_JOB *))
+{
+	if (g->job->error)
+		return;
+	if (setjmp (w->handler.env)) {
+		bail_catch (NULL);
+		g->job->error = xstrdup (w->handler.message);
+	} else {
+		bail_catch (&w->handler);
+		step (w, g);
+		bail_catch (NULL);
+	}
+	if (w->handler.warnings[0])
+		fprintf (stderr, "%s:%i: %s", w->batch->opt->batch_file, g->job->line, w->handler.warnings);
+}
+
+static int io_pass (WORKER * w, IO_FILE * files, size_t count, int write)
+{
+	if (setjmp (w->handler.env)) {
+		bail_catch (NULL);
+		return 0;
+	}
+	bail_catch (&w->handler);
+	if (write)
+		io_write_files (w->io, files, count);
+	else
+		io_read_files (w->io, files, count);
+	bail_catch (NULL);
+	return 1;
+}
+
+/* read or write the files of the group. A bail on the way fails the
+ * file it came from and leaves those that weren't done ECANCELED: they
+ * are tried again for as long as that gets any further. Whatever
+ * fails is a failed file of its job, the rest of the batch goes on */
+static void group_io (WORKER * w, IO_FILE * files, size_t count, int write)
+{
+	size_t i, j, left, last = count;
+	if (io_pass (w, files, count, write))
+		return;
+	while (1) {
+		for (i=left=0;i<count;i++)
+			left += files[i].error == ECANCELED;
+		if (!left || left == last)
+			return;
+		last = left;
+		for (i=0;i<count;i=j+1) {
+			for (j=i;j<count && files[j].error == ECANCELED;j++)
+				if (!write)
+					stream_write_reset (files[j].data);
+			if (j > i && !io_pass (w, files + i, j - i, write))
+				break;
+		}
+	}
+}
+
+/* compile a group of jobs, reading and writing their files in bulk */
+static void run_group (WORKER * w, size_t count)
+{
+	double start = now ();
+	size_t i, writes = 0;
+	w->input_count = 0;
+	for (i=0;i<count;i++)
+		group_step (w, w->group + i, group_parse);
+	group_io (w, w->inputs, w->input_count, 0);
+	for (i=0;i<count;i++) {
+		GROUP_JOB * g = w->group + i;
+		group_step (w, g, group_compile);
+		/* the cache writes the midi file itself */
+		if (!g->job->error && !w->batch->cache) {
+			IO_FILE * f = w->outputs + writes;
+			f->path = g->opt.output_file;
+			f->data = g->output;
+			g->write = writes++;
+		}
+	}
+	group_io (w, w->outputs, writes, 1);
+	for (i=0;i<count;i++) {
+		GROUP_JOB * g = w->group + i;
+		if (!g->job->error && !w->batch->cache && w->outputs[g->write].error) {
+			g->job->error = xmalloc (strlen (g->opt.output_file) + 32);
+			sprintf (g->job->error, "Unable to write file:%s\n", g->opt.output_file);
+		}
+		g->job->latency = now () - start;
+	}
+}
+
+static void * worker_main (void * arg)
+{
+	WORKER * w = arg;
+	JOB * j;
+	size_t count = 0;
+	if (!w->io) {
+		while ((j = next_job (w)))
+			run_job (w, j);
+		return NULL;
+	}
+	while ((j = next_job (w))) {
+		w->group[count++].job = j;
+		if (count == IO_GROUP) {
+			run_group (w, count);
+			count = 0;
+		}
+	}
+	if (count)
+		run_group (w, count);
+	return NULL;
+}
+
+static int compare_latency (const void * a, const void * b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of the sorted latencies, in milliseconds */
+static double percentile (double * sorted, size_t n, int p)
+{
+	size_t rank = (n*p + 99)/100;
+	return 1000*sorted[rank ? rank-1 : 0];
+}
+
+static void report (BATCH * b, double elapsed)
+{
+	double * latency;
+	size_t i, failed = 0;
+	for (i=0;i<b->job_count;i++) {
+		JOB * j = b->jobs + i;
+		if (j->error) {
+			fprintf (stderr, "%s:%i: %s", b->opt->batch_file, j->line, j->error);
+			failed++;
+		}
+	}
+	fprintf (stderr, "%s: %lu jobs (%lu failed) on %lu workers in %.3fs, %.1f jobs/s\n",
+	         PROG_NAME, (unsigned long)b->job_count, (unsigned long)failed,
+	         (unsigned long)b->worker_count, elapsed, elapsed > 0 ? b->job_count/elapsed : 0);
+	if (!b->job_count)
+		return;
+	latency = xmalloc (b->job_count*sizeof(double));
+	for (i=0;i<b->job_count;i++)
+		latency[i] = b->jobs[i].latency;
+	qsort (latency, b->job_count, sizeof(double), compare_latency);
+	fprintf (stderr, "%s: latency p50 %.3fms p90 %.3fms p99 %.3fms max %.3fms\n", PROG_NAME,
+	         percentile (latency, b->job_count, 50), percentile (latency, b->job_count, 90),
+	         percentile (latency, b->job_count, 99), percentile (latency, b->job_count, 100));
+	xfree (latency);
+}
+
+int run_batch (OPTIONS * opt)
+{
+	BATCH b;
+	size_t i;
+	double start;
+
+	if (opt->file_count || opt->output_file)
+		bail ("Input and output files are given in the batch manifest\n");
+	b.opt = opt;
+	b.cache = opt->cache_dir ? cache_open (opt->cache_dir, opt->cache_size*1024*1024) : NULL;
+	load_manifest (&b, opt->batch_file);
+	b.worker_count = opt->jobs;
+	if (!b.worker_count) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		b.worker_count = cpus > 0 ? (size_t)cpus : 1;
+	}
+	if (b.worker_count > b.job_count)
+		b.worker_count = b.job_count ? b.job_count : 1;
+	b.workers = xmalloc (b.worker_count*sizeof(WORKER));
+
+	start = now ();
+	for (i=0;i<b.worker_count;i++) {
+		WORKER * w = b.workers + i;
+		w->id = i;
+		w->batch = &b;
+		w->output = stream_create (1024);
+		w->scratch = stream_create (1024);
+		w->io = NULL;
+		w->inputs = NULL;
+		w->input_count = w->input_size = 0;
+		if (strcmp (opt->io_engine, "stdio")) {
+			size_t k;
+			w->io = io_engine_open (opt->io_engine);
+			for (k=0;k<IO_GROUP;k++)
+				w->group[k].output = stream_create (1024);
+		}
+		pthread_mutex_init (&w->queue.lock, NULL);
+		w->queue.head = i*b.job_count/b.worker_count;
+		w->queue.tail = (i+1)*b.job_count/b.worker_count;
+	}
+	for (i=0;i<b.worker_count;i++)
+		if (pthread_create (&b.workers[i].thread, NULL, worker_main, b.workers + i))
+			bail ("Unable to start a worker thread\n");
+	for (i=0;i<b.worker_count;i++)
+		pthread_join (b.workers[i].thread, NULL);
+	report (&b, now () - start);
+	if (b.cache) {
+		cache_report (b.cache);
+		cache_close (b.cache);
+	}
+
+	for (i=0;i<b.worker_count;i++) {
+		stream_free (b.workers[i].output);
+		stream_free (b.workers[i].scratch);
+		if (b.workers[i].io) {
+			WORKER * w = b.workers + i;
+			size_t k;
+			io_engine_close (w->io);
+			for (k=0;k<IO_GROUP;k++)
+				stream_free (w->group[k].output);
+			for (k=0;k<w->input_size;k++)
+				stream_free (w->inputs[k].data);
+			xfree (w->inputs);
+		}
+		pthread_mutex_destroy (&b.workers[i].queue.lock);
+	}
+	for (i=0;i<b.job_count;i++) {
+		xfree (b.jobs[i].argv);
+		if (b.jobs[i].error)
+			xfree (b.jobs[i].error);
+	}
+	xfree (b.jobs);
+	xfree (b.workers);
+	free (b.manifest);
+	return 1;
+}
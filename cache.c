@@ -0,0 +1,404 @@
+/*
+ * Compile cache - HS
+ * Songs are looked up by a hash of their notation and of every option
+ * that changes the midi file. An entry is the midi file behind a short
+ * header holding the time it took to compile, so a hit can say how much
+ * time it saved. Entries are written to a temporary file and renamed
+ * into place, so readers never see half an entry. A hit touches the
+ * entry, and when cmc is done the entries used longest ago are removed
+ * until the cache fits in its size.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include "stream.h"
+#include "util.h"
+#include "hash.h"
+#include "cache.h"
+
+/* change this whenever the encoder's output changes, so that old
+ * entries are no longer found */
+#define CACHE_FORMAT "cmc cache 6"
+#define CACHE_MAGIC  "CMC\001"
+#define HEADER_SIZE  8
+#define KEY_SIZE     16
+#define COPY_SIZE    (64*1024)
+
+struct cache_t
+{
+	char * dir;
+	unsigned long max_size;    /* bytes */
+	unsigned long hits;
+	unsigned long misses;
+	double saved;              /* compile time the hits saved, in seconds */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;      /* batch workers share the counts */
+#endif
+};
+
+struct cache_entry_t
+{
+	char name[KEY_SIZE+5];
+	off_t size;
+	time_t used;
+};
+
+typedef struct cache_entry_t CACHE_ENTRY;
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+CACHE * cache_open (char * dir, unsigned long max_size)
+{
+	CACHE * c;
+	if (mkdir (dir, 0777) < 0 && errno != EEXIST)
+		bail ("Unable to create the cache directory %s:%s\n",dir,strerror (errno));
+	c = xmalloc (sizeof(CACHE));
+	c->dir = dir;
+	c->max_size = max_size;
+	c->hits = 0;
+	c->misses = 0;
+	c->saved = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init (&c->lock, NULL);
+#endif
+	return c;
+}
+
+static void count (CACHE * c, int hit, double saved)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock (&c->lock);
+#endif
+	if (hit) {
+		c->hits++;
+		c->saved += saved;
+	} else
+		c->misses++;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock (&c->lock);
+#endif
+}
+
+/* the key covers the notation and every option that shows up in the
+ * midi file. 'scratch' is free until the song is encoded */
+static void cache_key (OPTIONS * opt, char ** track_text, size_t track_count,
+                       STREAM * scratch, char * key)
+{
+	char line[512];
+	size_t i;
+	HASH h;
+	stream_write_reset (scratch);
+	sprintf (line, "%s\n%lu %i %i %.64s %i %i %.64s %lu %.64s %lu %i %.64s\n", CACHE_FORMAT,
+	         opt->divisions, opt->auto_divisions, opt->speed,
+	         opt->instrument ? opt->instrument : "-", opt->portamento,
+	         opt->include_thalam, opt->thalam_name, opt->thalam_channel,
+	         opt->thalam_instrument ? opt->thalam_instrument : "-",
+	         opt->curve_events, opt->curve_error, opt->tuning_name);
+	stream_add_str (scratch, line);
+	for (i=0;i<track_count;i++) {
+		size_t len = strlen (track_text[i]);
+		sprintf (line, "%lu\n", (unsigned long)len);
+		stream_add_str (scratch, line);
+		stream_write (scratch, track_text[i], len);
+	}
+	h = hash64 (scratch->buffer, scratch->size, 0);
+	sprintf (key, "%08lx%08lx", (unsigned long)(h>>32), (unsigned long)(h & 0xFFFFFFFFUL));
+}
+
+static int write_all (int fd, const char * data, size_t len)
+{
+	while (len) {
+		ssize_t n = write (fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* copy the rest of 'in' to 'out'. The kernel does the copying if it
+ * can, which lets filesystems that support it share the blocks */
+static int copy_fd (int in, int out, size_t len)
+{
+	char buffer[COPY_SIZE];
+#ifdef HAVE_COPY_FILE_RANGE
+	while (len) {
+		ssize_t n = copy_file_range (in, NULL, out, NULL, len, 0);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+#endif
+	while (len) {
+		ssize_t n = read (in, buffer, len < COPY_SIZE ? len : COPY_SIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || !write_all (out, buffer, n))
+			return 0;
+		len -= n;
+	}
+	return 1;
+}
+
+static int open_output (char * output_file)
+{
+	int fd;
+	if (!output_file || !strcmp (output_file, "-"))
+		return STDOUT_FILENO;
+	fd = open (output_file, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+		bail ("Unable to write file:%s\n",output_file);
+	return fd;
+}
+
+/* copy the entry to the output. Returns 0 if there is no entry */
+static int fetch (CACHE * c, char * path, char * output_file)
+{
+	unsigned char head[HEADER_SIZE];
+	struct stat st;
+	double start = now (), compiled;
+	int in, out, ok;
+	in = open (path, O_RDONLY);
+	if (in < 0)
+		return 0;
+	if (fstat (in, &st) < 0 || st.st_size < HEADER_SIZE
+	    || read (in, head, HEADER_SIZE) != HEADER_SIZE || memcmp (head, CACHE_MAGIC, 4)) {
+		close (in);
+		return 0;
+	}
+	compiled = ((unsigned long)head[4]<<24 | (unsigned long)head[5]<<16
+	           | (unsigned long)head[6]<<8 | head[7])/1e6;
+	out = open_output (output_file);
+	ok = copy_fd (in, out, st.st_size - HEADER_SIZE);
+	close (in);
+	if (out != STDOUT_FILENO)
+		close (out);
+	if (!ok)
+		bail ("Unable to write file:%s\n",output_file ? output_file : "-");
+	utime (path, NULL);
+	count (c, 1, compiled - (now () - start));
+	return 1;
+}
+
+static void store (CACHE * c, char * path, STREAM * output, double seconds)
+{
+	unsigned char head[HEADER_SIZE];
+	unsigned long us = seconds*1e6 > 0xFFFFFFFFUL ? 0xFFFFFFFFUL : (unsigned long)(seconds*1e6);
+	char * temp = xmalloc (strlen (c->dir) + 16);
+	int fd;
+	sprintf (temp, "%s/.new-XXXXXX", c->dir);
+	fd = mkstemp (temp);
+	if (fd < 0) {
+		xfree (temp);
+		return;
+	}
+	fchmod (fd, 0644);
+	memcpy (head, CACHE_MAGIC, 4);
+	head[4] = (unsigned char)(us>>24);
+	head[5] = (unsigned char)(us>>16);
+	head[6] = (unsigned char)(us>>8);
+	head[7] = (unsigned char)us;
+	if (write_all (fd, (char *)head, HEADER_SIZE) && write_all (fd, output->buffer, output->size)
+	    && !close (fd))
+		rename (temp, path);
+	else {
+		close (fd);
+		unlink (temp);
+	}
+	xfree (temp);
+}
+
+/* encode the song, or take it from the cache, and write it out */
+void cache_compile (CACHE * c, OPTIONS * opt, char ** track_text, size_t track_count,
+                    STREAM * output, STREAM * scratch)
+{
+	char key[KEY_SIZE+1];
+	char * path;
+	double start;
+	cache_key (opt, track_text, track_count, scratch, key);
+	path = xmalloc (strlen (c->dir) + KEY_SIZE + 6);
+	bail_hold (path, free);
+	sprintf (path, "%s/%s.mid", c->dir, key);
+	if (fetch (c, path, opt->output_file)) {
+		bail_drop (path);
+		xfree (path);
+		return;
+	}
+	start = now ();
+	encode_file (opt, track_text, track_count, output, scratch);
+	if (!opt->output_file || !strcmp (opt->output_file, "-"))
+		stream_write_to_io (output, stdout);
+	else if (!stream_write_to_file (output, opt->output_file))
+		bail ("Unable to write file:%s\n",opt->output_file);
+	store (c, path, output, now () - start);
+	count (c, 0, 0);
+	bail_drop (path);
+	xfree (path);
+}
+
+static int is_entry (char * name)
+{
+	size_t i;
+	for (i=0;i<KEY_SIZE;i++)
+		if (!strchr ("0123456789abcdef", name[i]) || !name[i])
+			return 0;
+	return !strcmp (name + KEY_SIZE, ".mid");
+}
+
+/* read the entries of the cache. Returns how many there are */
+static size_t list_entries (char * dir, CACHE_ENTRY ** entries, off_t * total)
+{
+	DIR * d = opendir (dir);
+	struct dirent * de;
+	size_t n = 0, size = 16;
+	char * path = xmalloc (strlen (dir) + KEY_SIZE + 6);
+	*entries = xmalloc (size*sizeof(CACHE_ENTRY));
+	*total = 0;
+	while (d && (de = readdir (d))) {
+		struct stat st;
+		if (!is_entry (de->d_name))
+			continue;
+		sprintf (path, "%s/%s", dir, de->d_name);
+		if (stat (path, &st) < 0)
+			continue;
+		if (n == size) {
+			size *= 2;
+			*entries = xrealloc (*entries, size*sizeof(CACHE_ENTRY));
+		}
+		strcpy ((*entries)[n].name, de->d_name);
+		(*entries)[n].size = st.st_size;
+		(*entries)[n].used = st.st_mtime;
+		*total += st.st_size;
+		n++;
+	}
+	if (d)
+		closedir (d);
+	xfree (path);
+	return n;
+}
+
+static int compare_used (const void * a, const void * b)
+{
+	time_t x = ((const CACHE_ENTRY *)a)->used, y = ((const CACHE_ENTRY *)b)->used;
+	return x < y ? -1 : x > y;
+}
+
+/* remove the entries used longest ago until the cache fits */
+static void evict (CACHE * c)
+{
+	CACHE_ENTRY * entries;
+	off_t total;
+	size_t i, n = list_entries (c->dir, &entries, &total);
+	char * path = xmalloc (strlen (c->dir) + KEY_SIZE + 6);
+	if ((unsigned long)total > c->max_size)
+		qsort (entries, n, sizeof(CACHE_ENTRY), compare_used);
+	for (i=0;i<n && (unsigned long)total > c->max_size;i++) {
+		sprintf (path, "%s/%s", c->dir, entries[i].name);
+		if (!unlink (path))
+			total -= entries[i].size;
+	}
+	xfree (path);
+	xfree (entries);
+}
+
+/* the counts of all the runs that used the cache are kept in its
+ * stats file as "hits misses microseconds-saved" */
+static int open_stats (char * dir, int flags, unsigned long * counts)
+{
+	struct flock lock;
+	char * path = xmalloc (strlen (dir) + 8);
+	char buffer[96];
+	ssize_t n;
+	int fd;
+	sprintf (path, "%s/stats", dir);
+	fd = open (path, flags, 0666);
+	xfree (path);
+	counts[0] = counts[1] = counts[2] = 0;
+	if (fd < 0)
+		return -1;
+	memset (&lock, 0, sizeof(lock));
+	lock.l_type = flags == O_RDONLY ? F_RDLCK : F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	while (fcntl (fd, F_SETLKW, &lock) < 0 && errno == EINTR)
+		;
+	n = read (fd, buffer, sizeof(buffer)-1);
+	if (n > 0) {
+		buffer[n] = '\0';
+		sscanf (buffer, "%lu %lu %lu", counts, counts + 1, counts + 2);
+	}
+	return fd;
+}
+
+/* add this run's counts to the stats file and trim the cache */
+void cache_close (CACHE * c)
+{
+	unsigned long counts[3];
+	int fd = open_stats (c->dir, O_RDWR|O_CREAT, counts);
+	if (fd >= 0) {
+		char line[96];
+		counts[0] += c->hits;
+		counts[1] += c->misses;
+		if (c->saved > 0)
+			counts[2] += (unsigned long)(c->saved*1e6);
+		sprintf (line, "%lu %lu %lu\n", counts[0], counts[1], counts[2]);
+		if (!ftruncate (fd, 0) && lseek (fd, 0, SEEK_SET) == 0)
+			write_all (fd, line, strlen (line));
+		close (fd);
+	}
+	evict (c);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy (&c->lock);
+#endif
+	xfree (c);
+}
+
+static void print_counts (char * what, unsigned long hits, unsigned long misses, double saved)
+{
+	unsigned long total = hits + misses;
+	fprintf (stderr, "%s: %s %lu hits %lu misses (%.1f%% hits), %.3fs saved\n", PROG_NAME, what,
+	         hits, misses, total ? 100.0*hits/total : 0.0, saved);
+}
+
+/* the counts of this run */
+void cache_report (CACHE * c)
+{
+	print_counts ("cache", c->hits, c->misses, c->saved);
+}
+
+/* the counts of every run so far and what the cache holds */
+void cache_stats (char * dir)
+{
+	unsigned long counts[3];
+	CACHE_ENTRY * entries;
+	off_t total;
+	size_t n;
+	int fd = open_stats (dir, O_RDONLY, counts);
+	if (fd >= 0)
+		close (fd);
+	print_counts ("cache total", counts[0], counts[1], counts[2]/1e6);
+	n = list_entries (dir, &entries, &total);
+	fprintf (stderr, "%s: %lu entries, %.1fkB in %s\n", PROG_NAME, (unsigned long)n, total/1024.0, dir);
+	xfree (entries);
+}
@@ -0,0 +1,20 @@
+/* Compile cache
+ * HS
+ */
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "stream.h"
+#include "cmc.h"
+
+struct cache_t;
+typedef struct cache_t CACHE;
+
+CACHE * cache_open    (char * dir, unsigned long max_size);
+void    cache_close   (CACHE * cache);
+void    cache_compile (CACHE * cache, OPTIONS * opt, char ** track_text, size_t track_count,
+                       STREAM * output, STREAM * scratch);
+void    cache_report  (CACHE * cache);
+void    cache_stats   (char * dir);
+
+#endif /* _CACHE_H_ */
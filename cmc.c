@@ -4,35 +4,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "stream.h"
 #include "midi.h"
 #include "util.h"
 #include "scanner.h"
+#include "thalam.h"
+#include "curve.h"
+#include "raga.h"
+#include "hash.h"
+#include "cmc.h"
 #include <assert.h>
 
-#ifdef HAVE_ISATTY
-#	include <unistd.h>
-#endif
-
 
-#define MAX_TRACK_COUNT 4
 #define EXTRA_CHANNEL 5 
+#define EXTRA_INSTRUMENT 104
 
 #define DEF_INSTRUMENT 0x0
 #define DEFAULT_SPEED 30
+#define DEFAULT_DIVISIONS 96
+#define DEFAULT_TEMPO 500000 /* microseconds per quarter note */
+#define MAX_DIVISIONS 0x7FFF
+#define MAX_NADAI 16
+#define DEFAULT_CURVE_EVENTS 24
+#define DEFAULT_CURVE_ERROR 1
+#define DEFAULT_CACHE_SIZE 64 /* megabytes */
+#define DEFAULT_WATCH_DELAY 3 /* milliseconds */
 
+void options_init (OPTIONS * opt)
+{
+	opt->file_count = 0;
+	opt->output_file = NULL;
+	opt->divisions = DEFAULT_DIVISIONS;
+	opt->auto_divisions = 0;
+	opt->instrument = NULL;
+	opt->portamento = 1;
+	opt->include_thalam = 0;
+	opt->thalam_name = "adi";
+	opt->thalam_channel = EXTRA_CHANNEL;
+	opt->thalam_instrument = NULL;
+	opt->speed = DEFAULT_SPEED;
+	opt->curve_events = DEFAULT_CURVE_EVENTS;
+	opt->curve_error = DEFAULT_CURVE_ERROR;
+	opt->tuning_name = "bend";
+	opt->batch_file = NULL;
+	opt->serve_path = NULL;
+	opt->jobs = 0;
+	opt->cache_dir = NULL;
+	opt->cache_size = DEFAULT_CACHE_SIZE;
+	opt->cache_stats = 0;
+	opt->io_engine = "stdio";
+	opt->max_memory = 0;
+	opt->watch = 0;
+	opt->watch_delay = DEFAULT_WATCH_DELAY;
+	opt->pipeline = 0;
+	opt->parallel = 0;
+}
 
-static unsigned int file_count = 0;
-static char * in_files[MAX_TRACK_COUNT];
-
-/* global parameters set by the command-line */
-static char * output_file = NULL;
-static unsigned long divisions = 96;
-static char * instrument = NULL;
-static int portamento = 1;
-static int include_thalam = 0;
-static int speed = DEFAULT_SPEED;
 void simple_usage()
 {
 	fprintf (stderr, "%s: usage %s [notation_files] [-o midi_file]\n",PROG_NAME,PROG_NAME);
@@ -47,18 +76,49 @@ void print_usage()
 	fprintf (stderr, "  -V, --version                    Show program version info and exit\n");
 	fprintf (stderr, "  -h, --help                       Show this screen and exit\n");
 	fprintf (stderr, "Output Options:\n");
-	fprintf (stderr, "  -d, --divisions                  Ticks per Quarter Note\n");
+	fprintf (stderr, "  -d, --divisions <value|auto>     Ticks per Quarter Note, or the fewest that fit the song\n");
 	/* TODO: Speed */
 	fprintf (stderr, "  -s, --speed <value>              Default tempo\n");
 	fprintf (stderr, "  -i, --instrument <instrument>    Default instruments to use\n");
 	fprintf (stderr, "  -p, --portamento                 Generate portamento events when required\n");
 	fprintf (stderr, "  --no-portamento                  Don't generate portamento events ever\n");
-/* Thalam support is extremely crappy so it's been temporarily removed */
+	fprintf (stderr, "Gamaka and Ramp Options:\n");
+	fprintf (stderr, "  --curve-events <n>               Most curve events per quarter note on a channel (%i)\n",DEFAULT_CURVE_EVENTS);
+	fprintf (stderr, "  --curve-error <percent>          Largest deviation allowed from a curve (%i)\n",DEFAULT_CURVE_ERROR);
+	fprintf (stderr, "Tuning Options:\n");
+	fprintf (stderr, "  --tuning <bend|mts>              Tune the ragas with pitch bends or tuning messages (bend)\n");
+	fprintf (stderr, "  --dump-ragas                     Dump a list of the supported ragas to stdout and exit\n");
+	fprintf (stderr, "Memory Options:\n");
+	fprintf (stderr, "  --max-memory <megabytes>         Most memory to use, spilling the midi file to disk (no limit)\n");
+	fprintf (stderr, "Cache Options:\n");
+	fprintf (stderr, "  --cache <dir>                    Keep compiled songs in a directory and reuse them\n");
+	fprintf (stderr, "  --cache-size <megabytes>         Largest size of the cache (%i)\n",DEFAULT_CACHE_SIZE);
+	fprintf (stderr, "  --cache-stats                    Show how well the cache has done and exit\n");
+#ifdef HAVE_PTHREAD
+	fprintf (stderr, "Batch Options:\n");
+	fprintf (stderr, "  --batch <manifest>               Compile every line of the manifest as a command line\n");
+	fprintf (stderr, "  --jobs <n>                       Worker threads for --batch (one per cpu by default)\n");
+	fprintf (stderr, "  --io <stdio|threads|uring>       How --batch reads and writes its files (stdio)\n");
+	fprintf (stderr, "  --pipeline                       Read, scan, encode and write the song on threads of their own\n");
+	fprintf (stderr, "  --parallel                       Encode the tracks on threads of their own\n");
+#endif
+#ifdef HAVE_EPOLL
+	fprintf (stderr, "Server Options:\n");
+	fprintf (stderr, "  --serve <socket>                 Compile the notation sent to a unix socket\n");
+	fprintf (stderr, "  --jobs <n>                       Worker threads for --serve (one per cpu by default)\n");
+#endif
+#ifdef HAVE_INOTIFY
+	fprintf (stderr, "Watch Options:\n");
+	fprintf (stderr, "  --watch                          Compile again every time a notation file is saved\n");
+	fprintf (stderr, "  --watch-delay <ms>               Time to wait for the rest of a save (%i)\n",DEFAULT_WATCH_DELAY);
+#endif
 #ifdef HAVE_THALAM
 	fprintf (stderr, "Thalam Options:\n");
 	fprintf (stderr, "  -t, --thalam                     Include a thalam track\n");
+	fprintf (stderr, "  --thalam-cycle <name>            Thalam to use (adi by default)\n");
 	fprintf (stderr, "  --thalam-channel <number>        Channel number to be used for thalam\n");
 	fprintf (stderr, "  --thalam-instrument <instrument> Instrument to be used for thalams\n");
+	fprintf (stderr, "  --dump-thalams                   Dump a list of the supported thalams to stdout and exit\n");
 #endif
 }
 
@@ -71,6 +131,20 @@ void dump_instruments ()
 	}
 }
 
+void dump_ragas ()
+{
+	const RAGA_TABLE * r;
+	for (r=ragas;r->name;r++)
+		printf ("%-16s %s\n", r->name, r->swaras);
+}
+
+void dump_thalams ()
+{
+	const THALAM_CYCLE * c;
+	for (c=thalam_cycles;c->name;c++)
+		printf ("%-14s %s\n", c->name, c->beats);
+}
+
 #define FLAG(txt,var,val) if (!strcmp(txt,*argv)) {\
 								var = val;\
 								argv++;\
@@ -81,7 +155,7 @@ void dump_instruments ()
 							argv++; \
 							if (!*argv) \
 								bail("The %s option requires an argument\n",txt); \
-							var = xstrdup(*argv); \
+							var = *argv; \
 							argv++; \
 							continue; \
 	                    }
@@ -93,31 +167,74 @@ void dump_instruments ()
 							argv++; \
 							continue; \
 	                    }
-int parse_args (int argc, char ** argv)
+/* the arguments are parsed up to the terminating NULL. The options
+ * point into them, so they have to last as long as the options do */
+int parse_args (OPTIONS * opt, char ** argv)
 {
-	argv++;
 	while ((*argv)!=NULL) {
 		if (**argv == '-') {
-			VARSTR("-o",output_file);
-			VARSTR("--output",output_file);
+			VARSTR("-o",opt->output_file);
+			VARSTR("--output",opt->output_file);
 
-			VARINT("-d",divisions);
-			VARINT("--divisions",divisions);
+			if ((!strcmp("-d",*argv) || !strcmp("--divisions",*argv))
+			    && argv[1] && !strcmp("auto",argv[1])) {
+				opt->auto_divisions = 1;
+				argv += 2;
+				continue;
+			}
+			VARINT("-d",opt->divisions);
+			VARINT("--divisions",opt->divisions);
 
-			VARINT("-s",speed);
-			VARINT("--speed",speed);
+			VARINT("-s",opt->speed);
+			VARINT("--speed",opt->speed);
 
-			VARSTR("-i",instrument);
-			VARSTR("--instrument",instrument);
+			VARSTR("-i",opt->instrument);
+			VARSTR("--instrument",opt->instrument);
 
-			FLAG("-p",portamento,1);
-			FLAG("--portamento",portamento,1);
+			FLAG("-p",opt->portamento,1);
+			FLAG("--portamento",opt->portamento,1);
 
-			FLAG("--no-portamento",portamento,0);
+			FLAG("--no-portamento",opt->portamento,0);
+
+			VARINT("--curve-events",opt->curve_events);
+			VARINT("--curve-error",opt->curve_error);
+
+			VARSTR("--tuning",opt->tuning_name);
+
+			VARSTR("--cache",opt->cache_dir);
+			VARINT("--cache-size",opt->cache_size);
+			VARINT("--max-memory",opt->max_memory);
+			FLAG("--cache-stats",opt->cache_stats,1);
+
+#ifdef HAVE_PTHREAD
+			VARSTR("--batch",opt->batch_file);
+			VARINT("--jobs",opt->jobs);
+			VARSTR("--io",opt->io_engine);
+			FLAG("--pipeline",opt->pipeline,1);
+			FLAG("--parallel",opt->parallel,1);
+#endif
+#ifdef HAVE_EPOLL
+			VARSTR("--serve",opt->serve_path);
+#endif
+#ifdef HAVE_INOTIFY
+			FLAG("--watch",opt->watch,1);
+			VARINT("--watch-delay",opt->watch_delay);
+#endif
+			if (!strcmp("--dump-ragas",*argv)) {
+				dump_ragas();
+				return 0;
+			}
 
 #ifdef HAVE_THALAM
-		    FLAG("-t",include_thalam,1);
-			FLAG("--thalam",include_thalam,1);
+		    FLAG("-t",opt->include_thalam,1);
+			FLAG("--thalam",opt->include_thalam,1);
+			VARSTR("--thalam-cycle",opt->thalam_name);
+			VARINT("--thalam-channel",opt->thalam_channel);
+			VARSTR("--thalam-instrument",opt->thalam_instrument);
+			if (!strcmp("--dump-thalams",*argv)) {
+				dump_thalams();
+				return 0;
+			}
 #endif
 
 			if ((!strcmp("-h",*argv))||(!strcmp("--help",*argv))) {
@@ -131,9 +248,9 @@ int parse_args (int argc, char ** argv)
 
 			bail ("Unrecognized option:%s\n",*argv);
 		}else {
-			if (file_count >= MAX_TRACK_COUNT) 
+			if (opt->file_count >= MAX_TRACK_COUNT) 
 				bail("Too many tracks. You can only specify %i\n",MAX_TRACK_COUNT);
-			in_files[file_count++] = *argv;
+			opt->in_files[opt->file_count++] = *argv;
 			argv++;
 		}
 	}
@@ -142,9 +259,10 @@ int parse_args (int argc, char ** argv)
 void encode_lyric (MIDI_TRACK * mt, char * lyric, size_t len)
 {
 	MIDI_EVENT me;
+	META_EVENT meta;
 	me.delta_time = 0;
 	me.type = EVENT_TYPE_META;
-	me.event.meta_event = malloc(sizeof(META_EVENT));
+	me.event.meta_event = &meta;
 	me.event.meta_event->type = META_EVENT_LYRIC;
 	me.event.meta_event->length = len;
 	me.event.meta_event->data = lyric;
@@ -157,20 +275,291 @@ unsigned char note_map2 (char * n)
 	int i;
 	for (i=0;i<12;i++)
 		if (*n == notes[i]) {
-			unsigned char base = (unsigned char)i;
-			int octave = 0;
-			if (*(n+1)=='+' || *(n+1)=='-'){
-				if (*(n+1)=='+') octave++;
-				else octave--;
+			int note = i + 0x3C;
+			while (*++n == '+')
+				note += 12;
+			while (*n == '-') {
+				note -= 12;
+				n++;
 			}
-			return (unsigned char)((base+0x3C) + (unsigned char)octave*(unsigned char)12);
+			return note < 0 || note > 0x7F ? 0xFF : (unsigned char)note;
 		}
 	return 0xFF;
 }
+/* A fragment is a run of notation encoded once and copied into the
+ * track every time it is played. What depends on where it is played is
+ * written at splice time: the delta of its first timed event, the
+ * glide controllers of its first note and the note-off of the note
+ * left sounding before it */
+struct fragment_t
+{
+	char * name;           /* name of the phrase, NULL for repeat blocks */
+	STREAM * bytes;
+	int has_lead;
+	size_t lead_at;        /* offset of the (zero) delta of the first timed event */
+	unsigned long lead;    /* ticks before the first timed event */
+	int has_note;
+	size_t glide_at;       /* offset of the glide controllers of the first note */
+	unsigned long glide_delta;
+	int shifted;           /* the first note is a glide */
+	long bend;             /* the tuning of the first note */
+	size_t note_at;        /* offset of the note-on of the first note */
+	size_t off_at;         /* where the note-off of the previous note goes */
+	unsigned long trail;   /* ticks after the last timed event */
+	unsigned long ticks;   /* length of the fragment */
+	unsigned char last;    /* the note left sounding at the end */
+	long last_bend;
+	const RAGA_TABLE * raga; /* the raga in force at the end */
+	int raga_set;          /* it changes the raga */
+	int nadai;
+	int nadai_set;         /* it changes the nadai */
+	int gamaka;            /* the last note is still oscillating */
+	int shift;             /* a glide or gamaka is left for the note after it */
+	int tilde;
+	int phrases;           /* it defines or plays phrases */
+	STREAM * tape;         /* the tokens of a repeat block or phrase */
+	const RAGA_TABLE * start_raga; /* the raga and nadai it was recorded in */
+	int start_nadai;
+	CURVE curve;
+	unsigned long curve_time;
+	CURVE_BUDGET budget;
+	struct fragment_t * next;
+};
+
+#define MAX_CURVES 4
+
+/* state carried from one note to the next while encoding a track */
+struct encoder_t
+{
+	OPTIONS * opt;
+	MIDI_TRACK * mt;
+	unsigned char channel;
+	unsigned long delta_time;  /* ticks since the last event was written */
+	unsigned long ticks;       /* length of the track so far */
+	unsigned char prev;        /* the note currently sounding, 0 if none */
+	int note_shift;            /* the next note is a glide */
+	int gamaka;                /* the next note is a gamaka */
+	const RAGA_TABLE * raga;
+	int raga_set;              /* a raga directive has been encoded */
+	long bend;                 /* pitch bend the channel rests at */
+	int nadai;                 /* notes to a beat */
+	int nadai_set;             /* a nadai directive has been encoded */
+	unsigned long akshara;     /* length of a note */
+	CURVE curves[MAX_CURVES];  /* active ramps and gamakas */
+	int curve_count;
+	unsigned long curve_time;  /* the curves have been written up to here */
+	CURVE_BUDGET budget;
+	struct fragment_t * frag;  /* the fragment being recorded, if any */
+	struct fragment_t ** phrases;
+	char * define;             /* phrase started by the last directive */
+	char * play;               /* phrase played by the last directive */
+	int end;                   /* the last directive ended a phrase */
+	int phrase_used;           /* a phrase was defined or played */
+};
+
+typedef struct fragment_t FRAGMENT;
+typedef struct encoder_t  ENCODER;
+
+static void encoder_init (ENCODER * e, OPTIONS * opt, MIDI_TRACK * mt, unsigned char channel, FRAGMENT ** phrases)
+{
+	e->opt = opt;
+	e->mt = mt;
+	e->channel = channel;
+	e->delta_time = 0;
+	e->ticks = 0;
+	e->prev = 0;
+	e->note_shift = 0;
+	e->gamaka = 0;
+	e->raga = NULL;
+	e->raga_set = 0;
+	e->bend = PITCH_BEND_CENTER;
+	e->nadai = 4;
+	e->nadai_set = 0;
+	e->akshara = opt->beat/4;
+	e->curve_count = 0;
+	e->curve_time = 0;
+	curve_budget_init (&e->budget, opt->divisions, opt->curve_events, opt->curve_error);
+	e->frag = NULL;
+	e->phrases = phrases;
+	e->define = NULL;
+	e->play = NULL;
+	e->end = 0;
+	e->phrase_used = 0;
+}
+
+/* The first timed event of a fragment is written with a zero delta
+ * which splice_fragment replaces */
+static unsigned long lead_delta (ENCODER * e, unsigned long delta_time)
+{
+	FRAGMENT * f = e->frag;
+	if (!f || f->has_lead)
+		return delta_time;
+	f->has_lead = 1;
+	f->lead = delta_time;
+	f->lead_at = e->mt->stream->size;
+	return 0;
+}
+
+static void encode_curve_event (ENCODER * e, CURVE * c, unsigned long t, long value)
+{
+	unsigned long d = t - (e->ticks - e->delta_time);
+	if (c->type == VOICE_EVENT_PITCH_BEND)
+		encode_voice (e->mt, lead_delta (e, d), e->channel, VOICE_EVENT_PITCH_BEND,
+		              (unsigned char)(value & 0x7F), (unsigned char)(value >> 7));
+	else
+		encode_voice (e->mt, lead_delta (e, d), e->channel, VOICE_EVENT_CONTROLLER,
+		              c->controller, (unsigned char)value);
+	e->delta_time -= d;
+}
+
+/* write the curve events that fall before 'upto' and finish the ramps
+ * that are over by then, going from one event to the next */
+static void flush_curves (ENCODER * e, unsigned long upto)
+{
+	while (e->curve_count) {
+		unsigned long t = upto, at;
+		long v = 0, value;
+		int i, next = -1, ends = 0;
+		for (i=0;i<e->curve_count;i++) {
+			CURVE * c = e->curves + i;
+			unsigned long until = t;
+			int over = c->shape == CURVE_RAMP && c->start + c->length < until;
+			if (over)
+				until = c->start + c->length;
+			if (curve_next (c, &e->budget, e->curve_time, until, &at, &value)) {
+				t = at;
+				v = value;
+				next = i;
+				ends = 0;
+			} else if (over) {
+				t = until;
+				next = i;
+				ends = 1;
+			}
+		}
+		if (next < 0)
+			break;
+		e->curve_time = t;
+		if (ends) {
+			/* the ramp is over: it settles on its last value */
+			CURVE * c = e->curves + next;
+			if (c->emitted != c->to) {
+				encode_curve_event (e, c, t, c->to);
+				curve_emit (c, &e->budget, t, c->to);
+			}
+			e->curves[next] = e->curves[--e->curve_count];
+		} else {
+			encode_curve_event (e, e->curves + next, t, v);
+			curve_emit (e->curves + next, &e->budget, t, v);
+		}
+	}
+	e->curve_time = upto;
+}
+
+/* bring the curves up to now and stop those of the given shapes,
+ * leaving them at their final value */
+static void end_curves (ENCODER * e, int shapes)
+{
+	int i;
+	flush_curves (e, e->ticks);
+	for (i=0;i<e->curve_count;i++) {
+		CURVE * c = e->curves + i;
+		if (!(c->shape & shapes))
+			continue;
+		if (c->emitted != curve_final (c)) {
+			encode_curve_event (e, c, e->ticks, curve_final (c));
+			curve_emit (c, &e->budget, e->ticks, curve_final (c));
+		}
+		e->curves[i--] = e->curves[--e->curve_count];
+	}
+}
+
+static void add_curve (ENCODER * e, CURVE * c)
+{
+	if (e->curve_count >= MAX_CURVES)
+		bail ("Too many curves at once\n");
+	e->curves[e->curve_count++] = *c;
+}
+
+/* start ramping a controller from now over 'length' ticks */
+static void start_ramp (ENCODER * e, unsigned char controller, long from, long to, unsigned long length)
+{
+	CURVE c;
+	c.shape = CURVE_RAMP;
+	c.type = VOICE_EVENT_CONTROLLER;
+	c.controller = controller;
+	c.from = from;
+	c.to = to;
+	c.range = 0x80;
+	c.start = e->ticks;
+	c.length = length;
+	curve_start (&c, &e->budget);
+	encode_curve_event (e, &c, e->ticks, length ? from : to);
+	curve_emit (&c, &e->budget, e->ticks, length ? from : to);
+	if (length)
+		add_curve (e, &c);
+}
+
+/* a kampita: oscillate up to the next semitone once every akshara for
+ * as long as the note is held */
+static void start_gamaka (ENCODER * e)
+{
+	CURVE c;
+	c.shape = CURVE_KAMPITA;
+	c.type = VOICE_EVENT_PITCH_BEND;
+	c.controller = 0;
+	c.from = e->bend;
+	c.to = e->bend + PITCH_BEND_SEMITONE;
+	if (c.to > 0x3FFF)
+		c.to = 0x3FFF;
+	c.range = 2*PITCH_BEND_CENTER;
+	c.start = e->ticks;
+	c.length = e->akshara;
+	c.emitted = e->bend;
+	curve_start (&c, &e->budget);
+	add_curve (e, &c);
+}
+
+/* read a controller value and an optional range (from..to).
+ * Returns 1 for a range. The scanner is left on the token that
+ * follows the value */
+static int controller_value (SCANNER * scanner, char * name, long * from, long * to)
+{
+	long *v = from;
+	nexttoken (scanner);
+	match (scanner, EQUAL);
+	while (1) {
+		match_stay (scanner, NUMBER);
+		*v = strtol (scanner->token->buffer, NULL, 10);
+		if (!(*v>=0 && *v <= 0x7F)) {
+			bail ("%s: Invalid %s (should be between 0 and 127):%li\n",
+			      PROG_NAME,name,*v);
+		}
+		nexttoken (scanner);
+		if (v == to || scanner->tokenid != RANGE)
+			return v == to;
+		nexttoken (scanner);
+		v = to;
+	}
+}
+
+/* set a controller, or start ramping it up to the next directive or
+ * repeat bar */
+static void encode_controller (SCANNER * scanner, ENCODER * e, unsigned char controller, char * name)
+{
+	long from, to;
+	if (controller_value (scanner, name, &from, &to))
+		start_ramp (e, controller, from, to, scanner_count_ahead (scanner)*e->akshara);
+	else
+		encode_voice (e->mt, 0, e->channel, VOICE_EVENT_CONTROLLER, controller, (unsigned char)from);
+}
+
 /* the token after the '{' should be ready when
  * this function is called */
-void parse_directive (SCANNER * scanner, MIDI_TRACK * mt, unsigned char channel)
+void parse_directive (SCANNER * scanner, ENCODER * e)
 {
+	MIDI_TRACK * mt = e->mt;
+	unsigned char channel = e->channel;
 	while (scanner->tokenid != BRACECLOSE) {
 		switch (scanner->tokenid) {
 			case INSTRUMENT: {
@@ -180,217 +569,1055 @@ void parse_directive (SCANNER * scanner, MIDI_TRACK * mt, unsigned char channel)
 								 match_stay (scanner, STRING);
 								 instr = instrument_number (scanner->token->buffer);
 								 if (instr>=INSTRUMENT_COUNT){
-									 fprintf (stderr, "Unknown Instrument:%s\n",
-											 scanner->token->buffer);
-									 fprintf (stderr, "Using default instrument:%#x\n",DEF_INSTRUMENT);
+									 warn ("Unknown Instrument:%s\n",
+									       scanner->token->buffer);
+									 warn ("Using default instrument:%#x\n",DEF_INSTRUMENT);
 									 instr = DEF_INSTRUMENT;
 								 }
 								 encode_voice (mt, 0, channel, VOICE_EVENT_PROGRAM, instr, 0);
 								 break;
 								 
 							 }
-			case VOLUME: {
-							 long volume;
+			case VOLUME:
+				encode_controller (scanner, e, CONTROLLER_CHANNEL_VOLUME, "volume");
+				continue;
+			case PAN: /* TODO: What is the limit for "pan" events?*/
+				encode_controller (scanner, e, CONTROLLER_PAN, "pan value");
+				continue;
+			case PHRASE: {
 							 nexttoken (scanner);
 							 match (scanner, EQUAL);
-							 match_stay (scanner, NUMBER);
-							 volume = strtol (scanner->token->buffer, NULL, 10);
-							 if (!(volume>=0 && volume <= 0x7F)) {
-								 fprintf (stderr, "%s: Invalid volume (should be between 0 and 127):%li\n",
-										 PROG_NAME,volume);
-								 exit (0);
-							 }
-							 encode_voice (mt, 0, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_CHANNEL_VOLUME, (unsigned char)volume);
+							 match_stay (scanner, STRING);
+							 e->define = xstrdup (scanner->token->buffer);
+							 bail_hold (e->define, free);
+							 e->phrase_used = 1;
+							 break;
+						 }
+			case PLAY:   {
+							 nexttoken (scanner);
+							 match (scanner, EQUAL);
+							 match_stay (scanner, STRING);
+							 e->play = xstrdup (scanner->token->buffer);
+							 bail_hold (e->play, free);
+							 e->phrase_used = 1;
 							 break;
 						 }
-			case PAN:    {
-							 long pan;
+			case END:
+				e->end = 1;
+				break;
+			case NADAI:  {
+							 long n;
 							 nexttoken (scanner);
 							 match (scanner, EQUAL);
 							 match_stay (scanner, NUMBER);
-							 pan = strtol (scanner->token->buffer, NULL, 10);
-							 if (!(pan>=0 && pan<=0x7F)) { /* TODO: What is the limit for "pan" events?*/
-								 fprintf (stderr, "%s: Invalid pan value (should be between 0 and 127):%li\n",
-										 PROG_NAME,pan);
-								 exit (0);
+							 n = strtol (scanner->token->buffer, NULL, 10);
+							 if (n < 1 || n > MAX_NADAI)
+								 bail ("Error:%i Invalid nadai:%li\n",scanner->linecount,n);
+							 if (e->opt->beat % n)
+								 bail ("Error:%i A nadai of %li does not fit the divisions (try --divisions auto)\n",
+								       scanner->linecount,n);
+							 e->nadai = (int)n;
+							 e->akshara = e->opt->beat/n;
+							 e->nadai_set = 1;
+							 break;
+						 }
+			case RAGA:   {
+							 nexttoken (scanner);
+							 match (scanner, EQUAL);
+							 match_stay (scanner, STRING);
+							 e->raga = raga_find (scanner->token->buffer);
+							 if (!e->raga)
+								 bail ("Error:%i Unknown raga:%s\n",scanner->linecount,scanner->token->buffer);
+							 e->raga_set = 1;
+							 if (e->opt->tuning == TUNING_MTS) {
+								 unsigned char data[RAGA_MTS_SIZE];
+								 raga_mts (e->raga, channel, data);
+								 encode_sysex (mt, 0, 0xF0, RAGA_MTS_SIZE, data);
 							 }
-							 encode_voice (mt, 0, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_PAN, (unsigned char)pan);
 							 break;
 						 }
 			default:
-				fprintf (stderr, "Error in directive:%i\n",scanner->linecount);
-				exit(0);
+				bail ("Error in directive:%i\n",scanner->linecount);
 		}
 		nexttoken (scanner);
 	}
 	nexttoken(scanner);
 }
-#define BEATS 8
-void encode_track (MIDI_TRACK * mt, char * notes, MIDI_TRACK * extra, unsigned char channel)
+
+/* the portamento controllers that precede every note */
+static void encode_glide (MIDI_TRACK * mt, unsigned long delta_time, unsigned char channel, int on)
 {
-	unsigned long delta_time = 0;
-	SCANNER scanner;
-	int beat = 0;
-	unsigned char instr = 0;
-	int DT = speed;
-	
-	if (instrument) {
-		instr = instrument_number(instrument);
-		fprintf(stderr,"Instrument:%s,%#x\n",instrument,instr);
+	if (on) {
+		encode_voice (mt, delta_time, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_PORTAMENTO_SWITCH, 0x7F);
+		encode_voice (mt, 0, channel, VOICE_EVENT_CONTROLLER, 0x25, 0x01);
+		encode_voice (mt, 0, channel, VOICE_EVENT_CONTROLLER, 0x5, 0x50);
+	} else
+		encode_voice (mt, delta_time, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_PORTAMENTO_SWITCH, 0x0);
+}
+
+/* write the glide controllers of a note, marking them if this is the
+ * first note of a fragment */
+static void encode_lead (ENCODER * e, unsigned long delta_time, int shift, int first)
+{
+	FRAGMENT * f = e->frag;
+	if (first) {
+		f->has_note = 1;
+		f->shifted = shift;
+		f->glide_at = e->mt->stream->size;
+		f->glide_delta = delta_time;
 	}
-	scanner_init (&scanner, notes);
-	encode_voice (mt, 0, channel, VOICE_EVENT_PROGRAM, instr, 0);
-	if (extra) {
-	 	encode_voice (extra, 0, EXTRA_CHANNEL, VOICE_EVENT_PROGRAM, 104, 0);
- 		encode_voice (extra, 0, EXTRA_CHANNEL, VOICE_EVENT_CONTROLLER, CONTROLLER_CHANNEL_VOLUME, (unsigned char)45);
+	encode_glide (e->mt, delta_time, e->channel, shift);
+	if (first)
+		f->note_at = e->mt->stream->size;
+}
+
+/* tune the next note, writing a pitch bend only when it differs from
+ * the one the channel is at. The bend of the first note of a fragment
+ * is left for splice_fragment to write */
+static unsigned long encode_bend (ENCODER * e, long bend, unsigned long delta_time, int first)
+{
+	if (first)
+		e->frag->bend = bend;
+	else if (bend != e->bend) {
+		encode_voice (e->mt, delta_time, e->channel, VOICE_EVENT_PITCH_BEND,
+		              (unsigned char)(bend & 0x7F), (unsigned char)(bend >> 7));
+		delta_time = 0;
+	}
+	e->bend = bend;
+	return delta_time;
+}
+
+/* the note-on is in place: silence the note sounding before it */
+static void encode_note_off (ENCODER * e, int first)
+{
+	if (first)
+		e->frag->off_at = e->mt->stream->size;
+	if (e->prev)
+		encode_voice (e->mt, 0, e->channel, VOICE_EVENT_NOTE_OFF, e->prev, 0x40);
+}
+
+static void encode_note (ENCODER * e, unsigned char c)
+{
+	int first = e->frag && !e->frag->has_note;
+	unsigned long d;
+	end_curves (e, CURVE_KAMPITA);
+	d = lead_delta (e, e->delta_time);
+	d = encode_bend (e, e->opt->tuning == TUNING_BEND ? raga_bend (e->raga, c) : PITCH_BEND_CENTER, d, first);
+	encode_lead (e, d, e->note_shift && e->opt->portamento, first);
+	encode_voice (e->mt, 0, e->channel, VOICE_EVENT_NOTE_ON, c, 0x40);
+	encode_note_off (e, first);
+	e->prev = c;
+	e->note_shift = 0;
+	e->delta_time = 0;
+	if (e->gamaka)
+		start_gamaka (e);
+	e->gamaka = 0;
+}
+
+/* the raga and nadai only change where the fragment has a directive of
+ * its own; a phrase recorded in one raga or nadai leaves the ones it is
+ * played in alone */
+static void splice_state (ENCODER * e, FRAGMENT * f)
+{
+	if (f->raga_set) {
+		e->raga = f->raga;
+		e->raga_set = 1;
+	}
+	if (f->nadai_set) {
+		e->nadai = f->nadai;
+		e->akshara = e->opt->beat/f->nadai;
+		e->nadai_set = 1;
+	}
+}
+
+static void replay_fragment (ENCODER * e, FRAGMENT * f);
+
+/* play a recorded fragment at the current position */
+static void splice_fragment (ENCODER * e, FRAGMENT * f)
+{
+	STREAM * s = e->mt->stream;
+	char * b = f->bytes->buffer;
+	int first = e->frag && !e->frag->has_note;
+	unsigned long base = e->ticks;
+	size_t pos;
+	unsigned long d;
+
+	/* a '~' just before it puts a kampita on the first note, whose
+	 * bends go in among the events that follow: encode it over */
+	if (e->gamaka && f->has_note && f->tape) {
+		replay_fragment (e, f);
+		return;
+	}
+	if (!f->has_lead) {
+		/* nothing but zero delta events */
+		stream_write (s, b, f->bytes->size);
+		e->ticks += f->ticks;
+		e->delta_time += f->ticks;
+		e->note_shift |= f->shift;
+		e->gamaka |= f->tilde;
+		splice_state (e, f);
+		return;
+	}
+	stream_write (s, b, f->lead_at);
+
+	/* anything still going on here stops where the fragment starts */
+	e->ticks += f->lead;
+	e->delta_time += f->lead;
+	end_curves (e, CURVE_ALL);
+	d = lead_delta (e, e->delta_time);
+	e->delta_time = 0;
+
+	if (f->has_note) {
+		int shift = f->shifted || (e->note_shift && e->opt->portamento);
+		if (f->glide_at == f->lead_at)
+			encode_lead (e, encode_bend (e, f->bend, d, first), shift, first);
+		else {
+			stream_write_variable (s, d);
+			stream_write (s, b + f->lead_at + 1, f->glide_at - f->lead_at - 1);
+			encode_lead (e, encode_bend (e, f->bend, f->glide_delta, first), shift, first);
+		}
+		stream_write (s, b + f->note_at, f->off_at - f->note_at);
+		encode_note_off (e, first);
+		pos = f->off_at;
+		e->prev = f->last;
+		e->bend = f->last_bend;
+		e->note_shift = 0;
+		e->gamaka = 0;
+	} else {
+		stream_write_variable (s, d);
+		pos = f->lead_at + 1;
+	}
+	stream_write (s, b + pos, f->bytes->size - pos);
+	e->ticks = base + f->ticks;
+	e->delta_time = f->trail;
+	e->note_shift |= f->shift;
+	e->gamaka |= f->tilde;
+	splice_state (e, f);
+
+	/* the last note of the fragment may still be oscillating */
+	if (f->gamaka) {
+		CURVE c = f->curve;
+		c.start += base;
+		add_curve (e, &c);
+		e->curve_time = base + f->curve_time;
+		e->budget = f->budget;
+		e->budget.last += base;
+	} else
+		e->curve_time = e->ticks - e->delta_time;
+}
+
+static void free_fragment (FRAGMENT * f)
+{
+	bail_drop (f);
+	stream_free (f->bytes);
+	if (f->tape)
+		stream_free (f->tape);
+	if (f->name)
+		xfree (f->name);
+	xfree (f);
+}
+
+static void release_fragment (void * f)
+{
+	free_fragment (f);
+}
+
+static void encode_notes (ENCODER * e, SCANNER * scanner, TOKEN_TYPE until);
+
+/* A repeat block or phrase keeps the tokens it was recorded from, taken
+ * down as they go by on their way to the encoder and played back
+ * through a scanner of their own, the way the pipeline feeds tokens */
+struct taped_t
+{
+	TOKEN_TYPE id;
+	int line;
+	int ahead_count;       /* scanner_count_ahead for a BRACEOPEN */
+	size_t len;            /* of the text that follows */
+};
+
+struct tee_t
+{
+	SCANNER * from;
+	STREAM * tape;
+	int depth;             /* phrases defined inside the one recorded */
+};
+
+struct replay_t
+{
+	STREAM * tape;
+	size_t at;
+};
+
+typedef struct taped_t  TAPED;
+typedef struct tee_t    TEE;
+typedef struct replay_t REPLAY;
+
+static void tee_take (SCANNER * sc)
+{
+	TEE * t = sc->source;
+	sc->tokenid = t->from->tokenid;
+	sc->linecount = t->from->linecount;
+	if (sc->tokenid == BRACEOPEN)
+		sc->ahead_count = scanner_count_ahead (t->from);
+}
+
+/* the token before has been used: keep it, unless it is the {end} of
+ * the phrase itself */
+static void tee_feed (SCANNER * sc)
+{
+	TEE * t = sc->source;
+	int keep = 1;
+	if (sc->tokenid == PHRASE)
+		t->depth++;
+	else if (sc->tokenid == END) {
+		if (t->depth)
+			t->depth--;
+		else
+			keep = 0;
+	}
+	if (keep) {
+		TAPED k;
+		k.id = sc->tokenid;
+		k.line = sc->linecount;
+		k.ahead_count = sc->ahead_count;
+		k.len = sc->token->size;
+		stream_write (t->tape, (char *)&k, sizeof(k));
+		stream_write (t->tape, sc->token->buffer, k.len);
+	}
+	nexttoken (t->from);
+	tee_take (sc);
+}
+
+static void replay_feed (SCANNER * sc)
+{
+	REPLAY * r = sc->source;
+	TAPED k;
+	stream_write_reset (sc->token);
+	if (r->at == r->tape->size) {
+		sc->tokenid = NONE;
+		stream_add_char (sc->token, '\0');
+		return;
+	}
+	memcpy (&k, r->tape->buffer + r->at, sizeof(k));
+	r->at += sizeof(k);
+	sc->tokenid = k.id;
+	sc->linecount = k.line;
+	if (k.id == BRACEOPEN)
+		sc->ahead_count = k.ahead_count;
+	stream_write (sc->token, r->tape->buffer + r->at, k.len);
+	r->at += k.len;
+}
+
+/* encode a repeat block or phrase from its tokens, as if it were
+ * written out here. Its ramps end with it, as they do when spliced */
+static void replay_fragment (ENCODER * e, FRAGMENT * f)
+{
+	SCANNER sc;
+	REPLAY r;
+	const RAGA_TABLE * raga = e->raga;
+	int nadai = e->nadai;
+	unsigned long akshara = e->akshara;
+	r.tape = f->tape;
+	r.at = 0;
+	sc.feed = replay_feed;
+	sc.source = &r;
+	sc.token = stream_create (16);
+	sc.text = NULL;
+	sc.tokenid = NONE;
+	sc.state = STATE_NOTATION;
+	sc.linecount = 1;
+	sc.ahead_count = 0;
+	/* a phrase sounds the way it did where it was defined */
+	e->raga = f->start_raga;
+	e->nadai = f->start_nadai;
+	e->akshara = e->opt->beat/f->start_nadai;
+	nexttoken (&sc);
+	encode_notes (e, &sc, NONE);
+	end_curves (e, CURVE_RAMP);
+	if (!f->raga_set)
+		e->raga = raga;
+	if (!f->nadai_set) {
+		e->nadai = nadai;
+		e->akshara = akshara;
 	}
-	/*encode_event (mt, &event);*/
-	nexttoken (&scanner);
-	while (scanner.tokenid != NONE) {
+	stream_free (sc.token);
+}
+
+/* encode the notation up to 'until' into a new fragment, keeping its
+ * tokens as well if 'taped' */
+static FRAGMENT * record_fragment (ENCODER * e, SCANNER * scanner, char * name, TOKEN_TYPE until, int taped)
+{
+	ENCODER sub;
+	MIDI_TRACK mt;
+	SCANNER tee_scanner;
+	TEE tee;
+	STREAM * bytes = stream_create (16);
+	FRAGMENT * f = xmalloc (sizeof(FRAGMENT));
+	f->name = name;
+	f->bytes = mt.stream = bytes;
+	f->tape = taped ? stream_create (64) : NULL;
+	/* the name, the bytes and the tokens go with the fragment from here on */
+	bail_drop (bytes);
+	if (f->tape)
+		bail_drop (f->tape);
+	if (name)
+		bail_drop (name);
+	bail_hold (f, release_fragment);
+	f->has_lead = 0;
+	f->has_note = 0;
+	f->start_raga = e->raga;
+	f->start_nadai = e->nadai;
+	f->next = NULL;
+	if (taped) {
+		tee.from = scanner;
+		tee.tape = f->tape;
+		tee.depth = 0;
+		tee_scanner.feed = tee_feed;
+		tee_scanner.source = &tee;
+		tee_scanner.token = scanner->token;
+		tee_scanner.text = NULL;
+		tee_scanner.state = STATE_NOTATION;
+		tee_scanner.ahead_count = 0;
+		tee_take (&tee_scanner);
+		scanner = &tee_scanner;
+	}
+	encoder_init (&sub, e->opt, &mt, e->channel, e->phrases);
+	sub.frag = f;
+	sub.raga = e->raga;
+	sub.nadai = e->nadai;
+	sub.akshara = e->akshara;
+	encode_notes (&sub, scanner, until);
+	end_curves (&sub, CURVE_RAMP);
+	f->trail = sub.delta_time;
+	f->ticks = sub.ticks;
+	f->last = sub.prev;
+	f->last_bend = sub.bend;
+	f->raga = sub.raga;
+	f->raga_set = sub.raga_set;
+	f->nadai = sub.nadai;
+	f->nadai_set = sub.nadai_set;
+	f->shift = sub.note_shift;
+	f->tilde = sub.gamaka;
+	f->phrases = sub.phrase_used;
+	e->phrase_used |= sub.phrase_used;
+	f->gamaka = sub.curve_count;
+	if (f->gamaka) {
+		f->curve = sub.curves[0];
+		f->curve_time = sub.curve_time;
+		f->budget = sub.budget;
+	}
+	if (name && !sub.end)
+		bail ("Error:%i Phrase not terminated:%s\n",scanner->linecount,name);
+	return f;
+}
+
+static void play_phrase (ENCODER * e, SCANNER * scanner, char * name)
+{
+	FRAGMENT * f;
+	for (f=*(e->phrases);f;f=f->next)
+		if (!strcmp (f->name, name))
+			break;
+	if (!f)
+		bail ("Error:%i Unknown phrase:%s\n",scanner->linecount,name);
+	splice_fragment (e, f);
+}
+
+/* the token after the opening '|' should be ready when
+ * this function is called */
+static void encode_repeat (ENCODER * e, SCANNER * scanner)
+{
+	FRAGMENT * f;
+	long count = 2;
+	f = record_fragment (e, scanner, NULL, PIPE, 1);
+	if (scanner->tokenid != PIPE)
+		bail ("Error:%i Repeat block not terminated\n",scanner->linecount);
+	nexttoken (scanner);
+	if (scanner->tokenid == REPEAT) {
+		count = strtol (scanner->token->buffer+1, NULL, 10);
+		if (count < 1)
+			bail ("Error:%i Invalid repeat count:%s\n",scanner->linecount,scanner->token->buffer);
+		nexttoken (scanner);
+	}
+	while (count--)
+		splice_fragment (e, f);
+	free_fragment (f);
+}
+
+static void encode_notes (ENCODER * e, SCANNER * scanner, TOKEN_TYPE until)
+{
+	while (scanner->tokenid != NONE && scanner->tokenid != until) {
 		unsigned char c;
-		static char prev=0;
-		static int note_shift = 0;
-		if (scanner.tokenid == LYRIC) {
-			encode_lyric (mt, scanner.token->buffer, scanner.token->size);
-			nexttoken(&scanner);
+		if (scanner->tokenid == LYRIC) {
+			encode_lyric (e->mt, scanner->token->buffer, scanner->token->size);
+			nexttoken(scanner);
 			continue;
 		}
-		if (scanner.tokenid == STAR) {
-			note_shift = 1;
-			nexttoken (&scanner);
+		if (scanner->tokenid == STAR) {
+			e->note_shift = 1;
+			nexttoken (scanner);
 			continue;
 		}
-		if (scanner.tokenid == BRACEOPEN) {
-			nexttoken (&scanner);
-			parse_directive (&scanner, mt, channel);
+		if (scanner->tokenid == TILDE) {
+			e->gamaka = 1;
+			nexttoken (scanner);
 			continue;
 		}
-		delta_time += DT;
-		beat++;
-		if ( ((beat-1) % BEATS == 0) && extra) {
-			encode_voice (extra, beat==1?0:(BEATS-1)*DT, EXTRA_CHANNEL, VOICE_EVENT_NOTE_ON,note_map2("S"),0x40);
-			encode_voice (extra, 0, EXTRA_CHANNEL, VOICE_EVENT_NOTE_ON,  note_map2("P"), 0x40);
-			encode_voice (extra, 0, EXTRA_CHANNEL, VOICE_EVENT_NOTE_ON,  note_map2("S+"),0x40);
-			encode_voice (extra, DT, EXTRA_CHANNEL,VOICE_EVENT_NOTE_OFF, note_map2("S"), 0x40);
-			encode_voice (extra, 0, EXTRA_CHANNEL, VOICE_EVENT_NOTE_OFF, note_map2("P"), 0x40);
-			encode_voice (extra, 0, EXTRA_CHANNEL, VOICE_EVENT_NOTE_OFF, note_map2("S+"),0x40);
+		if (scanner->tokenid == BRACEOPEN) {
+			/* a ramp lasts up to the next directive */
+			end_curves (e, CURVE_RAMP);
+			nexttoken (scanner);
+			parse_directive (scanner, e);
+			if (e->end) {
+				if (!e->frag || !e->frag->name)
+					bail ("Error:%i {end} outside of a phrase\n",scanner->linecount);
+				return;
+			}
+			if (e->define) {
+				FRAGMENT * f = record_fragment (e, scanner, e->define, NONE, 1);
+				e->define = NULL;
+				f->next = *(e->phrases);
+				*(e->phrases) = f;
+				splice_fragment (e, f);
+			}
+			if (e->play) {
+				/* a phrase played over has directives of its own */
+				char * play = e->play;
+				e->play = NULL;
+				play_phrase (e, scanner, play);
+				bail_drop (play);
+				xfree (play);
+			}
+			continue;
 		}
-		if (scanner.tokenid == COMMA) {
-			nexttoken (&scanner);
+		if (scanner->tokenid == PIPE) {
+			end_curves (e, CURVE_RAMP);
+			nexttoken (scanner);
+			encode_repeat (e, scanner);
 			continue;
 		}
-		if (scanner.tokenid != NOTE) {
-			fprintf (stderr ,"Error:%i Unrecognized token:%s\n",scanner.linecount,scanner.token->buffer);
-			exit(0);
+		e->delta_time += e->akshara;
+		e->ticks += e->akshara;
+		if (scanner->tokenid == COMMA) {
+			nexttoken (scanner);
+			continue;
 		}
-		c = note_map2 (scanner.token->buffer);
-		nexttoken (&scanner);
-		if (c==0xFF) {
-			fprintf (stderr, "Invalid Note:%c(%#x)\n",*notes,(unsigned char)*notes);
-			exit(0);
+		if (scanner->tokenid != NOTE)
+			bail ("Error:%i Unrecognized token:%s\n",scanner->linecount,scanner->token->buffer);
+		c = note_map2 (scanner->token->buffer);
+		if (c==0xFF)
+			bail ("Invalid Note:%s\n",scanner->token->buffer);
+		nexttoken (scanner);
+		encode_note (e, c);
+	}
+}
+
+/* A session keeps the sections of the tracks it compiled, encoded as
+ * fragments together with the raga and nadai they started out in. When
+ * the song is compiled again only the sections whose notation or
+ * starting state changed are encoded; the others are spliced in as
+ * they are, which is also what puts the right deltas, note-offs and
+ * bends at their edges */
+struct section_t
+{
+	HASH hash;             /* of the notation */
+	size_t len;
+	const RAGA_TABLE * raga;
+	int nadai;
+	FRAGMENT * f;          /* NULL if it can't be kept */
+};
+
+struct session_track_t
+{
+	struct section_t * sections;
+	size_t count;
+};
+
+struct session_t
+{
+	unsigned long divisions;   /* the sections were encoded with these */
+	unsigned long beat;
+	int tuning;
+	int portamento;
+	unsigned long curve_events;
+	int curve_error;
+	struct session_track_t tracks[MAX_TRACK_COUNT];
+	unsigned long encoded;     /* sections in the last compile */
+	unsigned long reused;
+};
+
+typedef struct section_t       SECTION;
+typedef struct session_track_t SESSION_TRACK;
+
+static int word_is (char * p, char * word)
+{
+	while (*word && tolower ((unsigned char)*p) == *word)
+		p++, word++;
+	return !*word && !isalnum ((unsigned char)*p);
+}
+
+/* A track is split into sections at the lyrics that start a line, like
+ * ":Pallavi\n:". The first section is whatever comes before the first
+ * of them. Lyrics inside a directive, a repeat block or a phrase don't
+ * start a section, and neither do those while a ramp is going, since
+ * its length depends on the notes up to the next directive or repeat
+ * bar, or while a kampita waits for its note or is still sounding: it
+ * ends at the note after its own, and a phrase played may leave one
+ * either way. Fills in where each section starts (and where the
+ * last one ends) and its line number, and returns how many there are */
+static size_t find_sections (char * notes, size_t * starts, int * lines)
+{
+	int lyric = 0, brace = 0, string = 0, comment = 0, repeat = 0, phrase = 0, ramp = 0;
+	int kampita = 0;       /* notes until a kampita is over */
+	int line = 1;
+	size_t n = 1;
+	char * p;
+	if (starts) {
+		starts[0] = 0;
+		lines[0] = 1;
+	}
+	for (p=notes;*p;p++) {
+		if (*p == '\n') {
+			line++;
+			comment = 0;
+			if (p[1] == ':' && !lyric && !brace && !repeat && !phrase && !ramp && !kampita) {
+				if (starts) {
+					starts[n] = p + 1 - notes;
+					lines[n] = line;
+				}
+				n++;
+			}
+		} else if (comment)
+			continue;
+		else if (lyric) {
+			if (*p == '\\' && p[1] && p[1] != '\n')
+				p++;
+			else if (*p == ':')
+				lyric = 0;
+		} else if (string) {
+			if (*p == '\\' && p[1] && p[1] != '\n')
+				p++;
+			else if (*p == '"')
+				string = 0;
+		} else if (brace) {
+			if (*p == '}')
+				brace = 0;
+			else if (*p == '"')
+				string = 1;
+			else if (*p == '#')
+				comment = 1;
+			else if (*p == '.' && p[1] == '.')
+				ramp = 1;
+			else if (isalpha ((unsigned char)*p) && !isalnum ((unsigned char)p[-1])) {
+				if (word_is (p, "phrase"))
+					phrase = 1;
+				else if (word_is (p, "end"))
+					phrase = 0;
+				else if (word_is (p, "play"))
+					kampita = 2;
+			}
+		} else if (*p == ':')
+			lyric = 1;
+		else if (*p == '{') {
+			/* a directive or a repeat bar ends a ramp */
+			brace = 1;
+			ramp = 0;
+		} else if (*p == '#')
+			comment = 1;
+		else if (*p == '|') {
+			repeat = !repeat;
+			ramp = 0;
+		} else if (*p == '~')
+			kampita = 2;
+		else if (isalpha ((unsigned char)*p) && *p != 'x' && kampita)
+			kampita--;
+	}
+	if (starts)
+		starts[n] = p - notes;
+	return n;
+}
+
+/* a kept section with the same notation and starting state, preferably
+ * the one in the same place */
+static FRAGMENT * take_section (SESSION_TRACK * t, SECTION * s, size_t at)
+{
+	size_t i;
+	for (i=0;i<=t->count;i++) {
+		SECTION * old = t->sections + (i ? i-1 : at);
+		FRAGMENT * f;
+		if (!i && at >= t->count)
+			continue;
+		f = old->f;
+		if (f && old->hash == s->hash && old->len == s->len
+		    && old->raga == s->raga && old->nadai == s->nadai) {
+			old->f = NULL;
+			return f;
 		}
-		if (note_shift && portamento) {
-			encode_voice (mt, delta_time, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_PORTAMENTO_SWITCH, 0x7F);
-			delta_time = 0;
-			encode_voice (mt, delta_time, channel, VOICE_EVENT_CONTROLLER, 0x25, 0x01);
-			encode_voice (mt, delta_time, channel, VOICE_EVENT_CONTROLLER, 0x5, 0x50);
-		}else {
-			encode_voice (mt, delta_time, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_PORTAMENTO_SWITCH, 0x0);
-			delta_time = 0;
+	}
+	return NULL;
+}
+
+static void free_sections (SESSION_TRACK * t)
+{
+	size_t i;
+	for (i=0;i<t->count;i++)
+		if (t->sections[i].f)
+			free_fragment (t->sections[i].f);
+	if (t->sections)
+		xfree (t->sections);
+	t->sections = NULL;
+	t->count = 0;
+}
+
+static void encode_sections (ENCODER * e, char * notes, SESSION * session, SESSION_TRACK * t)
+{
+	size_t i, n = find_sections (notes, NULL, NULL);
+	size_t * starts;
+	int * lines;
+	SECTION * sections;
+	starts = xmalloc ((n+1)*sizeof(size_t));
+	bail_hold (starts, free);
+	lines = xmalloc (n*sizeof(int));
+	bail_hold (lines, free);
+	sections = xmalloc (n*sizeof(SECTION));
+	bail_hold (sections, free);
+	find_sections (notes, starts, lines);
+	for (i=0;i<n;i++) {
+		SECTION * s = sections + i;
+		char * text = notes + starts[i];
+		s->len = starts[i+1] - starts[i];
+		s->hash = hash64 (text, s->len, 0);
+		s->raga = e->raga;
+		s->nadai = e->nadai;
+		s->f = take_section (t, s, i);
+		if (s->f) {
+			/* it is this compile's until the session gets it back */
+			bail_hold (s->f, release_fragment);
+			session->reused++;
 		}
-		encode_voice (mt, delta_time, channel, VOICE_EVENT_NOTE_ON, c, 0x40);
-		if (prev) {
-			encode_voice (mt, delta_time, channel, VOICE_EVENT_NOTE_OFF, prev, 0x40);
+		else {
+			SCANNER scanner;
+			char end = text[s->len];
+			text[s->len] = '\0';
+			scanner_init (&scanner, text);
+			text[s->len] = end;
+			scanner.linecount = lines[i];
+			nexttoken (&scanner);
+			s->f = record_fragment (e, &scanner, NULL, NONE, 0);
+			stream_free (scanner.token);
+			stream_free (scanner.text);
+			session->encoded++;
 		}
-		prev =c;
-		note_shift = 0;
-		delta_time = 0;
+		splice_fragment (e, s->f);
+	}
+	free_sections (t);
+	/* what a phrase sounds like depends on where it was defined */
+	for (i=0;i<n;i++)
+		if (sections[i].f->phrases) {
+			free_fragment (sections[i].f);
+			sections[i].f = NULL;
+		}
+	for (i=n;i--;)
+		if (sections[i].f)
+			bail_drop (sections[i].f);
+	bail_drop (sections);
+	t->sections = sections;
+	t->count = n;
+	bail_drop (lines);
+	xfree (lines);
+	bail_drop (starts);
+	xfree (starts);
+}
+
+/* encode a track and return its length in ticks. With a session, only
+ * the sections that changed since the last time are encoded */
+/* the notes come from 'scanner' if it is given, otherwise from 'notes' */
+static unsigned long encode_track (OPTIONS * opt, MIDI_TRACK * mt, char * notes, SCANNER * fed,
+                                   unsigned char channel, SESSION * session, SESSION_TRACK * sections)
+{
+	SCANNER scanner;
+	ENCODER e;
+	FRAGMENT * phrases = NULL;
+	unsigned char instr = 0;
+	
+	if (opt->instrument) {
+		instr = instrument_number(opt->instrument);
+		warn ("Instrument:%s,%#x\n",opt->instrument,instr);
+	}
+	encoder_init (&e, opt, mt, channel, &phrases);
+	encode_voice (mt, 0, channel, VOICE_EVENT_PROGRAM, instr, 0);
+	if (fed) {
+		nexttoken (fed);
+		encode_notes (&e, fed, NONE);
+	} else if (session)
+		encode_sections (&e, notes, session, sections);
+	else {
+		scanner_init (&scanner, notes);
+		nexttoken (&scanner);
+		encode_notes (&e, &scanner, NONE);
+		stream_free (scanner.token);
+		stream_free (scanner.text);
 	}
-	encode_voice (mt, delta_time, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_PORTAMENTO_SWITCH, 0x0);
-	encode_meta (mt, delta_time, META_EVENT_EOT, 0, 0, NULL);
-	if (extra)
-		encode_meta (extra, delta_time, META_EVENT_EOT, 0, 0, NULL);
+	end_curves (&e, CURVE_ALL);
+	encode_voice (mt, e.delta_time, channel, VOICE_EVENT_CONTROLLER, CONTROLLER_PORTAMENTO_SWITCH, 0x0);
+	encode_meta (mt, e.delta_time, META_EVENT_EOT, 0, 0, NULL);
+	while (phrases) {
+		FRAGMENT * next = phrases->next;
+		free_fragment (phrases);
+		phrases = next;
+	}
+	return e.ticks;
 }
-void encode_file (char ** track_text, size_t track_count)
+
+unsigned long encode_scanned_track (OPTIONS * opt, MIDI_TRACK * mt, SCANNER * scanner,
+                                    unsigned char channel)
+{
+	return encode_track (opt, mt, NULL, scanner, channel, NULL, NULL);
+}
+
+/* the thalam follows the last track. A beat is four aksharas long */
+void encode_thalam (OPTIONS * opt, STREAM * output, STREAM * scratch, unsigned long ticks)
+{
+	THALAM thalam;
+	MIDI_TRACK extra;
+	const THALAM_CYCLE * cycle;
+	unsigned char instr = EXTRA_INSTRUMENT;
+
+	cycle = thalam_cycle (opt->thalam_name);
+	if (!cycle)
+		bail ("Unknown thalam:%s\n",opt->thalam_name);
+	if (opt->thalam_channel > 0xF)
+		bail ("Invalid thalam channel:%lu\n",opt->thalam_channel);
+	if (opt->thalam_instrument) {
+		instr = instrument_number (opt->thalam_instrument);
+		if (instr>=INSTRUMENT_COUNT)
+			bail ("Unknown Instrument:%s\n",opt->thalam_instrument);
+	}
+	if (!thalam_init (&thalam, cycle, opt->beat, (unsigned char)opt->thalam_channel, instr))
+		bail ("The speed is too low to generate a thalam\n");
+	extra.stream = scratch;
+	stream_write_reset (scratch);
+	thalam_encode (&thalam, &extra, ticks);
+	write_track_chunk (output, &extra);
+	thalam_free (&thalam);
+}
+static unsigned long gcd (unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* The fewest ticks to a beat that every nadai in the notation divides
+ * exactly. Gamakas and ramps need room for their curve events as well */
+static unsigned long fit_divisions (OPTIONS * opt, char ** track_text, size_t track_count)
+{
+	unsigned long ticks = 4;
+	int curves = 0;
+	size_t i;
+	for (i=0;i<track_count;i++) {
+		SCANNER scanner;
+		scanner_init (&scanner, track_text[i]);
+		nexttoken (&scanner);
+		while (scanner.tokenid != NONE) {
+			if (scanner.tokenid == TILDE || scanner.tokenid == RANGE)
+				curves = 1;
+			if (scanner.tokenid == NADAI) {
+				nexttoken (&scanner);
+				if (scanner.tokenid == EQUAL)
+					nexttoken (&scanner);
+				if (scanner.tokenid == NUMBER) {
+					/* bad values are reported when the track is encoded */
+					long n = strtol (scanner.token->buffer, NULL, 10);
+					if (n >= 1 && n <= MAX_NADAI)
+						ticks = ticks/gcd (ticks, n)*n;
+				}
+				continue;
+			}
+			nexttoken (&scanner);
+		}
+		stream_free (scanner.token);
+		stream_free (scanner.text);
+	}
+	if (curves && opt->curve_events)
+		ticks = ticks/gcd (ticks, opt->curve_events)*opt->curve_events;
+	if (ticks > MAX_DIVISIONS)
+		bail ("Unable to fit the song into %lu divisions\n",(unsigned long)MAX_DIVISIONS);
+	return ticks;
+}
+
+/* work out the settings of the whole song and write the header chunk.
+ * Returns the tempo the first track starts with, 0 for the default */
+static unsigned long song_header (OPTIONS * opt, char ** track_text, size_t track_count,
+                                  STREAM * output)
 {
 	MIDI_FILE mf;
-	MIDI_TRACK extra, mt;
-	int i;
-	STREAM * output;
-	unsigned char channel = 0;
-	mf.tracks = track_count + ((include_thalam==1)?1:0);
+	unsigned long tempo = 0;
+	if (opt->auto_divisions) {
+		/* a beat to a quarter note, played as fast as 4*speed ticks
+		 * would be at the default divisions and tempo */
+		opt->divisions = opt->beat = fit_divisions (opt, track_text, track_count);
+		tempo = 4*opt->speed*(DEFAULT_TEMPO/4)/(DEFAULT_DIVISIONS/4);
+		if (!tempo || tempo > 0xFFFFFF)
+			bail ("Invalid speed:%i\n",opt->speed);
+	} else
+		opt->beat = 4*opt->speed;
+	mf.tracks = track_count + ((opt->include_thalam==1)?1:0);
 	mf.format = 1;
 	mf.division = DIVISION_TQN;
-	mf.tpqn = divisions;
-	output= stream_create (10);
+	mf.tpqn = opt->divisions;
+	if (!strcmp (opt->tuning_name, "bend"))
+		opt->tuning = TUNING_BEND;
+	else if (!strcmp (opt->tuning_name, "mts"))
+		opt->tuning = TUNING_MTS;
+	else
+		bail ("Unknown tuning:%s\n",opt->tuning_name);
+	stream_write_reset (output);
 	write_header_chunk (output, &mf);
-	for (i=0;i<track_count-1;i++) {
+	return tempo;
+}
+
+/* the header of a song whose tracks are encoded one at a time. The
+ * divisions can only be fitted to the song if 'track_text' is given */
+unsigned long encode_header (OPTIONS * opt, char ** track_text, size_t track_count,
+                             STREAM * output)
+{
+	if (opt->auto_divisions && !track_text)
+		bail ("-d auto needs the whole song up front\n");
+	return song_header (opt, track_text, track_count, output);
+}
+
+/* encode track 'i' of a song, 'tempo' being what encode_header gave */
+static unsigned long song_track (OPTIONS * opt, MIDI_TRACK * mt, char * notes, size_t i,
+                                 unsigned long tempo, SESSION * session)
+{
+	if (tempo && !i) {
+		unsigned char data[3];
+		data[0] = (unsigned char)(tempo>>16);
+		data[1] = (unsigned char)(tempo>>8);
+		data[2] = (unsigned char)tempo;
+		encode_meta (mt, 0, META_EVENT_SET_TEMPO, 0, 3, data);
+	}
+	return encode_track (opt, mt, notes, NULL, (unsigned char)i,
+	                     session, session ? session->tracks + i : NULL);
+}
+
+/* encode track 'i' as a whole chunk, ready to go into the file */
+unsigned long encode_track_chunk (OPTIONS * opt, char * notes, size_t i, unsigned long tempo,
+                                  STREAM * chunk)
+{
+	MIDI_TRACK mt;
+	unsigned long ticks, len;
+	mt.stream = chunk;
+	stream_write_reset (chunk);
+	stream_write (chunk, "MTrk\0\0\0\0", 8);
+	ticks = song_track (opt, &mt, notes, i, tempo, NULL);
+	len = chunk->size - 8;
+	chunk->buffer[4] = (char)(len>>24);
+	chunk->buffer[5] = (char)(len>>16);
+	chunk->buffer[6] = (char)(len>>8);
+	chunk->buffer[7] = (char)len;
+	return ticks;
+}
+
+/* encode a song into 'output'. 'scratch' holds one track at a time */
+static void session_options (SESSION * s, OPTIONS * opt, size_t track_count);
+
+static void encode_song (OPTIONS * opt, char ** track_text, size_t track_count,
+                         STREAM * output, STREAM * scratch, SESSION * session)
+{
+	size_t i;
+	unsigned long ticks = 0;
+	unsigned long tempo = song_header (opt, track_text, track_count, output);
+	if (session)
+		session_options (session, opt, track_count);
+	for (i=0;i<track_count;i++) {
 		MIDI_TRACK mt;
-		mt.stream = stream_create (6);
-		encode_track (&mt,*(track_text++),NULL,channel++);
+		mt.stream = scratch;
+		stream_write_reset (scratch);
+		ticks = song_track (opt, &mt, track_text[i], i, tempo, session);
 		write_track_chunk (output, &mt);
-		stream_free (mt.stream);
 	}
 	
-	mt.stream    = stream_create (6);
-	if (include_thalam) {
-		extra.stream = stream_create (6);
-		encode_track (&mt, *(track_text),&extra, channel);
-		write_track_chunk(output, &mt);
-		write_track_chunk(output,&extra);
-		stream_free (mt.stream);
-		stream_free (extra.stream);
-	} else {
-		encode_track (&mt, *(track_text), NULL, channel);
-		write_track_chunk(output, &mt);
-		stream_free (mt.stream);
+	if (opt->include_thalam)
+		encode_thalam (opt, output, scratch, ticks);
+}
+
+void encode_file (OPTIONS * opt, char ** track_text, size_t track_count,
+                  STREAM * output, STREAM * scratch)
+{
+	encode_song (opt, track_text, track_count, output, scratch, NULL);
+}
+
+SESSION * session_create (void)
+{
+	SESSION * s = xmalloc (sizeof(SESSION));
+	int i;
+	s->divisions = 0;
+	for (i=0;i<MAX_TRACK_COUNT;i++) {
+		s->tracks[i].sections = NULL;
+		s->tracks[i].count = 0;
 	}
-	
-	if (!output_file || !strcmp(output_file,"-"))
-		stream_write_to_io (output, stdout);
-	else
-		stream_write_to_file (output, output_file);
-	stream_free (output);
-	
+	s->encoded = 0;
+	s->reused = 0;
+	return s;
+}
+
+void session_free (SESSION * s)
+{
+	int i;
+	for (i=0;i<MAX_TRACK_COUNT;i++)
+		free_sections (s->tracks + i);
+	xfree (s);
+}
+
+/* the kept sections are no good once an option that reaches them changes */
+static void session_options (SESSION * s, OPTIONS * opt, size_t track_count)
+{
+	size_t i;
+	if (s->divisions != opt->divisions || s->beat != opt->beat || s->tuning != opt->tuning
+	    || s->portamento != opt->portamento || s->curve_events != opt->curve_events
+	    || s->curve_error != opt->curve_error)
+		track_count = 0;
+	for (i=track_count;i<MAX_TRACK_COUNT;i++)
+		free_sections (s->tracks + i);
+	s->divisions = opt->divisions;
+	s->beat = opt->beat;
+	s->tuning = opt->tuning;
+	s->portamento = opt->portamento;
+	s->curve_events = opt->curve_events;
+	s->curve_error = opt->curve_error;
+	s->encoded = 0;
+	s->reused = 0;
+}
+
+/* encode a song, reusing what it can from the last one */
+void session_encode (SESSION * s, OPTIONS * opt, char ** track_text, size_t track_count,
+                     STREAM * output, STREAM * scratch)
+{
+	encode_song (opt, track_text, track_count, output, scratch, s);
+}
+
+void session_counts (SESSION * s, unsigned long * encoded, unsigned long * reused)
+{
+	*encoded = s->encoded;
+	*reused = s->reused;
 }
-int main(int argc, char ** argv)
+
+/* read the input files into 'tracks', last file first. Returns the
+ * number of tracks */
+int load_tracks (OPTIONS * opt, char ** tracks)
 {
-	STREAM * note_s;
-	char * tracks[MAX_TRACK_COUNT];
 	int track_count = 0;
-	if (parse_args (argc, argv) == 0)
-		return 0;
-	if (!file_count) {
-#ifdef HAVE_ISATTY
-		/* if no text was piped into the program,
-		 * just display usage info and exit */
-		if (isatty (STDIN_FILENO)) {
-			simple_usage();
-			return 1;
-		}
-#endif
-		note_s = stream_create (1);
-		if (!stream_copy_from_io (note_s,stdin))
-			return 0;
-		tracks[0] = stream_copy_buffer (note_s);
-		track_count = 1;
-		stream_free (note_s);
-	} else {
-		while (file_count--) {
-			STREAM * tr = stream_load_from_file (in_files[file_count]);
-			if (!tr)
-				bail ("Unable to open file:%s\n",in_files[file_count]);
-			stream_add_char (tr, '\0');
-			tracks[track_count++] = stream_copy_buffer (tr);
-			stream_free (tr);
-		}
-		
-/*note_s = stream_load_from_file (argv[1]);
-		argv++;*/
-	}
-	encode_file (tracks, track_count);
-	while (track_count-->0)
-		free (tracks[track_count]);
-/*	encode_notes2 (note_s->buffer,argv[1]?argv[1]:"-");*/
-	return 1;
+	unsigned int n = opt->file_count;
+	while (n--) {
+		STREAM * tr = stream_load_from_file (opt->in_files[n]);
+		if (!tr)
+			bail ("Unable to open file:%s\n",opt->in_files[n]);
+		stream_add_char (tr, '\0');
+		tracks[track_count++] = stream_take_buffer (tr);
+	}
+	return track_count;
 }
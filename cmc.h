@@ -0,0 +1,80 @@
+/* Options shared by the single song and batch front ends
+ * HS
+ */
+#ifndef _CMC_H_
+#define _CMC_H_
+
+#include "stream.h"
+
+#define MAX_TRACK_COUNT 4
+
+/* parameters set by the command-line (or a line of a batch manifest) */
+struct options_t
+{
+	unsigned int file_count;
+	char * in_files[MAX_TRACK_COUNT];
+	char * output_file;
+	unsigned long divisions;
+	int auto_divisions;
+	char * instrument;
+	int portamento;
+	int include_thalam;
+	char * thalam_name;
+	unsigned long thalam_channel;
+	char * thalam_instrument;
+	int speed;
+	unsigned long curve_events;
+	int curve_error;
+	char * tuning_name;
+	char * batch_file;
+	char * serve_path;
+	unsigned long jobs;        /* worker threads in batch mode, 0 for one per cpu */
+	char * cache_dir;
+	unsigned long cache_size;  /* megabytes */
+	int cache_stats;
+	char * io_engine;          /* how --batch reads and writes files */
+	unsigned long max_memory;  /* megabytes the streams may have, 0 for no limit */
+	int watch;
+	int watch_delay;           /* milliseconds to wait for the rest of a save */
+	int pipeline;
+	int parallel;
+
+	/* worked out by encode_file */
+	unsigned long beat;        /* ticks in a beat of four aksharas */
+	int tuning;
+};
+
+typedef struct options_t OPTIONS;
+
+/* a song compiled over and over as it is edited */
+struct session_t;
+typedef struct session_t SESSION;
+
+struct miditrack_t;
+struct scanner_t;
+
+void options_init (OPTIONS * opt);
+void simple_usage (void);
+int  parse_args   (OPTIONS * opt, char ** argv);
+int  load_tracks  (OPTIONS * opt, char ** tracks);
+void encode_file  (OPTIONS * opt, char ** track_text, size_t track_count,
+                   STREAM * output, STREAM * scratch);
+unsigned long encode_header (OPTIONS * opt, char ** track_text, size_t track_count,
+                             STREAM * output);
+unsigned long encode_track_chunk (OPTIONS * opt, char * notes, size_t i, unsigned long tempo,
+                                  STREAM * chunk);
+unsigned long encode_scanned_track (OPTIONS * opt, struct miditrack_t * mt,
+                                    struct scanner_t * scanner, unsigned char channel);
+void encode_thalam  (OPTIONS * opt, STREAM * output, STREAM * scratch, unsigned long ticks);
+SESSION * session_create (void);
+void session_free   (SESSION * s);
+void session_encode (SESSION * s, OPTIONS * opt, char ** track_text, size_t track_count,
+                     STREAM * output, STREAM * scratch);
+void session_counts (SESSION * s, unsigned long * encoded, unsigned long * reused);
+int  run_batch    (OPTIONS * opt);
+int  run_server   (OPTIONS * opt);
+int  run_watch    (OPTIONS * opt);
+int  run_pipeline (OPTIONS * opt);
+void write_parallel (OPTIONS * opt, char ** track_text, size_t track_count);
+
+#endif /* _CMC_H_ */
@@ -0,0 +1,132 @@
+/*
+ * Curves for gamakas and controller ramps - HS
+ * A curve follows a precomputed shape table, a straight line between
+ * every two samples. An event is only written when the curve strays
+ * from the last value written by more than its tolerance, and never
+ * sooner than the channel's event budget allows. The curve only moves
+ * one way between two samples, so where it strays is found a sample
+ * at a time rather than a tick at a time.
+ */
+#include <stdio.h>
+#include "curve.h"
+
+static const int shapes[][CURVE_SAMPLES+1] = {
+	/* CURVE_RAMP: a straight line */
+	{   0,   32,   64,   96,  128,  160,  192,  224,  256,  288,  320,
+	  352,  384,  416,  448,  480,  512,  544,  576,  608,  640,  672,
+	  704,  736,  768,  800,  832,  864,  896,  928,  960,  992, 1024},
+	/* CURVE_KAMPITA: one period of a raised cosine */
+	{   0,   10,   39,   86,  150,  228,  316,  412,  512,  612,  708,
+	  796,  874,  938,  985, 1014, 1024, 1014,  985,  938,  874,  796,
+	  708,  612,  512,  412,  316,  228,  150,   86,   39,   10,    0}
+};
+
+/* 'events' is the most curve events allowed per quarter note */
+void curve_budget_init (CURVE_BUDGET * b, unsigned long tpqn, unsigned long events, int error)
+{
+	b->spacing = events ? tpqn/events : tpqn;
+	if (!b->spacing)
+		b->spacing = 1;
+	b->error = error;
+	b->used = 0;
+	b->last = 0;
+}
+
+/* the value of the curve 't' ticks into the track */
+long curve_value (CURVE * c, unsigned long t)
+{
+	const int * shape;
+	unsigned long pos, i;
+	long s;
+	if (c->shape == CURVE_RAMP) {
+		shape = shapes[0];
+		if (t >= c->start + c->length)
+			return c->to;
+		pos = (t - c->start)*CURVE_SAMPLES*CURVE_SCALE/c->length;
+	} else {
+		shape = shapes[1];
+		pos = ((t - c->start)%c->length)*CURVE_SAMPLES*CURVE_SCALE/c->length;
+	}
+	/* interpolate between neighbouring samples */
+	i = pos/CURVE_SCALE;
+	s = shape[i] + (long)(shape[i+1]-shape[i])*(long)(pos%CURVE_SCALE)/CURVE_SCALE;
+	return c->from + (c->to - c->from)*s/CURVE_SCALE;
+}
+
+/* a new curve on the channel: the tolerance is worked out from the
+ * allowed error and the event budget starts afresh */
+void curve_start (CURVE * c, CURVE_BUDGET * b)
+{
+	c->tolerance = (long)b->error*c->range/100;
+	b->used = 0;
+}
+
+static int strays (CURVE * c, unsigned long t)
+{
+	long d = curve_value (c, t) - c->emitted;
+	return d > c->tolerance || -d > c->tolerance;
+}
+
+/* the first tick of sample 'i' of a shape 'length' ticks long */
+static unsigned long sample_start (unsigned long length, unsigned long i)
+{
+	return (i*length + CURVE_SAMPLES - 1)/CURVE_SAMPLES;
+}
+
+/* The next event of the curve: the first tick in [from,until) that the
+ * budget allows and at which the curve strays. Returns 0 if there is
+ * none. A ramp is left at its last value once it is over */
+int curve_next (CURVE * c, CURVE_BUDGET * b, unsigned long from, unsigned long until,
+                unsigned long * t, long * value)
+{
+	if (b->used && from < b->last + b->spacing)
+		from = b->last + b->spacing;
+	while (from < until) {
+		unsigned long at, end, lo, hi;
+		if (strays (c, from)) {
+			*t = from;
+			*value = curve_value (c, from);
+			return 1;
+		}
+		if (c->shape == CURVE_RAMP) {
+			if (from >= c->start + c->length)
+				return 0;
+			at = from - c->start;
+		} else
+			at = (from - c->start)%c->length;
+		/* the end of the stretch between two samples */
+		end = from - at + sample_start (c->length, at*CURVE_SAMPLES/c->length + 1);
+		if (end > until)
+			end = until;
+		if (strays (c, end - 1)) {
+			/* in here it strays once and for all: find where */
+			lo = from;
+			hi = end - 1;
+			while (hi - lo > 1) {
+				unsigned long mid = lo + (hi - lo)/2;
+				if (strays (c, mid))
+					hi = mid;
+				else
+					lo = mid;
+			}
+			*t = hi;
+			*value = curve_value (c, hi);
+			return 1;
+		}
+		from = end;
+	}
+	return 0;
+}
+
+void curve_emit (CURVE * c, CURVE_BUDGET * b, unsigned long t, long value)
+{
+	c->emitted = value;
+	b->used = 1;
+	b->last = t;
+}
+
+/* the value a curve settles on once it is over */
+long curve_final (CURVE * c)
+{
+	return c->shape == CURVE_RAMP ? c->to : c->from;
+}
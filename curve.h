@@ -0,0 +1,52 @@
+/* Controller and pitch bend curves (gamakas and ramps)
+ * HS
+ */
+#ifndef _CURVE_H_
+#define _CURVE_H_
+
+#define CURVE_SAMPLES 32   /* samples in a shape table */
+#define CURVE_SCALE   1024 /* full scale of a shape table */
+
+/* shapes -- also used as masks */
+#define CURVE_RAMP    1    /* straight line from one value to another */
+#define CURVE_KAMPITA 2    /* oscillation between a value and a peak */
+#define CURVE_ALL     (CURVE_RAMP|CURVE_KAMPITA)
+
+#define PITCH_BEND_CENTER   0x2000
+#define PITCH_BEND_SEMITONE 0x1000 /* with the default bend range of 2 semitones */
+
+struct curve_t
+{
+	int shape;
+	unsigned char type;        /* VOICE_EVENT_CONTROLLER or VOICE_EVENT_PITCH_BEND */
+	unsigned char controller;
+	long from;                 /* value at the start */
+	long to;                   /* value at the end of a ramp, the peak of an oscillation */
+	long range;                /* full scale of the value */
+	unsigned long start;
+	unsigned long length;      /* length of a ramp, period of an oscillation */
+	long emitted;              /* last value written */
+	long tolerance;            /* largest deviation allowed from the curve */
+};
+
+/* limits on the events written for the curves of one channel */
+struct curve_budget_t
+{
+	unsigned long spacing;     /* minimum ticks between two curve events */
+	int error;                 /* allowed deviation, in percent of a curve's full scale */
+	int used;                  /* an event has been written */
+	unsigned long last;        /* time of the last event */
+};
+
+typedef struct curve_t        CURVE;
+typedef struct curve_budget_t CURVE_BUDGET;
+
+void curve_budget_init (CURVE_BUDGET * b, unsigned long tpqn, unsigned long events, int error);
+long curve_value       (CURVE * c, unsigned long t);
+void curve_start       (CURVE * c, CURVE_BUDGET * b);
+int  curve_next        (CURVE * c, CURVE_BUDGET * b, unsigned long from, unsigned long until,
+                        unsigned long * t, long * value);
+void curve_emit        (CURVE * c, CURVE_BUDGET * b, unsigned long t, long value);
+long curve_final       (CURVE * c);
+
+#endif /* _CURVE_H_ */
@@ -0,0 +1,88 @@
+/*
+ * XXH64 - HS
+ * Yann Collet's xxHash, 64 bit version. It reads 32 bytes at a time
+ * through four independent lanes, which keeps it close to memory speed.
+ * Words are read a byte at a time so it works on any alignment and
+ * either byte order.
+ */
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define rotl(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static HASH read64 (const unsigned char * p)
+{
+	return (HASH)p[0] | (HASH)p[1]<<8 | (HASH)p[2]<<16 | (HASH)p[3]<<24
+	     | (HASH)p[4]<<32 | (HASH)p[5]<<40 | (HASH)p[6]<<48 | (HASH)p[7]<<56;
+}
+
+static HASH read32 (const unsigned char * p)
+{
+	return (HASH)p[0] | (HASH)p[1]<<8 | (HASH)p[2]<<16 | (HASH)p[3]<<24;
+}
+
+static HASH round64 (HASH acc, HASH input)
+{
+	acc += input*PRIME2;
+	acc = rotl (acc, 31);
+	return acc*PRIME1;
+}
+
+static HASH merge64 (HASH acc, HASH lane)
+{
+	acc ^= round64 (0, lane);
+	return acc*PRIME1 + PRIME4;
+}
+
+HASH hash64 (const void * data, size_t len, HASH seed)
+{
+	const unsigned char * p = data;
+	const unsigned char * end = p + len;
+	HASH h;
+
+	if (len >= 32) {
+		HASH v1 = seed + PRIME1 + PRIME2;
+		HASH v2 = seed + PRIME2;
+		HASH v3 = seed;
+		HASH v4 = seed - PRIME1;
+		do {
+			v1 = round64 (v1, read64 (p));
+			v2 = round64 (v2, read64 (p+8));
+			v3 = round64 (v3, read64 (p+16));
+			v4 = round64 (v4, read64 (p+24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = rotl (v1, 1) + rotl (v2, 7) + rotl (v3, 12) + rotl (v4, 18);
+		h = merge64 (h, v1);
+		h = merge64 (h, v2);
+		h = merge64 (h, v3);
+		h = merge64 (h, v4);
+	} else
+		h = seed + PRIME5;
+	h += (HASH)len;
+
+	for (;p + 8 <= end;p += 8) {
+		h ^= round64 (0, read64 (p));
+		h = rotl (h, 27)*PRIME1 + PRIME4;
+	}
+	if (p + 4 <= end) {
+		h ^= read32 (p)*PRIME1;
+		h = rotl (h, 23)*PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (;p < end;p++) {
+		h ^= (*p)*PRIME5;
+		h = rotl (h, 11)*PRIME1;
+	}
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,14 @@
+/* 64 bit hashes of byte strings
+ * HS
+ */
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+
+typedef unsigned long long HASH;
+
+/* XXH64 of 'len' bytes */
+HASH hash64 (const void * data, size_t len, HASH seed);
+
+#endif /* _HASH_H_ */
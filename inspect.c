@@ -0,0 +1,292 @@
+/*
+ * Midi file inspector - HS
+ * cmc-inspect decodes midi files as they are read, a piece at a time,
+ * so a file coming down a pipe ('-' for standard input) is inspected
+ * without being stored anywhere first. It prints the header and, for
+ * every track, how many events and notes it has, the channels it plays
+ * on and the tick it ends at. With -a the file is indexed instead, and
+ * what each track is playing at that time is printed.
+ */
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "midi.h"
+#include "stream.h"
+#include "util.h"
+
+#define PROG_INSPECT "cmc-inspect"
+#define READ_SIZE (64*1024)
+
+struct track_info_t
+{
+	unsigned long events;
+	unsigned long notes;
+	unsigned long last_tick;
+	unsigned int channels;     /* a bit for every channel used */
+	char name[64];
+};
+
+struct inspect_t
+{
+	const char * path;
+	MIDI_PUSH * push;
+	struct track_info_t * tracks;
+	size_t capacity;
+	int errors;
+};
+
+typedef struct track_info_t TRACK_INFO;
+typedef struct inspect_t    INSPECT;
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/* the track the decoder is in, counted as it starts */
+static TRACK_INFO * track (INSPECT * in, unsigned long tick)
+{
+	size_t i = in->push->tracks - 1;
+	TRACK_INFO * t;
+	if (i >= in->capacity) {
+		size_t capacity = in->capacity * 2;
+		in->tracks = xrealloc (in->tracks, capacity*sizeof(TRACK_INFO));
+		memset (in->tracks + in->capacity, 0, (capacity - in->capacity)*sizeof(TRACK_INFO));
+		in->capacity = capacity;
+	}
+	t = in->tracks + i;
+	t->events++;
+	t->last_tick = tick;
+	return t;
+}
+
+static void on_note (void * ctx, unsigned long tick, unsigned char channel,
+                     unsigned char type, unsigned char note, unsigned char velocity)
+{
+	TRACK_INFO * t = track (ctx, tick);
+	t->channels |= 1 << channel;
+	if (type == VOICE_EVENT_NOTE_ON && velocity)
+		t->notes++;
+}
+
+static void on_channel (void * ctx, unsigned long tick, unsigned char channel,
+                        unsigned char data1, unsigned char data2)
+{
+	track (ctx, tick)->channels |= 1 << channel;
+}
+
+static void on_voice (void * ctx, unsigned long tick, unsigned char channel,
+                      unsigned char type, unsigned char data1, unsigned char data2)
+{
+	track (ctx, tick)->channels |= 1 << channel;
+}
+
+static void on_meta (void * ctx, unsigned long tick, unsigned char type,
+                     unsigned char raw_type, const unsigned char * data, unsigned long length)
+{
+	TRACK_INFO * t = track (ctx, tick);
+	if (type == META_EVENT_TRACK_NAME && !t->name[0]) {
+		if (length >= sizeof(t->name))
+			length = sizeof(t->name) - 1;
+		memcpy (t->name, data, length);
+		t->name[length] = '\0';
+	}
+}
+
+static void on_sysex (void * ctx, unsigned long tick, unsigned char type,
+                      const unsigned char * data, unsigned long length)
+{
+	track (ctx, tick);
+}
+
+static void on_mode (void * ctx, unsigned long tick, unsigned char channel,
+                     unsigned char type, unsigned char data)
+{
+	track (ctx, tick)->channels |= 1 << channel;
+}
+
+static void on_error (void * ctx, const char * message)
+{
+	INSPECT * in = ctx;
+	if (in->push->tracks)
+		fprintf (stderr, "%s: %s: track %lu: %s", PROG_INSPECT, in->path,
+		         (unsigned long)in->push->tracks, message);
+	else
+		fprintf (stderr, "%s: %s: %s", PROG_INSPECT, in->path, message);
+	in->errors++;
+}
+
+static const MIDI_VISITOR visitor = {
+	on_note, on_channel, on_voice, on_meta, on_sysex, on_mode, on_error
+};
+
+static void print_info (INSPECT * in)
+{
+	MIDI_FILE * mf = &in->push->header;
+	size_t i;
+	int c;
+	printf ("%s: format %u, %lu tracks, ", in->path, mf->format, (unsigned long)mf->tracks);
+	if (mf->division == DIVISION_TQN)
+		printf ("%u ticks per quarter note\n", mf->tpqn);
+	else
+		printf ("%u ticks per frame at %u frames per second\n", mf->tpf, mf->fps);
+	for (i=0;i<in->push->tracks;i++) {
+		TRACK_INFO * t = in->tracks + i;
+		printf ("  track %lu", (unsigned long)i + 1);
+		if (t->name[0])
+			printf (" \"%s\"", t->name);
+		printf (": %lu events, %lu notes, ends at tick %lu, channels", t->events, t->notes, t->last_tick);
+		if (!t->channels)
+			printf (" none");
+		for (c=0;c<16;c++)
+			if (t->channels & (1 << c))
+				printf (" %d", c + 1);
+		printf ("\n");
+	}
+}
+
+/* Returns the number of events, or -1 if the file can't be inspected */
+static long inspect (const char * path, unsigned char * buffer)
+{
+	INSPECT in;
+	long events = 0;
+	ssize_t n;
+	size_t i;
+	int fd = strcmp (path, "-") ? open (path, O_RDONLY) : 0;
+	if (fd < 0) {
+		fprintf (stderr, "%s: Unable to open file:%s\n", PROG_INSPECT, path);
+		return -1;
+	}
+	in.path = path;
+	in.push = midi_push_create (&visitor, &in);
+	in.capacity = 16;
+	in.tracks = xmalloc (in.capacity*sizeof(TRACK_INFO));
+	memset (in.tracks, 0, in.capacity*sizeof(TRACK_INFO));
+	in.errors = 0;
+	while ((n = read (fd, buffer, READ_SIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "%s: Unable to read file:%s\n", PROG_INSPECT, path);
+			in.errors++;
+			break;
+		}
+		if (!midi_push_feed (in.push, buffer, n))
+			break;
+	}
+	if (n == 0)
+		midi_push_end (in.push);
+	if (fd)
+		close (fd);
+	if (in.push->tracks || !in.errors)
+		print_info (&in);
+	for (i=0;i<in.push->tracks;i++)
+		events += in.tracks[i].events;
+	midi_push_free (in.push);
+	xfree (in.tracks);
+	return in.errors ? -1 : events;
+}
+
+/* seconds, or minutes:seconds. Returns -1 if it is neither */
+static double parse_time (const char * text)
+{
+	char * end;
+	double t = strtod (text, &end);
+	if (*end == ':')
+		t = t*60 + strtod (end + 1, &end);
+	return *end || t < 0 ? -1 : t;
+}
+
+/* the notes held on every track at a time, found through the index */
+static int inspect_at (const char * path, double seconds)
+{
+	MIDI_READER * r = midi_reader_open (path);
+	MIDI_INDEX * index;
+	MIDI_CHANNEL_STATE channels[16];
+	unsigned long tick;
+	size_t i;
+	int c, n;
+	if (!r) {
+		fprintf (stderr, "%s: Unable to read midi file:%s\n", PROG_INSPECT, path);
+		return 0;
+	}
+	index = midi_reader_index (r);
+	tick = midi_index_tick (index, seconds*1e6);
+	printf ("%s: at %d:%06.3f, tick %lu\n", path, (int)(seconds/60),
+	        seconds - 60*(int)(seconds/60), tick);
+	for (i=0;i<r->track_count;i++) {
+		size_t event = midi_index_seek (index, i, tick, channels);
+		int playing = 0;
+		printf ("  track %lu: event %lu of %lu\n", (unsigned long)i + 1,
+		        (unsigned long)event, (unsigned long)r->events[i]->count);
+		for (c=0;c<16;c++) {
+			for (n=0;n<128;n++)
+				if (channels[c].held[n>>3] & (1 << (n & 7)))
+					break;
+			if (n == 128)
+				continue;
+			printf ("    channel %d program %u volume %u pan %u notes", c + 1,
+			        channels[c].program, channels[c].volume, channels[c].pan);
+			for (;n<128;n++)
+				if (channels[c].held[n>>3] & (1 << (n & 7)))
+					printf (" %d", n);
+			printf ("\n");
+			playing = 1;
+		}
+		if (!playing)
+			printf ("    nothing playing\n");
+	}
+	midi_reader_close (r);
+	return 1;
+}
+
+static void usage (void)
+{
+	fprintf (stderr, "%s: usage %s [-a [minutes:]seconds] file.mid ... ('-' reads standard input)\n",
+	         PROG_INSPECT, PROG_INSPECT);
+	exit (1);
+}
+
+int main (int argc, char ** argv)
+{
+	unsigned char * buffer;
+	unsigned long total = 0;
+	double start, elapsed, at = -1;
+	int failed = 0;
+
+	argv++;
+	if (*argv && !strcmp (*argv, "-a")) {
+		if (!argv[1] || (at = parse_time (argv[1])) < 0)
+			usage ();
+		argv += 2;
+	}
+	if (!*argv)
+		usage ();
+	if (at >= 0) {
+		for (;*argv;argv++)
+			failed |= !inspect_at (*argv, at);
+		return failed;
+	}
+	buffer = xmalloc (READ_SIZE);
+	start = now ();
+	for (;*argv;argv++) {
+		long events = inspect (*argv, buffer);
+		if (events < 0)
+			failed = 1;
+		else
+			total += events;
+	}
+	elapsed = now () - start;
+	fprintf (stderr, "%lu events in %.3fs, %.0f events/s\n", total, elapsed,
+	         elapsed > 0 ? total/elapsed : 0);
+	xfree (buffer);
+	return failed;
+}
@@ -0,0 +1,577 @@
+/*
+ * Bulk file I/O - HS
+ * Reads and writes whole files, many at a time. With io_uring the
+ * opens, reads, writes and closes of up to IO_DEPTH files are in flight
+ * at once and go to the kernel a whole ring at a time, so a group of
+ * files costs a few system calls rather than four or more per file.
+ * Reads go into buffers registered with the ring once, when it is set
+ * up, and reused for every file. Where io_uring can't be had a few
+ * threads do the same with ordinary system calls.
+ *
+ * The ring is talked to with the raw system calls, there is no library
+ * to link with.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_IO_URING
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <linux/io_uring.h>
+#endif
+
+#include "stream.h"
+#include "util.h"
+#include "io.h"
+
+#define IO_DEPTH   64            /* files in flight at once */
+#define IO_BUFFER  (32*1024)     /* read at a time */
+#define IO_THREADS 4
+
+#define load_acquire(x)    __atomic_load_n (&(x), __ATOMIC_ACQUIRE)
+#define store_release(x,v) __atomic_store_n (&(x), (v), __ATOMIC_RELEASE)
+
+enum slot_state_t
+{
+	SLOT_OPEN, SLOT_READ, SLOT_WRITE, SLOT_CLOSE
+};
+
+/* a file in flight on the ring */
+struct slot_t
+{
+	IO_FILE * file;        /* NULL if the slot is free */
+	int fd;
+	enum slot_state_t state;
+	unsigned long offset;
+};
+
+struct io_engine_t
+{
+	const char * name;
+	int uring;
+#ifdef HAVE_IO_URING
+	int ring;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_entries;
+	unsigned * sq_array;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_sqe * sqes;
+	struct io_uring_cqe * cqes;
+	void * sq_map;
+	void * cq_map;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned queued;       /* entries not submitted yet */
+	int registered;        /* the buffers are registered with the ring */
+	int writing;
+	int current;           /* the slot whose completion is being seen to */
+	int broken;            /* a run bailed and the ring couldn't be emptied */
+	char * buffers;        /* IO_BUFFER for every slot */
+	struct slot_t slots[IO_DEPTH];
+#endif
+
+	/* the threads */
+	pthread_t threads[IO_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	IO_FILE * files;
+	size_t count;
+	size_t next;           /* the next file a thread can take */
+	size_t finished;
+	int write;
+	int stop;
+};
+
+static void close_held (void * fd)
+{
+	close (*(int *)fd);
+}
+
+static void read_file (IO_FILE * f)
+{
+	char buffer[IO_BUFFER];
+	ssize_t n;
+	int fd = open (f->path, O_RDONLY|O_CLOEXEC);
+	f->error = 0;
+	if (fd < 0) {
+		f->error = errno;
+		return;
+	}
+	bail_hold (&fd, close_held);
+	while ((n = read (fd, buffer, IO_BUFFER)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			f->error = errno;
+			break;
+		}
+		stream_write (f->data, buffer, n);
+	}
+	bail_drop (&fd);
+	close (fd);
+}
+
+static void write_file (IO_FILE * f)
+{
+	char * p = f->data->buffer;
+	size_t len = f->data->size;
+	int fd = open (f->path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	f->error = 0;
+	if (fd < 0) {
+		f->error = errno;
+		return;
+	}
+	while (len) {
+		ssize_t n = write (fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			f->error = errno;
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+	if (close (fd) < 0 && !f->error)
+		f->error = errno;
+}
+
+static void * io_thread (void * arg)
+{
+	IO_ENGINE * io = arg;
+	BAIL_HANDLER handler;
+	pthread_mutex_lock (&io->lock);
+	while (1) {
+		IO_FILE * f;
+		while (!io->stop && io->next >= io->count)
+			pthread_cond_wait (&io->work, &io->lock);
+		if (io->stop)
+			break;
+		f = io->files + io->next++;
+		pthread_mutex_unlock (&io->lock);
+		/* running out of the memory budget fails the file, not the
+		 * program */
+		if (setjmp (handler.env)) {
+			bail_catch (NULL);
+			f->error = ENOMEM;
+		} else {
+			bail_catch (&handler);
+			if (io->write)
+				write_file (f);
+			else
+				read_file (f);
+			bail_catch (NULL);
+		}
+		pthread_mutex_lock (&io->lock);
+		if (++io->finished == io->count)
+			pthread_cond_signal (&io->done);
+	}
+	pthread_mutex_unlock (&io->lock);
+	return NULL;
+}
+
+static void threads_start (IO_ENGINE * io)
+{
+	int i;
+	io->name = "threads";
+	io->count = io->next = io->finished = 0;
+	io->stop = 0;
+	pthread_mutex_init (&io->lock, NULL);
+	pthread_cond_init (&io->work, NULL);
+	pthread_cond_init (&io->done, NULL);
+	for (i=0;i<IO_THREADS;i++)
+		if (pthread_create (io->threads + i, NULL, io_thread, io))
+			bail ("Unable to start an I/O thread\n");
+}
+
+static void threads_run (IO_ENGINE * io, IO_FILE * files, size_t count, int write)
+{
+	if (!count)
+		return;
+	pthread_mutex_lock (&io->lock);
+	io->files = files;
+	io->count = count;
+	io->next = io->finished = 0;
+	io->write = write;
+	pthread_cond_broadcast (&io->work);
+	while (io->finished < io->count)
+		pthread_cond_wait (&io->done, &io->lock);
+	io->count = io->next = 0;
+	pthread_mutex_unlock (&io->lock);
+}
+
+static void threads_stop (IO_ENGINE * io)
+{
+	int i;
+	pthread_mutex_lock (&io->lock);
+	io->stop = 1;
+	pthread_cond_broadcast (&io->work);
+	pthread_mutex_unlock (&io->lock);
+	for (i=0;i<IO_THREADS;i++)
+		pthread_join (io->threads[i], NULL);
+	pthread_mutex_destroy (&io->lock);
+	pthread_cond_destroy (&io->work);
+	pthread_cond_destroy (&io->done);
+}
+
+#ifdef HAVE_IO_URING
+static int ring_setup (IO_ENGINE * io)
+{
+	struct io_uring_params p;
+	struct io_uring_probe * probe;
+	struct iovec iov[IO_DEPTH];
+	size_t probe_size;
+	int i, ok;
+
+	memset (&p, 0, sizeof(p));
+	io->ring = syscall (__NR_io_uring_setup, IO_DEPTH, &p);
+	if (io->ring < 0)
+		return 0;
+	/* the opcodes the slots go through */
+	probe_size = sizeof(*probe) + 256*sizeof(struct io_uring_probe_op);
+	probe = xmalloc (probe_size);
+	memset (probe, 0, probe_size);
+	ok = !syscall (__NR_io_uring_register, io->ring, IORING_REGISTER_PROBE, probe, 256);
+	if (ok)
+		ok = probe->last_op >= IORING_OP_WRITE
+		     && (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+		     && (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED)
+		     && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+		     && (probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED)
+		     && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	xfree (probe);
+	if (!ok) {
+		close (io->ring);
+		return 0;
+	}
+
+	io->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	io->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (io->cq_size > io->sq_size)
+			io->sq_size = io->cq_size;
+		io->cq_size = io->sq_size;
+	}
+	io->sq_map = mmap (NULL, io->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	                   io->ring, IORING_OFF_SQ_RING);
+	if (io->sq_map == MAP_FAILED) {
+		close (io->ring);
+		return 0;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		io->cq_map = io->sq_map;
+	else
+		io->cq_map = mmap (NULL, io->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		                   io->ring, IORING_OFF_CQ_RING);
+	io->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	io->sqes = mmap (NULL, io->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	                 io->ring, IORING_OFF_SQES);
+	if (io->cq_map == MAP_FAILED || io->sqes == MAP_FAILED)
+		bail ("Unable to map the io_uring rings\n");
+	io->sq_head = (unsigned *)((char *)io->sq_map + p.sq_off.head);
+	io->sq_tail = (unsigned *)((char *)io->sq_map + p.sq_off.tail);
+	io->sq_mask = (unsigned *)((char *)io->sq_map + p.sq_off.ring_mask);
+	io->sq_entries = (unsigned *)((char *)io->sq_map + p.sq_off.ring_entries);
+	io->sq_array = (unsigned *)((char *)io->sq_map + p.sq_off.array);
+	io->cq_head = (unsigned *)((char *)io->cq_map + p.cq_off.head);
+	io->cq_tail = (unsigned *)((char *)io->cq_map + p.cq_off.tail);
+	io->cq_mask = (unsigned *)((char *)io->cq_map + p.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe *)((char *)io->cq_map + p.cq_off.cqes);
+	io->queued = 0;
+
+	/* reads still work from buffers that couldn't be registered, just
+	 * with the pages looked up every time */
+	io->buffers = xmalloc (IO_DEPTH*IO_BUFFER);
+	for (i=0;i<IO_DEPTH;i++) {
+		iov[i].iov_base = io->buffers + i*IO_BUFFER;
+		iov[i].iov_len = IO_BUFFER;
+		io->slots[i].file = NULL;
+	}
+	io->registered = !syscall (__NR_io_uring_register, io->ring, IORING_REGISTER_BUFFERS,
+	                           iov, IO_DEPTH);
+	io->current = -1;
+	io->broken = 0;
+	io->name = "uring";
+	return 1;
+}
+
+static void ring_enter (IO_ENGINE * io, unsigned wait)
+{
+	while (syscall (__NR_io_uring_enter, io->ring, io->queued, wait,
+	                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+		if (errno != EINTR)
+			bail ("Unable to submit I/O:%s\n",strerror (errno));
+	io->queued = 0;
+}
+
+static struct io_uring_sqe * ring_sqe (IO_ENGINE * io, int slot, int opcode, int fd)
+{
+	struct io_uring_sqe * sqe;
+	unsigned tail = *io->sq_tail;
+	unsigned index;
+	/* never full: a slot has one entry in flight at a time */
+	index = tail & *io->sq_mask;
+	sqe = io->sqes + index;
+	memset (sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = slot;
+	io->sq_array[index] = index;
+	store_release (*io->sq_tail, tail + 1);
+	io->queued++;
+	return sqe;
+}
+
+static void slot_next (IO_ENGINE * io, int i)
+{
+	struct slot_t * s = io->slots + i;
+	struct io_uring_sqe * sqe;
+	STREAM * data = s->file->data;
+	switch (s->state) {
+		case SLOT_OPEN:
+			sqe = ring_sqe (io, i, IORING_OP_OPENAT, AT_FDCWD);
+			sqe->addr = (unsigned long)s->file->path;
+			if (io->writing) {
+				sqe->open_flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+				sqe->len = 0644;
+			} else
+				sqe->open_flags = O_RDONLY|O_CLOEXEC;
+			break;
+		case SLOT_READ:
+			sqe = ring_sqe (io, i, io->registered ? IORING_OP_READ_FIXED : IORING_OP_READ, s->fd);
+			sqe->addr = (unsigned long)(io->buffers + i*IO_BUFFER);
+			sqe->len = IO_BUFFER;
+			sqe->off = s->offset;
+			sqe->buf_index = i;
+			break;
+		case SLOT_WRITE:
+			sqe = ring_sqe (io, i, IORING_OP_WRITE, s->fd);
+			sqe->addr = (unsigned long)(data->buffer + s->offset);
+			sqe->len = data->size - s->offset;
+			sqe->off = s->offset;
+			break;
+		case SLOT_CLOSE:
+			ring_sqe (io, i, IORING_OP_CLOSE, s->fd);
+			break;
+	}
+}
+
+/* what to do after an entry of a slot has completed. Returns 0 once the
+ * file is done with */
+static int slot_done (IO_ENGINE * io, int i, int res)
+{
+	struct slot_t * s = io->slots + i;
+	IO_FILE * f = s->file;
+	if (s->state == SLOT_CLOSE) {
+		if (res < 0 && !f->error)
+			f->error = -res;
+		s->file = NULL;
+		return 0;
+	}
+	if (res < 0) {
+		f->error = -res;
+		if (s->state == SLOT_OPEN) {
+			s->file = NULL;
+			return 0;
+		}
+		s->state = SLOT_CLOSE;
+	} else if (s->state == SLOT_OPEN) {
+		s->fd = res;
+		s->offset = 0;
+		s->state = io->writing ? SLOT_WRITE : SLOT_READ;
+		if (io->writing && !f->data->size)
+			s->state = SLOT_CLOSE;
+	} else if (s->state == SLOT_READ) {
+		if (res)
+			stream_write (f->data, io->buffers + i*IO_BUFFER, res);
+		else
+			s->state = SLOT_CLOSE;
+		s->offset += res;
+	} else if (s->state == SLOT_WRITE) {
+		s->offset += res;
+		if (!res) {
+			f->error = EIO;
+			s->state = SLOT_CLOSE;
+		} else if (s->offset == f->data->size)
+			s->state = SLOT_CLOSE;
+	}
+	slot_next (io, i);
+	return 1;
+}
+
+/* a slot is done with: close the file an entry of it left open */
+static void slot_drop (IO_ENGINE * io, int i, int res)
+{
+	struct slot_t * s = io->slots + i;
+	if (s->state == SLOT_OPEN && res >= 0)
+		close (res);
+	else if (s->state == SLOT_READ || s->state == SLOT_WRITE)
+		close (s->fd);
+	s->file = NULL;
+}
+
+/* a run bailed on the way: wait for the entries still in flight and
+ * close what they leave open, so the ring is empty for the next run.
+ * Only the file being read into when it bailed has failed: what
+ * wasn't done is left ECANCELED to be tried again */
+static void ring_abandon (void * arg)
+{
+	IO_ENGINE * io = arg;
+	int i, active = 0;
+	/* its entry has completed and the next one wasn't made */
+	if (io->current >= 0) {
+		io->slots[io->current].file->error = ENOMEM;
+		slot_drop (io, io->current, -1);
+	}
+	io->current = -1;
+	for (i=0;i<IO_DEPTH;i++)
+		if (io->slots[i].file)
+			active++;
+	while (active) {
+		unsigned head, tail;
+		if (syscall (__NR_io_uring_enter, io->ring, io->queued, 1,
+		             IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+			if (errno == EINTR)
+				continue;
+			io->broken = 1;
+			return;
+		}
+		io->queued = 0;
+		head = *io->cq_head;
+		tail = load_acquire (*io->cq_tail);
+		for (;head != tail;head++) {
+			struct io_uring_cqe * cqe = io->cqes + (head & *io->cq_mask);
+			if (io->slots[cqe->user_data].file) {
+				io->slots[cqe->user_data].file->error = ECANCELED;
+				slot_drop (io, (int)cqe->user_data, cqe->res);
+				active--;
+			}
+		}
+		store_release (*io->cq_head, head);
+	}
+}
+
+static void ring_run (IO_ENGINE * io, IO_FILE * files, size_t count, int write)
+{
+	size_t next = 0, active = 0;
+	int i;
+	if (io->broken) {
+		for (next=0;next<count;next++)
+			files[next].error = EIO;
+		return;
+	}
+	io->writing = write;
+	for (i=0;(size_t)i<count;i++)
+		files[i].error = ECANCELED;
+	bail_hold (io, ring_abandon);
+	while (next < count || active) {
+		unsigned head, tail;
+		for (i=0;i<IO_DEPTH && next<count;i++)
+			if (!io->slots[i].file) {
+				struct slot_t * s = io->slots + i;
+				s->file = files + next++;
+				s->file->error = 0;
+				s->state = SLOT_OPEN;
+				slot_next (io, i);
+				active++;
+			}
+		ring_enter (io, 1);
+		head = *io->cq_head;
+		tail = load_acquire (*io->cq_tail);
+		/* each completion is taken off before it is seen to, so a
+		 * bail leaves the ring as it is */
+		while (head != tail) {
+			struct io_uring_cqe * cqe = io->cqes + (head & *io->cq_mask);
+			int slot = (int)cqe->user_data, res = cqe->res;
+			store_release (*io->cq_head, ++head);
+			io->current = slot;
+			if (!slot_done (io, slot, res))
+				active--;
+			io->current = -1;
+		}
+	}
+	bail_drop (io);
+}
+
+static void ring_close (IO_ENGINE * io)
+{
+	munmap (io->sqes, io->sqes_size);
+	if (io->cq_map != io->sq_map)
+		munmap (io->cq_map, io->cq_size);
+	munmap (io->sq_map, io->sq_size);
+	close (io->ring);
+	xfree (io->buffers);
+}
+#endif /* HAVE_IO_URING */
+
+/* "uring" falls back to threads where it can't be set up */
+IO_ENGINE * io_engine_open (char * name)
+{
+	IO_ENGINE * io = xmalloc (sizeof(IO_ENGINE));
+	io->uring = 0;
+	if (!strcmp (name, "uring")) {
+#ifdef HAVE_IO_URING
+		io->uring = ring_setup (io);
+#endif
+		if (!io->uring)
+			warn ("io_uring isn't available, using threads for I/O\n");
+	} else if (strcmp (name, "threads")) {
+		xfree (io);
+		bail ("Unknown I/O engine:%s\n",name);
+	}
+	if (!io->uring)
+		threads_start (io);
+	return io;
+}
+
+const char * io_engine_name (IO_ENGINE * io)
+{
+	return io->name;
+}
+
+void io_read_files (IO_ENGINE * io, IO_FILE * files, size_t count)
+{
+#ifdef HAVE_IO_URING
+	if (io->uring) {
+		ring_run (io, files, count, 0);
+		return;
+	}
+#endif
+	threads_run (io, files, count, 0);
+}
+
+void io_write_files (IO_ENGINE * io, IO_FILE * files, size_t count)
+{
+#ifdef HAVE_IO_URING
+	if (io->uring) {
+		ring_run (io, files, count, 1);
+		return;
+	}
+#endif
+	threads_run (io, files, count, 1);
+}
+
+void io_engine_close (IO_ENGINE * io)
+{
+#ifdef HAVE_IO_URING
+	if (io->uring)
+		ring_close (io);
+	else
+#endif
+		threads_stop (io);
+	xfree (io);
+}
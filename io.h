@@ -0,0 +1,27 @@
+/* Reading and writing whole files in bulk
+ * HS
+ */
+#ifndef _IO_H_
+#define _IO_H_
+
+#include "stream.h"
+
+/* a file read into 'data', or written from it */
+struct io_file_t
+{
+	char * path;
+	STREAM * data;
+	int error;             /* errno if it went wrong, 0 if not */
+};
+
+struct io_engine_t;
+typedef struct io_file_t   IO_FILE;
+typedef struct io_engine_t IO_ENGINE;
+
+IO_ENGINE *  io_engine_open  (char * name);
+const char * io_engine_name  (IO_ENGINE * io);
+void         io_read_files   (IO_ENGINE * io, IO_FILE * files, size_t count);
+void         io_write_files  (IO_ENGINE * io, IO_FILE * files, size_t count);
+void         io_engine_close (IO_ENGINE * io);
+
+#endif /* _IO_H_ */
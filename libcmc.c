@@ -0,0 +1,184 @@
+/*
+ * The library interface - HS
+ * The caller's buffers are handed to the encoder as STREAMs and taken
+ * back once it is done, grown or not. Errors come back through this
+ * thread's bail handler.
+ */
+#include <string.h>
+#include <setjmp.h>
+
+#include "stream.h"
+#include "util.h"
+#include "thalam.h"
+#include "cmc.h"
+#include "libcmc.h"
+
+struct compile_t
+{
+	OPTIONS opt;
+	SESSION * session;     /* NULL for a one off compile */
+	STREAM text;
+	STREAM output;
+	STREAM scratch;
+	BAIL_HANDLER handler;
+};
+
+typedef struct compile_t COMPILE;
+
+void cmc_options_init (CMC_OPTIONS * options)
+{
+	OPTIONS opt;
+	options_init (&opt);
+	options->divisions = opt.divisions;
+	options->speed = opt.speed;
+	options->instrument = NULL;
+	options->portamento = opt.portamento;
+	options->thalam = 0;
+	options->thalam_name = NULL;
+	options->thalam_channel = opt.thalam_channel;
+	options->thalam_instrument = NULL;
+	options->curve_events = opt.curve_events;
+	options->curve_error = opt.curve_error;
+	options->tuning = NULL;
+}
+
+/* the settings the encoder would only trip over part way through */
+static int check_options (OPTIONS * opt, char * message)
+{
+	if (opt->speed <= 0)
+		sprintf (message, "Invalid speed:%i\n", opt->speed);
+	else if (opt->divisions > 0x7FFF)
+		sprintf (message, "Invalid divisions:%lu\n", opt->divisions);
+	else if (opt->instrument && instrument_number (opt->instrument) >= INSTRUMENT_COUNT)
+		sprintf (message, "Unknown Instrument:%.64s\n", opt->instrument);
+	else if (strcmp (opt->tuning_name, "bend") && strcmp (opt->tuning_name, "mts"))
+		sprintf (message, "Unknown tuning:%.64s\n", opt->tuning_name);
+	else if (opt->include_thalam && !thalam_cycle (opt->thalam_name))
+		sprintf (message, "Unknown thalam:%.64s\n", opt->thalam_name);
+	else if (opt->include_thalam && opt->thalam_channel > 0xF)
+		sprintf (message, "Invalid thalam channel:%lu\n", opt->thalam_channel);
+	else
+		return 1;
+	return 0;
+}
+
+static int compile (COMPILE * c, const char * notes, size_t len)
+{
+	char * tracks[1];
+	if (setjmp (c->handler.env)) {
+		bail_catch (NULL);
+		return c->handler.out_of_memory ? CMC_ERROR_MEMORY : CMC_ERROR_NOTATION;
+	}
+	bail_catch (&c->handler);
+	stream_write (&c->text, notes, len);
+	stream_add_char (&c->text, '\0');
+	tracks[0] = c->text.buffer;
+	if (c->session)
+		session_encode (c->session, &c->opt, tracks, 1, &c->output, &c->scratch);
+	else
+		encode_file (&c->opt, tracks, 1, &c->output, &c->scratch);
+	bail_catch (NULL);
+	return CMC_OK;
+}
+
+static int compile_song (CMC_SESSION * session, const char * notes, size_t len,
+                         const CMC_OPTIONS * options, CMC_BUFFER * out)
+{
+	COMPILE c;
+	int result;
+
+	c.session = (SESSION *)session;
+	options_init (&c.opt);
+	if (options) {
+		c.opt.divisions = options->divisions;
+		c.opt.auto_divisions = !options->divisions;
+		c.opt.speed = options->speed;
+		c.opt.instrument = (char *)options->instrument;
+		c.opt.portamento = options->portamento;
+		c.opt.include_thalam = options->thalam;
+		if (options->thalam_name)
+			c.opt.thalam_name = (char *)options->thalam_name;
+		c.opt.thalam_channel = options->thalam_channel;
+		c.opt.thalam_instrument = (char *)options->thalam_instrument;
+		c.opt.curve_events = options->curve_events;
+		c.opt.curve_error = options->curve_error;
+		if (options->tuning)
+			c.opt.tuning_name = (char *)options->tuning;
+	}
+	out->size = 0;
+	out->message[0] = '\0';
+	out->warnings[0] = '\0';
+	if (!check_options (&c.opt, out->message))
+		return CMC_ERROR_OPTIONS;
+
+	stream_wrap (&c.text, out->text, out->text_capacity);
+	stream_wrap (&c.output, out->data, out->capacity);
+	stream_wrap (&c.scratch, out->track, out->track_capacity);
+	result = compile (&c, notes, len);
+
+	/* the buffers may have moved, even if the compile failed */
+	out->text = stream_unwrap (&c.text);
+	out->text_capacity = c.text.capacity;
+	out->track = stream_unwrap (&c.scratch);
+	out->track_capacity = c.scratch.capacity;
+	out->data = stream_unwrap (&c.output);
+	out->capacity = c.output.capacity;
+	strcpy (out->warnings, c.handler.warnings);
+	if (result == CMC_OK)
+		out->size = c.output.size;
+	else
+		strcpy (out->message, c.handler.message);
+	return result;
+}
+
+int cmc_compile (const char * notes, size_t len, const CMC_OPTIONS * options,
+                 CMC_BUFFER * out)
+{
+	return compile_song (NULL, notes, len, options, out);
+}
+
+/* the session can't be allocated under a bail handler, so a failure
+ * here ends the program like any other */
+CMC_SESSION * cmc_session_create (void)
+{
+	return (CMC_SESSION *)session_create ();
+}
+
+int cmc_session_compile (CMC_SESSION * session, const char * notes, size_t len,
+                         const CMC_OPTIONS * options, CMC_BUFFER * out)
+{
+	return compile_song (session, notes, len, options, out);
+}
+
+void cmc_session_counts (CMC_SESSION * session, unsigned long * encoded, unsigned long * reused)
+{
+	session_counts ((SESSION *)session, encoded, reused);
+}
+
+void cmc_session_free (CMC_SESSION * session)
+{
+	session_free ((SESSION *)session);
+}
+
+void cmc_buffer_free (CMC_BUFFER * out)
+{
+	if (out->data)
+		free (out->data);
+	if (out->text)
+		free (out->text);
+	if (out->track)
+		free (out->track);
+	out->data = out->text = out->track = NULL;
+	out->size = out->capacity = out->text_capacity = out->track_capacity = 0;
+}
+
+const char * cmc_error_string (int error)
+{
+	switch (error) {
+		case CMC_OK:             return "No error";
+		case CMC_ERROR_OPTIONS:  return "Invalid options";
+		case CMC_ERROR_NOTATION: return "The notation couldn't be compiled";
+		case CMC_ERROR_MEMORY:   return "Out of memory";
+	}
+	return "Unknown error";
+}
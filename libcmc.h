@@ -0,0 +1,76 @@
+/* Compiling notation into midi files from other programs
+ * HS
+ *
+ * cmc_compile never ends the program. A compile that fails returns an
+ * error code with the reason in the buffer's message. Any number of
+ * threads can compile at the same time as long as each one has a
+ * buffer of its own.
+ */
+#ifndef _LIBCMC_H_
+#define _LIBCMC_H_
+
+#include <stddef.h>
+
+#define CMC_OK             0
+#define CMC_ERROR_OPTIONS  1 /* an option has a value that can't be used */
+#define CMC_ERROR_NOTATION 2 /* the notation couldn't be compiled */
+#define CMC_ERROR_MEMORY   3 /* memory ran out */
+
+#define CMC_MESSAGE_SIZE 256
+
+/* the same settings as the command line options of the same names. A
+ * NULL string keeps the default */
+struct cmc_options_t
+{
+	unsigned long divisions;   /* 0 for -d auto */
+	int speed;
+	const char * instrument;
+	int portamento;
+	int thalam;
+	const char * thalam_name;
+	unsigned long thalam_channel;
+	const char * thalam_instrument;
+	unsigned long curve_events;
+	int curve_error;
+	const char * tuning;       /* "bend" or "mts" */
+};
+
+/* The midi file is written to 'data', which is grown with realloc when
+ * it is too small. A buffer that starts out zeroed is fine, and reusing
+ * it saves allocating for every compile. The work areas are kept for
+ * the next compile too */
+struct cmc_buffer_t
+{
+	char * data;
+	size_t size;
+	size_t capacity;
+	char message[CMC_MESSAGE_SIZE];  /* why the compile failed */
+	char warnings[CMC_MESSAGE_SIZE]; /* what was ignored or replaced */
+	char * text;                     /* work areas */
+	size_t text_capacity;
+	char * track;
+	size_t track_capacity;
+};
+
+/* A session keeps what it compiled. Compiling the song again after an
+ * edit only encodes the sections (from one lyric at the start of a line
+ * to the next) that changed. A session is for one thread at a time */
+struct cmc_session_t;
+
+typedef struct cmc_options_t CMC_OPTIONS;
+typedef struct cmc_buffer_t  CMC_BUFFER;
+typedef struct cmc_session_t CMC_SESSION;
+
+void cmc_options_init (CMC_OPTIONS * options);
+int  cmc_compile      (const char * notes, size_t len, const CMC_OPTIONS * options,
+                       CMC_BUFFER * out);
+void cmc_buffer_free  (CMC_BUFFER * out);
+
+CMC_SESSION * cmc_session_create (void);
+int  cmc_session_compile (CMC_SESSION * session, const char * notes, size_t len,
+                          const CMC_OPTIONS * options, CMC_BUFFER * out);
+void cmc_session_counts  (CMC_SESSION * session, unsigned long * encoded, unsigned long * reused);
+void cmc_session_free    (CMC_SESSION * session);
+const char * cmc_error_string (int error);
+
+#endif /* _LIBCMC_H_ */
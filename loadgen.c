@@ -0,0 +1,211 @@
+/*
+ * Load generator for cmc --serve - HS
+ * Every client opens a connection of its own and sends the same song
+ * down it again and again, waiting for each answer before sending the
+ * next request. The time taken by every request is reported at the end.
+ */
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stream.h"
+#include "util.h"
+
+#define PROG_LOADGEN "cmc-loadgen"
+
+struct client_t
+{
+	pthread_t thread;
+	double * latency;      /* seconds, one for every request */
+	unsigned long errors;
+	char * fail;           /* why the client gave up, if it did */
+};
+
+typedef struct client_t CLIENT;
+
+static char * socket_path;
+static STREAM * request;
+static unsigned long requests = 1000;
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static int send_all (int fd, char * data, size_t len)
+{
+	while (len) {
+		ssize_t n = write (fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* read one answer. Returns -1 if the connection broke, 0 for an error
+ * answer and 1 for a midi file */
+static int read_answer (int fd, STREAM * in)
+{
+	char buffer[4096];
+	char * eol;
+	unsigned long len;
+	stream_write_reset (in);
+	while (1) {
+		ssize_t n;
+		if (in->size && (eol = memchr (in->buffer, '\n', in->size))) {
+			len = strtoul (strchr (in->buffer, ' ') + 1, NULL, 10);
+			if ((size_t)(eol + 1 - in->buffer) + len <= in->size)
+				return !strncmp (in->buffer, "OK ", 3);
+		}
+		n = read (fd, buffer, sizeof(buffer));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		stream_write (in, buffer, n);
+	}
+}
+
+static void * client_main (void * arg)
+{
+	CLIENT * c = arg;
+	struct sockaddr_un addr;
+	STREAM * in = stream_create (4096);
+	unsigned long i;
+	int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	memset (&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+	if (fd < 0 || connect (fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		c->fail = "unable to connect";
+		return NULL;
+	}
+	for (i=0;i<requests;i++) {
+		double start = now ();
+		int r;
+		if (!send_all (fd, request->buffer, request->size)) {
+			c->fail = "write failed";
+			break;
+		}
+		r = read_answer (fd, in);
+		if (r < 0) {
+			c->fail = "connection closed";
+			break;
+		}
+		if (!r)
+			c->errors++;
+		c->latency[i] = now () - start;
+	}
+	close (fd);
+	stream_free (in);
+	return NULL;
+}
+
+static int compare_latency (const void * a, const void * b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile (double * sorted, size_t n, int p)
+{
+	size_t rank = (n*p + 99)/100;
+	return 1000*sorted[rank ? rank-1 : 0];
+}
+
+static void usage (void)
+{
+	fprintf (stderr, "%s: usage %s [-c clients] [-n requests] socket notation_file [options]\n",
+	         PROG_LOADGEN, PROG_LOADGEN);
+	exit (1);
+}
+
+int main (int argc, char ** argv)
+{
+	unsigned long clients = 8, i, j, total = 0, errors = 0;
+	STREAM * notes;
+	CLIENT * c;
+	double * all, start, elapsed;
+	char head[32];
+
+	argv++;
+	while (*argv && **argv == '-') {
+		if (!argv[1])
+			usage ();
+		if (!strcmp (*argv, "-c"))
+			clients = strtoul (argv[1], NULL, 10);
+		else if (!strcmp (*argv, "-n"))
+			requests = strtoul (argv[1], NULL, 10);
+		else
+			usage ();
+		argv += 2;
+	}
+	if (!argv[0] || !argv[1] || !clients || !requests)
+		usage ();
+	socket_path = *argv++;
+	notes = stream_load_from_file (*argv);
+	if (!notes)
+		bail ("Unable to open file:%s\n",*argv);
+	argv++;
+
+	/* the request is the same every time */
+	request = stream_create (notes->size + 64);
+	sprintf (head, "%lu", (unsigned long)notes->size);
+	stream_add_str (request, head);
+	for (;*argv;argv++) {
+		stream_add_char (request, ' ');
+		stream_add_str (request, *argv);
+	}
+	stream_add_char (request, '\n');
+	stream_write (request, notes->buffer, notes->size);
+
+	c = xmalloc (clients*sizeof(CLIENT));
+	start = now ();
+	for (i=0;i<clients;i++) {
+		c[i].latency = xmalloc (requests*sizeof(double));
+		c[i].errors = 0;
+		c[i].fail = NULL;
+		for (j=0;j<requests;j++)
+			c[i].latency[j] = -1;
+		if (pthread_create (&c[i].thread, NULL, client_main, c + i))
+			bail ("Unable to start a client thread\n");
+	}
+	for (i=0;i<clients;i++)
+		pthread_join (c[i].thread, NULL);
+	elapsed = now () - start;
+
+	all = xmalloc (clients*requests*sizeof(double));
+	for (i=0;i<clients;i++) {
+		if (c[i].fail)
+			fprintf (stderr, "%s: client %lu: %s\n", PROG_LOADGEN, i, c[i].fail);
+		errors += c[i].errors;
+		for (j=0;j<requests;j++)
+			if (c[i].latency[j] >= 0)
+				all[total++] = c[i].latency[j];
+	}
+	printf ("%lu requests (%lu errors) from %lu clients in %.3fs, %.1f requests/s\n",
+	        total, errors, clients, elapsed, elapsed > 0 ? total/elapsed : 0);
+	if (total) {
+		qsort (all, total, sizeof(double), compare_latency);
+		printf ("latency p50 %.3fms p90 %.3fms p99 %.3fms max %.3fms\n",
+		        percentile (all, total, 50), percentile (all, total, 90),
+		        percentile (all, total, 99), percentile (all, total, 100));
+	}
+	return total && !errors ? 0 : 1;
+}
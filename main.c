@@ -0,0 +1,101 @@
+/*
+ * The cmc command line - HS
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "stream.h"
+#include "util.h"
+#include "cmc.h"
+#include "cache.h"
+
+#ifdef HAVE_ISATTY
+#	include <unistd.h>
+#endif
+
+#define SPILL_SHARE 8 /* of --max-memory the midi file holds before it spills */
+
+int main(int argc, char ** argv)
+{
+	OPTIONS opt;
+	STREAM * note_s, * output, * scratch;
+	char * tracks[MAX_TRACK_COUNT];
+	int track_count = 0;
+	options_init (&opt);
+	if (parse_args (&opt, argv+1) == 0)
+		return 0;
+	if (opt.max_memory)
+		stream_set_budget (opt.max_memory*1024*1024);
+	if (opt.cache_stats) {
+		if (!opt.cache_dir)
+			bail ("--cache-stats needs the --cache directory\n");
+		cache_stats (opt.cache_dir);
+		return 1;
+	}
+#ifdef HAVE_PTHREAD
+	if (opt.batch_file)
+		return run_batch (&opt);
+	/* each of these writes the midi file its own way */
+	if (opt.pipeline && opt.cache_dir)
+		bail ("--pipeline can't be used with --cache\n");
+	if (opt.pipeline && opt.parallel)
+		bail ("--pipeline can't be used with --parallel\n");
+	if (opt.parallel && opt.cache_dir)
+		bail ("--parallel can't be used with --cache\n");
+	if (opt.pipeline)
+		return run_pipeline (&opt);
+#endif
+#ifdef HAVE_EPOLL
+	if (opt.serve_path)
+		return run_server (&opt);
+#endif
+#ifdef HAVE_INOTIFY
+	if (opt.watch)
+		return run_watch (&opt);
+#endif
+	if (!opt.file_count) {
+#ifdef HAVE_ISATTY
+		/* if no text was piped into the program,
+		 * just display usage info and exit */
+		if (isatty (STDIN_FILENO)) {
+			simple_usage();
+			return 1;
+		}
+#endif
+		note_s = stream_create (1);
+		if (!stream_copy_from_io (note_s,stdin))
+			return 0;
+		stream_add_char (note_s, '\0');
+		tracks[0] = stream_take_buffer (note_s);
+		track_count = 1;
+	} else
+		track_count = load_tracks (&opt, tracks);
+	output = stream_create (10);
+	scratch = stream_create (6);
+	if (opt.cache_dir) {
+		CACHE * cache = cache_open (opt.cache_dir, opt.cache_size*1024*1024);
+		cache_compile (cache, &opt, tracks, track_count, output, scratch);
+		cache_close (cache);
+	}
+#ifdef HAVE_PTHREAD
+	else if (opt.parallel)
+		write_parallel (&opt, tracks, track_count);
+#endif
+	else {
+		/* both are only appended to until they are written out */
+		if (opt.max_memory) {
+			stream_spill (output, opt.max_memory*1024*1024/SPILL_SHARE);
+			stream_spill (scratch, opt.max_memory*1024*1024/SPILL_SHARE);
+		}
+		encode_file (&opt, tracks, track_count, output, scratch);
+		if (!opt.output_file || !strcmp(opt.output_file,"-"))
+			stream_write_to_io (output, stdout);
+		else if (!stream_write_to_file (output, opt.output_file))
+			bail ("Unable to write file:%s\n",opt.output_file);
+	}
+	stream_free (output);
+	stream_free (scratch);
+	while (track_count-->0)
+		free (tracks[track_count]);
+	return 1;
+}
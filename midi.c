@@ -3,15 +3,29 @@
  * self-contained code for reading and writing midi files
  */
 
+#define _XOPEN_SOURCE 500 /* vsnprintf */
+#ifdef HAVE_COPY_FILE_RANGE
+#	define _GNU_SOURCE    /* copy_file_range */
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 #define assert_unreachable() assert(0)
 
 #include "midi.h"
 #include "stream.h"
 #include "util.h"
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+#ifdef HAVE_MMAP
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#endif
 
 
 const unsigned char MIDI_VOICE_EVENTS[VOICE_EVENT_COUNT][4] = {
@@ -65,6 +79,50 @@ const unsigned char MIDI_MODE_EVENTS[MODE_EVENT_COUNT][2] = {
 	{0x7F, 0}     /* poly on */
 } ;
 
+#define STATUS_ROW(kind,len) \
+	{kind,len},{kind,len},{kind,len},{kind,len},{kind,len},{kind,len},{kind,len},{kind,len}, \
+	{kind,len},{kind,len},{kind,len},{kind,len},{kind,len},{kind,len},{kind,len},{kind,len}
+
+const unsigned char MIDI_STATUS_EVENTS[256][2] = {
+	/*
+	{EVENT_TYPE_*, bytes of data} for every status byte. Controller
+	changes are mode events when data1 is over 0x77. Bytes below 0x80
+	are data, they only come after a voice or mode event's status
+	 */
+	STATUS_ROW (EVENT_TYPE_UNKNOWN, 0), STATUS_ROW (EVENT_TYPE_UNKNOWN, 0),
+	STATUS_ROW (EVENT_TYPE_UNKNOWN, 0), STATUS_ROW (EVENT_TYPE_UNKNOWN, 0),
+	STATUS_ROW (EVENT_TYPE_UNKNOWN, 0), STATUS_ROW (EVENT_TYPE_UNKNOWN, 0),
+	STATUS_ROW (EVENT_TYPE_UNKNOWN, 0), STATUS_ROW (EVENT_TYPE_UNKNOWN, 0),
+	STATUS_ROW (EVENT_TYPE_VOICE, 2), /* note off */
+	STATUS_ROW (EVENT_TYPE_VOICE, 2), /* note on */
+	STATUS_ROW (EVENT_TYPE_VOICE, 2), /* polyphonic pressure */
+	STATUS_ROW (EVENT_TYPE_VOICE, 2), /* controller change */
+	STATUS_ROW (EVENT_TYPE_VOICE, 1), /* program change */
+	STATUS_ROW (EVENT_TYPE_VOICE, 1), /* channel pressure */
+	STATUS_ROW (EVENT_TYPE_VOICE, 2), /* pitch bend */
+	{EVENT_TYPE_SYSEX, 0xFF},
+	{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+	{EVENT_TYPE_SYSEX, 0xFF},
+	{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+	{EVENT_TYPE_META, 0xFF}
+};
+
+#undef STATUS_ROW
+
+#define U META_EVENT_UNKNOWN
+/* the row of MIDI_META_EVENTS for every meta type */
+static const unsigned char META_TYPES[128] = {
+	0, 1, 2, 3, 4, 5, 6, 7, U, U, U, U, U, U, U, U,
+	U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+	8, U, U, U, U, U, U, U, U, U, U, U, U, U, U, 9,
+	U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+	U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+	U, 0xA, U, U, 0xB, U, U, U, 0xC, 0xD, U, U, U, U, U, U,
+	U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+	U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, 0xE
+};
+#undef U
+
 
 
 const char * MIDI_ERROR_STR[0xe] = {
@@ -90,58 +148,85 @@ const char * MIDI_ERROR_STR[0xe] = {
  * error_report(int,...)
  * and then set midi_error_fun to point to this function.
  * All generated errors will then call your custom function (error_report
- * in this case)
+ * in this case) as error_report(0, message), the message being formatted
+ * already. Errors decoding a track go to the track's own error function
+ * if it has one
  */
-static void (*midi_error_fun)(int ,...) = NULL;
+void (*midi_error_fun)(int ,...) = NULL;
 
+#define ERROR_SIZE 256
+
+static void report (void (*error) (void *, const char *), void * ctx, const char * text, va_list args)
+{
+	char message[ERROR_SIZE];
+	vsnprintf (message, ERROR_SIZE, text, args);
+	if (error)
+		error (ctx, message);
+	else if (midi_error_fun)
+		midi_error_fun (0, message);
+	else
+		fputs (message, stderr);
+}
 
 void printe(const char * text,...)
 {
 	va_list args;
 	va_start (args, text);
-	if (midi_error_fun)
-		midi_error_fun (0, args);
-	else
-		vfprintf (stderr, text, args);
+	report (NULL, NULL, text, args);
+	va_end (args);
+}
+
+static void track_error (MIDI_TRACK * mt, const char * text,...)
+{
+	va_list args;
+	va_start (args, text);
+	report (mt->error, mt->error_ctx, text, args);
 	va_end (args);
 }
 
+/* set up a track to be decoded into. Errors go to 'error' (called with
+ * 'ctx'), or printe if it is NULL */
+void midi_track_init (MIDI_TRACK * mt, void (*error) (void * ctx, const char * message), void * ctx)
+{
+	mt->stream = NULL;
+	mt->next = NULL;
+	mt->running = 0;
+	mt->status = 0;
+	mt->error = error;
+	mt->error_ctx = ctx;
+}
 
 
 
-/* try not to choke on this */
-static int stream_write_variable (STREAM * stream, unsigned int i)
+
+/* the seven bit groups come out lowest first, so they are put in place
+ * from the end of the buffer */
+int stream_write_variable (STREAM * stream, unsigned int i)
 {
-	STREAM * hack;
-	unsigned int j = i;
-	unsigned char x;
-	hack = stream_create(12);
-	x = (j & 0x7F);
-	stream_add_char (hack, x);
-	j >>= 7;
-	while (j) {
-		x = j & 0x7F;
-		j >>= 7;
-		x = x|0x80;
-		stream_add_char (hack, x);
-	}
-	for (j=hack->size;j>0;j--)
-		stream_add_char (stream, hack->buffer[j-1]);
-	stream_free (hack);
+	char bytes[5];
+	size_t n = sizeof(bytes);
+	bytes[--n] = (char)(i & 0x7F);
+	while (i >>= 7)
+		bytes[--n] = (char)((i & 0x7F)|0x80);
+	stream_write (stream, bytes + n, sizeof(bytes) - n);
 	return 1;
 }
 
 
+/* stream_read_char without the call, for the decoding loops */
+#define stream_next(stream,c) \
+	((stream)->r_offset > (int)(stream)->size ? 0 : (*(c) = (stream)->buffer[(stream)->r_offset++], 1))
+
 static unsigned long stream_read_variable (STREAM * stream)
 {
 	long result = 0;
 	unsigned char b;
-	stream_read_char (stream, &b);
+	stream_next (stream, &b);
 	while (1) {
 		result = (result<<7) + (b & 0x7F);
 		if (!(b & 0x80))
 			return result;
-		stream_read_char (stream, &b);
+		stream_next (stream, &b);
 	}
 }
 
@@ -158,31 +243,36 @@ static int write_int_reverse (char * buffer, int i, size_t int_size)
 	return 1;
 }
 
+/* a loop rather than recursion, a long track would run out of stack */
 void free_event_list (MIDI_EVENT * event)
 {
 	MIDI_EVENT * next;
 	assert (event);
-	next = event->next;
-	switch (event->type)
-	{
-		case EVENT_TYPE_META:
-			xfree (event->event.meta_event);
-			break;
-		case EVENT_TYPE_SYSEX:
-			xfree (event->event.sysex_event);
-			break;
-		case EVENT_TYPE_VOICE:
-			xfree (event->event.voice_event);
-			break;
-		case EVENT_TYPE_MODE:
-			xfree (event->event.mode_event);
-			break;
-		default: assert_unreachable();
-			
+	for (;event;event=next) {
+		next = event->next;
+		switch (event->type)
+		{
+			case EVENT_TYPE_META:
+				if (event->event.meta_event->data)
+					xfree (event->event.meta_event->data);
+				xfree (event->event.meta_event);
+				break;
+			case EVENT_TYPE_SYSEX:
+				if (event->event.sysex_event->data)
+					xfree (event->event.sysex_event->data);
+				xfree (event->event.sysex_event);
+				break;
+			case EVENT_TYPE_VOICE:
+				xfree (event->event.voice_event);
+				break;
+			case EVENT_TYPE_MODE:
+				xfree (event->event.mode_event);
+				break;
+			default: assert_unreachable();
+				
+		}
+		xfree (event);
 	}
-	xfree (event);
-	if (next)
-		free_event_list (next);
 }
 
 /* determine the specific voice event from the first byte */
@@ -202,12 +292,7 @@ static unsigned char mode_event_type (unsigned char c)
 }
 static unsigned char meta_event_type (unsigned char c)
 {
-	int i;
-	for (i=0;i<META_EVENT_COUNT;i++)
-		if	(MIDI_META_EVENTS[i][0]==c)
-			return (unsigned char)i;
-	printe("Unknown meta event type:%#x\n",c);
-	return META_EVENT_UNKNOWN;
+	return c < 0x80 ? META_TYPES[c] : META_EVENT_UNKNOWN;
 }
 
 
@@ -219,18 +304,9 @@ static unsigned char meta_event_type (unsigned char c)
 static int get_event_type (char * buffer)
 {
 	unsigned char b = buffer[0];
-	if (b>=0x80 && b<=0xEF) {
-		if (b>>4 == 0xB && buffer[1] > 0x77)
-			return EVENT_TYPE_MODE;
-		else
-			return EVENT_TYPE_VOICE;
-		
-	} else if (b==0xF0 || b==0xF7) {
-		return EVENT_TYPE_SYSEX;
-		
-	} else if (b==0xFF) return EVENT_TYPE_META;
-	
-	return EVENT_TYPE_UNKNOWN;
+	if (b>>4 == 0xB && buffer[1] > 0x77)
+		return EVENT_TYPE_MODE;
+	return MIDI_STATUS_EVENTS[b][0];
 }
 
 int validate_chunk (MIDI_CHUNK * mc)
@@ -319,13 +395,13 @@ void encode_event_sysex (MIDI_TRACK * mt, SYSEX_EVENT * event)
 	stream_write (mt->stream, event->data, event->length);
 }
 
-#define readstream(k) if (!stream_read_char(mt->stream,(k))) return 0
+#define readstream(k) if (!stream_next(mt->stream,(k))) return 0
 
 
 /* for the decode_event_* routines, the decoding routine itself will allocate the appropriate
  * member in the MIDI_EVENT structure -- Any pre allocated block will thus be lost 
- * TODO: Implement decoders using callback functions -- More efficient and no
- * memory allocation overhead
+ * midi_decode_track decodes with callback functions instead, without
+ * allocating anything
  */
 int decode_event_voice (MIDI_TRACK * mt, MIDI_EVENT * event, unsigned char status)
 {
@@ -337,7 +413,7 @@ int decode_event_voice (MIDI_TRACK * mt, MIDI_EVENT * event, unsigned char statu
 		k = status;
 	type = voice_event_type (k>>4);
 	if (type == VOICE_EVENT_UNKNOWN) {
-		printe ("Error decoding voice event:%#x\n",k);
+		track_error (mt, "Error decoding voice event:%#x\n",k);
 		return 0;
 	}
 	ve = xmalloc(sizeof(VOICE_EVENT));
@@ -366,7 +442,7 @@ int decode_event_mode (MIDI_TRACK * mt, MIDI_EVENT * event, unsigned char status
 	readstream (&j);
 	type = mode_event_type (j);
 	if (type == MODE_EVENT_UNKNOWN) {
-		printe ("Error decoding mode event:%#x:%#x\n",k,j);
+		track_error (mt, "Error decoding mode event:%#x:%#x\n",k,j);
 		return 0;
 	}
 	me = xmalloc(sizeof(MODE_EVENT));
@@ -395,8 +471,10 @@ int decode_event_meta (MIDI_TRACK * mt, MIDI_EVENT * event)
 	event->event.meta_event = me;
 	readstream(&k);
 	me->type = meta_event_type (k); 
-	if (me->type == META_EVENT_UNKNOWN)
+	if (me->type == META_EVENT_UNKNOWN) {
+		track_error (mt, "Unknown meta event type:%#x\n",k);
 		me->unknown_type = k;
+	}
 	len = stream_read_variable(mt->stream);
 	me->length = len;
 	if (!me->length)
@@ -531,8 +609,6 @@ int encode_mode (MIDI_TRACK * mt, unsigned long delta_time, unsigned char type,
 MIDI_EVENT * parse_track_event (MIDI_TRACK * mt)
 {
 	int e_type;
-	static int running = 0;
-	static unsigned char status;
 	MIDI_EVENT * event = xmalloc(sizeof(MIDI_EVENT));
 	if (!event) return NULL;
 	event->delta_time = stream_read_variable (mt->stream);
@@ -544,46 +620,46 @@ MIDI_EVENT * parse_track_event (MIDI_TRACK * mt)
 		case EVENT_TYPE_SYSEX:
 			if (!decode_event_sysex (mt, event))
 				return NULL;
-			running = 0;
+			mt->running = 0;
 			return event;
 			break;
 			
 		case EVENT_TYPE_UNKNOWN:
-			if ((running == 1) || (  (running ==2) && *(stream_current_position(mt->stream))  <=0x77)  ) {
-				assert (voice_event_type (status>>4) != VOICE_EVENT_UNKNOWN);
-				if (!decode_event_voice (mt, event, status))
+			if ((mt->running == 1) || (  (mt->running ==2) && *(stream_current_position(mt->stream))  <=0x77)  ) {
+				assert (voice_event_type (mt->status>>4) != VOICE_EVENT_UNKNOWN);
+				if (!decode_event_voice (mt, event, mt->status))
 					return NULL;
 				return event;
-			} else if (running == 2) {
-				if (!decode_event_mode (mt, event, status))
+			} else if (mt->running == 2) {
+				if (!decode_event_mode (mt, event, mt->status))
 					return NULL;
 				return event;
 			}
-			printe ("Error:Unknown midi event:%i\n",e_type);
-			printe ("%i:%i\t:%#x\n",mt->stream->r_offset, mt->stream->size,*(mt->stream->buffer+mt->stream->r_offset));
+			track_error (mt, "Error:Unknown midi event:%i\n",e_type);
+			track_error (mt, "%i:%i\t:%#x\n",mt->stream->r_offset, mt->stream->size,*(mt->stream->buffer+mt->stream->r_offset));
 			return NULL;
 			break;
 
 		case EVENT_TYPE_MODE:
 			if (!decode_event_mode (mt, event, 0))
 				return NULL;
-			status = (0xB0)|(event->event.mode_event->channel); 
-			running = 2;
+			mt->status = (0xB0)|(event->event.mode_event->channel); 
+			mt->running = 2;
 			return event;
 			break;
 
 		case EVENT_TYPE_META:
 			if (!decode_event_meta (mt, event))
 				return NULL;
-			running = 0;
+			mt->running = 0;
 			return event;
 			break;
 
 		case EVENT_TYPE_VOICE:
 			if (!decode_event_voice (mt, event, 0))
 				return NULL;
-			status = (MIDI_VOICE_EVENTS[(event->event.voice_event->type)][1]<<4)|(event->event.voice_event->channel);
-			running = 1;
+			mt->status = (MIDI_VOICE_EVENTS[(event->event.voice_event->type)][1]<<4)|(event->event.voice_event->channel);
+			mt->running = 1;
 			return event;
 			break;
 
@@ -624,7 +700,7 @@ MIDI_EVENT * parse_track_events (MIDI_TRACK * mt)
 	if  (event2->type == EVENT_TYPE_META && event2->event.meta_event->type == META_EVENT_EOT)
 	{
 	}else {
-		printe ("EOT marker not found\n");
+		track_error (mt, "EOT marker not found\n");
 	}
 	return base;
 }
@@ -665,14 +741,14 @@ int write_chunk_to_stream (STREAM * stream, MIDI_CHUNK * chunk)
 }
 
 
+/* straight from the track's stream, which may have spilled, so a
+ * song's worth of track isn't copied */
 int write_track_chunk (STREAM * stream, MIDI_TRACK * mt)
 {
-	MIDI_CHUNK chunk;
-	int result;
-	if (!make_track_chunk(mt, &chunk)) return 0;
-	result = write_chunk_to_stream (stream, &chunk);
-	xfree (chunk.data);
-	return result;
+	stream_write (stream, "MTrk", 4);
+	stream_write_int_reverse (stream, stream_length (mt->stream), 4);
+	stream_write_stream (stream, mt->stream);
+	return 1;
 }
 
 int write_header_chunk (STREAM * stream, MIDI_FILE * mf)
@@ -744,12 +820,14 @@ int read_chunk (MIDI_FILE * mf, MIDI_CHUNK * chunk)
 MIDI_EVENT *  parse_track_chunk (MIDI_CHUNK * chunk, MIDI_TRACK * mt)
 {
 	if (chunk->type != TRACK_CHUNK) {
-		printe ("Track Chunk expected but not found\n");
+		track_error (mt, "Track Chunk expected but not found\n");
 		return NULL;
 	}
 
 	if (mt->stream)
 		stream_free (mt->stream);
+	mt->running = 0;
+	mt->status = 0;
 	mt->stream = stream_create (5);
 	stream_write (mt->stream, chunk->data, chunk->length);	
 	return (parse_track_events (mt));
@@ -801,172 +879,1430 @@ int parse_header_chunk (MIDI_FILE * mf)
 	return 1;
 	
 }
-#ifdef DO_MAIN
-void print_midi_file (MIDI_FILE * mf)
+
+/* the most bytes an event has before its data: a 4 byte delta time,
+ * the status, the meta type and a 4 byte length */
+#define EVENT_HEAD 10
+
+/* a variable length value, read without looking for the end of the
+ * data. Returns 0 if it goes on past 4 bytes */
+static int read_variable (const unsigned char ** p, unsigned long * value)
 {
-	printf("Format:\t%i\nTracks:\t%i\n",mf->format,mf->tracks);
-	if (mf->division == DIVISION_TQN)
-		printf ("Division: Ticks Per Quarter Note (%i)\n",mf->tpqn);
-	else {
-		printf ("Division: Ticks Per SMTPE Frame (%i)\n",mf->tpf);
-		printf ("          SMTPE Frames per second (%i)\n",mf->fps);
+	unsigned long result = 0;
+	int i;
+	for (i=0;i<4;i++) {
+		unsigned char b = *(*p)++;
+		result = (result<<7) | (b & 0x7F);
+		if (!(b & 0x80)) {
+			*value = result;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void decode_error (const MIDI_VISITOR * v, void * ctx, const char * text,...)
+{
+	va_list args;
+	va_start (args, text);
+	report (v->on_error, ctx, text, args);
+	va_end (args);
+}
+
+/* Decode the event at *pp, calling the visitor for it. Returns 1 once
+ * it is decoded, with *pp moved past it, and -1 if it can't be. Returns
+ * 0 if the event runs past 'end', with *need set to the bytes it takes
+ * from *pp if that is known yet, 0 if not. *tick and *status are only
+ * changed once the event is complete.
+ * The head of the event (everything but meta and sysex data) is read
+ * without checking for the end and checked once it has been read. Near
+ * the end it is read from a copy padded with zeroes, which end any
+ * variable length value the data cuts short */
+static int decode_event (const unsigned char ** pp, const unsigned char * end,
+                         unsigned long * tick, unsigned char * status, int * eot, size_t * need,
+                         const MIDI_VISITOR * v, void * ctx)
+{
+	const unsigned char * start = *pp, * base = start, * p, * at;
+	unsigned char padded[EVENT_HEAD];
+	size_t limit = end - start;
+	unsigned long delta, size;
+	unsigned char b, kind, data1, data2;
+	int ok;
+
+	*need = 0;
+	if (limit < EVENT_HEAD) {
+		memset (padded, 0, EVENT_HEAD);
+		memcpy (padded, start, limit);
+		base = padded;
+	}
+	p = base;
+	if (!read_variable (&p, &delta)) {
+		decode_error (v, ctx, "Error:Bad variable length value\n");
+		return -1;
+	}
+	at = p;
+	b = *p;
+	if (b < 0x80)
+		b = *status;   /* running status, 0 if there is none */
+	else
+		p++;
+	kind = MIDI_STATUS_EVENTS[b][0];
+
+	if (kind == EVENT_TYPE_VOICE) {
+		data1 = p[0];
+		data2 = MIDI_STATUS_EVENTS[b][1] == 2 ? p[1] : 0;
+		p += MIDI_STATUS_EVENTS[b][1];
+		if ((size_t)(p - base) > limit)
+			return 0;
+		if ((data1 | data2) & 0x80) {
+			decode_error (v, ctx, "Error:Bad data byte:%#x\n", (data1 & 0x80) ? data1 : data2);
+			return -1;
+		}
+		*tick += delta;
+		if (b>>4 == 0xB && data1 > 0x77) {
+			if (v->on_mode)
+				v->on_mode (ctx, *tick, b & 0xF, mode_event_type (data1), data2);
+		} else if (b>>4 == 0x8 || b>>4 == 0x9) {
+			if (v->on_note)
+				v->on_note (ctx, *tick, b & 0xF, voice_event_type (b>>4), data1, data2);
+		} else if (b>>4 == 0xB) {
+			if (v->on_controller)
+				v->on_controller (ctx, *tick, b & 0xF, data1, data2);
+		} else if (v->on_voice)
+			v->on_voice (ctx, *tick, b & 0xF, voice_event_type (b>>4), data1, data2);
+		*status = b;
+		*pp = start + (p - base);
+		return 1;
+	}
+	if (kind == EVENT_TYPE_UNKNOWN) {
+		if ((size_t)(at - base) >= limit)
+			return 0;
+		decode_error (v, ctx, "Error:Unknown midi event:%#x\n",*at);
+		return -1;
+	}
+
+	data1 = kind == EVENT_TYPE_META ? *p++ : 0;
+	ok = read_variable (&p, &size);
+	if ((size_t)(p - base) > limit)
+		return 0;
+	if (!ok) {
+		decode_error (v, ctx, "Error:Bad variable length value\n");
+		return -1;
+	}
+	p = start + (p - base);
+	if (size > (unsigned long)(end - p)) {
+		*need = p - start + size;
+		return 0;
+	}
+	*tick += delta;
+	if (kind == EVENT_TYPE_META) {
+		unsigned char type = meta_event_type (data1);
+		if (v->on_meta)
+			v->on_meta (ctx, *tick, type, data1, p, size);
+		*eot = type == META_EVENT_EOT;
+	} else if (v->on_sysex)
+		v->on_sysex (ctx, *tick, b, p, size);
+	*pp = p + size;
+	*status = 0;
+	return 1;
+}
+
+/* Decode the data of a track chunk, calling the visitor for every event.
+ * Meta and sysex data is passed as a pointer into 'data', nothing is
+ * allocated or copied, and running status is kept here rather than
+ * between calls. Callbacks left NULL are skipped. Returns 0 if the
+ * track is cut short or has an event that can't be decoded */
+int midi_decode_track (const unsigned char * data, size_t length,
+                       const MIDI_VISITOR * v, void * ctx)
+{
+	const unsigned char * p = data, * end = data + length;
+	unsigned long tick = 0;
+	unsigned char status = 0;  /* for running status, 0 after meta and sysex events */
+	int eot = 0, r = 1;
+	size_t need;
+
+	while (p < end && r > 0) {
+		r = decode_event (&p, end, &tick, &status, &eot, &need, v, ctx);
+		if (eot)
+			return 1;
 	}
+	if (r >= 0)
+		decode_error (v, ctx, "EOT marker not found\n");
+	return 0;
+}
+
+/* the bytes of an event over all its arrays */
+#define EVENT_BYTES (3*sizeof(unsigned long) + 5)
+
+static void events_layout (MIDI_EVENTS * e, char * block, size_t capacity)
+{
+	e->block = block;
+	e->capacity = capacity;
+	e->tick = (unsigned long *)block;
+	e->offset = e->tick + capacity;
+	e->length = e->offset + capacity;
+	e->kind = (unsigned char *)(e->length + capacity);
+	e->type = e->kind + capacity;
+	e->channel = e->type + capacity;
+	e->data1 = e->channel + capacity;
+	e->data2 = e->data1 + capacity;
+}
+
+static void events_grow (MIDI_EVENTS * e)
+{
+	MIDI_EVENTS old = *e;
+	size_t n = e->count;
+	events_layout (e, xmalloc (2*old.capacity*EVENT_BYTES), 2*old.capacity);
+	memcpy (e->tick, old.tick, n*sizeof(unsigned long));
+	memcpy (e->offset, old.offset, n*sizeof(unsigned long));
+	memcpy (e->length, old.length, n*sizeof(unsigned long));
+	memcpy (e->kind, old.kind, n);
+	memcpy (e->type, old.type, n);
+	memcpy (e->channel, old.channel, n);
+	memcpy (e->data1, old.data1, n);
+	memcpy (e->data2, old.data2, n);
+	xfree (old.block);
+}
+
+MIDI_EVENTS * midi_events_create (size_t capacity)
+{
+	MIDI_EVENTS * e = xmalloc (sizeof(MIDI_EVENTS));
+	if (capacity < 16)
+		capacity = 16;
+	events_layout (e, xmalloc (capacity*EVENT_BYTES), capacity);
+	e->count = 0;
+	e->payload = stream_create (256);
+	e->error[0] = '\0';
+	return e;
 }
-void print_octaves(signed int amount)
+
+/* empty, keeping the memory for the next track */
+void midi_events_reset (MIDI_EVENTS * e)
 {
-	char o = '+';
-	int octave = amount;
-	fprintf(stderr,"octaves:%i\n",amount);
-	if (amount <0) {
-		octave = -amount;
-		o='-';
+	e->count = 0;
+	stream_write_reset (e->payload);
+	e->error[0] = '\0';
+}
+
+void midi_events_free (MIDI_EVENTS * e)
+{
+	xfree (e->block);
+	stream_free (e->payload);
+	xfree (e);
+}
+
+static void add_event (MIDI_EVENTS * e, unsigned long tick, unsigned char kind, unsigned char type,
+                       unsigned char channel, unsigned char data1, unsigned char data2,
+                       const unsigned char * payload, unsigned long length)
+{
+	size_t n = e->count;
+	if (n == e->capacity)
+		events_grow (e);
+	e->tick[n] = tick;
+	e->offset[n] = 0;
+	e->length[n] = length;
+	if (length) {
+		e->offset[n] = e->payload->size;
+		stream_write (e->payload, (const char *)payload, length);
 	}
-	for(;octave--;)printf("%c",o);
+	e->kind[n] = kind;
+	e->type[n] = type;
+	e->channel[n] = channel;
+	e->data1[n] = data1;
+	e->data2[n] = data2;
+	e->count++;
 }
-void print_commans(int amount)
+
+static void add_voice (void * ctx, unsigned long tick, unsigned char channel, unsigned char type,
+                       unsigned char data1, unsigned char data2)
 {
-	int i=0;
-	for (i=0;i<amount/60;++i)
-		printf(",");
+	add_event (ctx, tick, EVENT_TYPE_VOICE, type, channel, data1, data2, NULL, 0);
 }
-void doit(MIDI_FILE * _m,MIDI_EVENT ** events)
+
+static void add_controller (void * ctx, unsigned long tick, unsigned char channel,
+                            unsigned char controller, unsigned char value)
 {
-	MIDI_FILE mf;
-	MIDI_TRACK mt;
-	STREAM *s1;
-	FILE * stream;
-	MIDI_EVENT * event;
-	int j= 0;
-	unsigned long time = 0,prev_time = 0,prev=0;
-	
-	mf = *_m;
-	s1 = stream_create (10);
-	write_header_chunk (s1, &mf);
-	printf ("Header chunk written\n");
-	for (;events[0];events++) {
-		event = events[0];
-		mt.stream = stream_create(6);
-		while (event) {
-			if (event->type == EVENT_TYPE_VOICE) {
-				signed char k;
-				signed char o;
-				VOICE_EVENT * ve;
-				static char notes[12] = {'S','r','R','g','G','m','M','P','d','D','n','N'};
-				char s[10] = "";
-				ve = event->event.voice_event;
-				k = ve->data1 - 0x3c;
-				//int base = k % 12;
-				int base = ve->data1 % 12;
-				if (base >11 || base < 0){
-					fprintf(stderr,"Error--**--:%i\n",base);
-				}
-				k = k - (base%12);
-				if (k/12 > 0) {
-					o = '+';
-				}
-				if ((signed char)(k/12) < 0) {
-					o = '-';
-				}
-				if (k/12 == 0) {
-					o =' ';
-				}
-				if (ve->type == VOICE_EVENT_NOTE_ON) {
-					fprintf(stderr,"%i\n",ve->data1);
-					if (prev != time) {
-						printf("%c",notes[base]);
-						if (o!=' ')
-							print_octaves(k/12);
-						print_commans(time - prev_time);
-						printf("\t#%i %i %i\n",ve->channel,time-prev_time,time);
-						/*prev_time = event->delta_time + time;*/
-						prev_time = time;
-					}
-					prev = time;
-				}
-
-				//encode_event (&mt, event);
+	add_event (ctx, tick, EVENT_TYPE_VOICE, VOICE_EVENT_CONTROLLER, channel, controller, value, NULL, 0);
+}
+
+static void add_mode (void * ctx, unsigned long tick, unsigned char channel, unsigned char type,
+                      unsigned char data)
+{
+	add_event (ctx, tick, EVENT_TYPE_MODE, type, channel, data, 0, NULL, 0);
+}
+
+static void add_meta (void * ctx, unsigned long tick, unsigned char type, unsigned char raw_type,
+                      const unsigned char * data, unsigned long length)
+{
+	add_event (ctx, tick, EVENT_TYPE_META, type, 0, type == META_EVENT_UNKNOWN ? raw_type : 0, 0,
+	           data, length);
+}
+
+static void add_sysex (void * ctx, unsigned long tick, unsigned char type,
+                       const unsigned char * data, unsigned long length)
+{
+	add_event (ctx, tick, EVENT_TYPE_SYSEX, type, 0, 0, 0, data, length);
+}
+
+/* the first error is kept */
+static void add_error (void * ctx, const char * message)
+{
+	MIDI_EVENTS * e = ctx;
+	if (!e->error[0]) {
+		strncpy (e->error, message, sizeof(e->error) - 1);
+		e->error[sizeof(e->error) - 1] = '\0';
+	}
+}
+
+static const MIDI_VISITOR event_adder = {
+	add_voice, add_controller, add_voice, add_meta, add_sysex, add_mode, add_error
+};
+
+/* Decode the data of a track chunk, adding its events to 'e'. Returns 0
+ * as midi_decode_track does, with the reason in e->error; the events
+ * before the trouble are kept */
+int midi_decode_events (MIDI_EVENTS * e, const unsigned char * data, size_t length)
+{
+	return midi_decode_track (data, length, &event_adder, e);
+}
+/* a track chunk of a file being decoded */
+struct track_job_t
+{
+	const unsigned char * data;
+	size_t length;
+	MIDI_EVENTS * events;
+};
+
+struct file_decode_t
+{
+	struct track_job_t * jobs;
+	size_t count;
+	size_t next;           /* the next job a worker can take */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+static int compare_length (const void * a, const void * b)
+{
+	size_t x = ((const struct track_job_t *)a)->length, y = ((const struct track_job_t *)b)->length;
+	return x > y ? -1 : x < y;
+}
+
+static void * decode_worker (void * arg)
+{
+	struct file_decode_t * f = arg;
+	while (1) {
+		struct track_job_t * j = NULL;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock (&f->lock);
+#endif
+		if (f->next < f->count)
+			j = f->jobs + f->next++;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock (&f->lock);
+#endif
+		if (!j)
+			break;
+		midi_decode_events (j->events, j->data, j->length);
+	}
+	return NULL;
+}
+
+/* Decode every track chunk of a midi file into tracks[], which are
+ * created here for the caller to free, on up to 'workers' threads. The
+ * biggest tracks go first, so the file takes about as long as its
+ * biggest track does. Returns the number of tracks, 0 if 'data' isn't a
+ * midi file. A track that didn't decode has its error set */
+size_t midi_decode_file (const unsigned char * data, size_t length, MIDI_EVENTS ** tracks,
+                         size_t max_tracks, size_t workers)
+{
+	const unsigned char * p = data, * end = data + length;
+	struct file_decode_t f;
+	unsigned long len;
+#ifdef HAVE_PTHREAD
+	pthread_t * threads = NULL;
+	size_t i, started = 0;
+#endif
+
+	if (length < 14 || memcmp (p, "MThd", 4) || !max_tracks)
+		return 0;
+	len = read32 (p+4);
+	if (len > length - 8)
+		return 0;
+	p += 8 + len;
+	f.jobs = xmalloc (max_tracks*sizeof(struct track_job_t));
+	f.count = 0;
+	f.next = 0;
+	while (end - p >= 8 && f.count < max_tracks) {
+		len = read32 (p+4);
+		/* a chunk cut short is decoded as far as it goes */
+		if (len > (unsigned long)(end - p - 8))
+			len = end - p - 8;
+		if (!memcmp (p, "MTrk", 4)) {
+			struct track_job_t * j = f.jobs + f.count;
+			j->data = p + 8;
+			j->length = len;
+			j->events = tracks[f.count++] = midi_events_create (len/4);
+		}
+		p += 8 + len;
+	}
+	qsort (f.jobs, f.count, sizeof(struct track_job_t), compare_length);
+	if (workers > f.count)
+		workers = f.count;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init (&f.lock, NULL);
+	if (workers > 1) {
+		threads = xmalloc ((workers-1)*sizeof(pthread_t));
+		for (i=0;i<workers-1;i++)
+			if (!pthread_create (threads + started, NULL, decode_worker, &f))
+				started++;
+	}
+#endif
+	/* this thread is a worker too, so nothing is left if none started */
+	decode_worker (&f);
+#ifdef HAVE_PTHREAD
+	for (i=0;i<started;i++)
+		pthread_join (threads[i], NULL);
+	if (threads)
+		xfree (threads);
+	pthread_mutex_destroy (&f.lock);
+#endif
+	xfree (f.jobs);
+	return f.count;
+}
+
+/* the default tempo, 120 quarter notes a minute */
+#define DEFAULT_TEMPO 500000
+
+static void channels_init (MIDI_CHANNEL_STATE * channels)
+{
+	int i;
+	memset (channels, 0, 16*sizeof(MIDI_CHANNEL_STATE));
+	for (i=0;i<16;i++) {
+		channels[i].volume = 100;
+		channels[i].pan = 64;
+	}
+}
+
+/* change the channels as event i of a track does */
+static void channels_apply (MIDI_CHANNEL_STATE * channels, const MIDI_EVENTS * e, size_t i)
+{
+	MIDI_CHANNEL_STATE * c = channels + e->channel[i];
+	unsigned char d1 = e->data1[i];
+	if (e->kind[i] == EVENT_TYPE_MODE) {
+		if (e->type[i] == MODE_EVENT_NOTES_OFF || e->type[i] == MODE_EVENT_SOUND_OFF)
+			memset (c->held, 0, sizeof(c->held));
+		return;
+	}
+	if (e->kind[i] != EVENT_TYPE_VOICE)
+		return;
+	switch (e->type[i]) {
+		case VOICE_EVENT_NOTE_ON:
+			if (e->data2[i]) {
+				c->held[d1>>3] |= 1 << (d1 & 7);
+				break;
 			}
-			time += event->delta_time;
-			event = event->next;
+			/* a note on without velocity is a note off */
+		case VOICE_EVENT_NOTE_OFF:
+			c->held[d1>>3] &= ~(1 << (d1 & 7));
+			break;
+		case VOICE_EVENT_PROGRAM:
+			c->program = d1;
+			break;
+		case VOICE_EVENT_CONTROLLER:
+			if (d1 == CONTROLLER_CHANNEL_VOLUME)
+				c->volume = e->data2[i];
+			else if (d1 == CONTROLLER_PAN)
+				c->pan = e->data2[i];
+			break;
+	}
+}
+
+static MIDI_CHECKPOINT * make_checkpoints (const MIDI_EVENTS * e)
+{
+	MIDI_CHECKPOINT * cp = xmalloc ((e->count/MIDI_CHECKPOINT_EVENTS + 1)*sizeof(MIDI_CHECKPOINT));
+	MIDI_CHANNEL_STATE channels[16];
+	size_t i;
+	channels_init (channels);
+	for (i=0;i<e->count;i++) {
+		if (i % MIDI_CHECKPOINT_EVENTS == 0) {
+			cp[i/MIDI_CHECKPOINT_EVENTS].event = i;
+			memcpy (cp[i/MIDI_CHECKPOINT_EVENTS].channels, channels, sizeof(channels));
 		}
-		//write_track_chunk (s1, &mt);
-		printf ("Track %i written\n",++j);
-		time = 0;
+		channels_apply (channels, e, i);
+	}
+	if (!e->count) {
+		cp[0].event = 0;
+		memcpy (cp[0].channels, channels, sizeof(channels));
+	}
+	return cp;
+}
+
+/* tempo changes in the order they come, a later track's last at a tick */
+static int compare_tempo (const void * a, const void * b)
+{
+	const MIDI_TEMPO * x = a, * y = b;
+	if (x->tick != y->tick)
+		return x->tick < y->tick ? -1 : 1;
+	return x->usec < y->usec ? -1 : x->usec > y->usec;
+}
+
+/* the set tempo events of every track, merged into one map */
+static void make_tempo_map (MIDI_INDEX * index)
+{
+	size_t i, j, n = 1, count = 0;
+	MIDI_TEMPO * t;
+	for (i=0;i<index->track_count;i++)
+		for (j=0;j<index->tracks[i]->count;j++)
+			n += index->tracks[i]->kind[j] == EVENT_TYPE_META
+			     && index->tracks[i]->type[j] == META_EVENT_SET_TEMPO;
+	t = xmalloc (n*sizeof(MIDI_TEMPO));
+	t[count].tick = 0;
+	t[count].usec = -1;        /* sorts before a change at tick 0 */
+	t[count++].tempo = DEFAULT_TEMPO;
+	for (i=0;i<index->track_count;i++) {
+		MIDI_EVENTS * e = index->tracks[i];
+		for (j=0;j<e->count;j++)
+			if (e->kind[j] == EVENT_TYPE_META && e->type[j] == META_EVENT_SET_TEMPO
+			    && e->length[j] >= 3) {
+				const unsigned char * d = (const unsigned char *)e->payload->buffer + e->offset[j];
+				t[count].tick = e->tick[j];
+				t[count].usec = count;   /* keeps the order of equal ticks */
+				t[count++].tempo = (unsigned long)d[0]<<16 | d[1]<<8 | d[2];
+			}
+	}
+	qsort (t, count, sizeof(MIDI_TEMPO), compare_tempo);
+	/* the last change at a tick is the one that counts */
+	for (i=0,j=0;i<count;i++) {
+		if (j && t[j-1].tick == t[i].tick)
+			j--;
+		t[j++] = t[i];
 	}
-	assert (mf.tracks==j);
-	stream = fopen("raw.mid","w");
-	fwrite(s1->buffer, 1, s1->size, stream);
-	fclose(stream);
+	t[0].usec = 0;
+	for (i=1;i<j;i++)
+		t[i].usec = t[i-1].usec + (double)(t[i].tick - t[i-1].tick)*t[i-1].tempo/index->tpqn;
+	index->tempo = t;
+	index->tempo_count = j;
 }
-/*stupid hack to get the size of a file
-  or verify that it exists*/
-int get_file_size(char *fname)
+
+/* Index the decoded tracks of a song: the tempo changes of all of them
+ * in one map, and checkpoints of the channels for every track. The
+ * tracks must outlive the index */
+MIDI_INDEX * midi_index_create (const MIDI_FILE * header, MIDI_EVENTS ** tracks, size_t count)
+{
+	MIDI_INDEX * index = xmalloc (sizeof(MIDI_INDEX));
+	size_t i;
+	index->division = header->division;
+	index->tpqn = header->tpqn ? header->tpqn : 1;
+	index->usec_per_frame_tick = header->division == DIVISION_TPF && header->fps && header->tpf ?
+	                             1e6/(header->fps*header->tpf) : 0;
+	index->tracks = xmalloc ((count + 1)*sizeof(MIDI_EVENTS *));
+	index->checkpoints = xmalloc ((count + 1)*sizeof(MIDI_CHECKPOINT *));
+	index->track_count = count;
+	for (i=0;i<count;i++) {
+		index->tracks[i] = tracks[i];
+		index->checkpoints[i] = make_checkpoints (tracks[i]);
+	}
+	make_tempo_map (index);
+	return index;
+}
+
+void midi_index_free (MIDI_INDEX * index)
 {
+	size_t i;
+	for (i=0;i<index->track_count;i++)
+		xfree (index->checkpoints[i]);
+	xfree (index->checkpoints);
+	xfree (index->tracks);
+	xfree (index->tempo);
+	xfree (index);
+}
+
+/* the microseconds from the start of the song to a tick */
+double midi_index_usec (const MIDI_INDEX * index, unsigned long tick)
+{
+	size_t lo = 0, hi = index->tempo_count;
+	const MIDI_TEMPO * t;
+	if (index->division == DIVISION_TPF)
+		return tick*index->usec_per_frame_tick;
+	/* the last change at or before the tick */
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo)/2;
+		if (index->tempo[mid].tick <= tick)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	t = index->tempo + lo;
+	return t->usec + (double)(tick - t->tick)*t->tempo/index->tpqn;
+}
+
+/* the tick playing at a time, in microseconds from the start */
+unsigned long midi_index_tick (const MIDI_INDEX * index, double usec)
+{
+	size_t lo = 0, hi = index->tempo_count;
+	const MIDI_TEMPO * t;
+	if (usec <= 0)
+		return 0;
+	if (index->division == DIVISION_TPF)
+		return index->usec_per_frame_tick ? (unsigned long)(usec/index->usec_per_frame_tick) : 0;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo)/2;
+		if (index->tempo[mid].usec <= usec)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	t = index->tempo + lo;
+	return t->tick + (unsigned long)((usec - t->usec)*index->tpqn/(t->tempo ? t->tempo : 1));
+}
+
+/* Find the first event of a track at or after a tick, and set 'channels'
+ * (16 of them) to what they are just before it. Decoding picks up from
+ * the event returned, which is the track's event count if the track
+ * ends before the tick. A binary search and the events since the last
+ * checkpoint, never the whole track */
+size_t midi_index_seek (const MIDI_INDEX * index, size_t track, unsigned long tick,
+                        MIDI_CHANNEL_STATE * channels)
+{
+	const MIDI_EVENTS * e = index->tracks[track];
+	const MIDI_CHECKPOINT * cp;
+	size_t lo = 0, hi = e->count, i, k;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo)/2;
+		if (e->tick[mid] < tick)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	k = lo/MIDI_CHECKPOINT_EVENTS;
+	if (k && k*MIDI_CHECKPOINT_EVENTS >= e->count)
+		k--;
+	cp = index->checkpoints[track] + k;
+	memcpy (channels, cp->channels, 16*sizeof(MIDI_CHANNEL_STATE));
+	for (i=cp->event;i<lo;i++)
+		channels_apply (channels, e, i);
+	return lo;
+}
+
+/* the file's bytes, mapped if that can be done. The file is kept open
+ * then, for chunks to be copied straight out of it */
+static int reader_load (MIDI_READER * r, const char * filename)
+{
+#ifdef HAVE_MMAP
+	struct stat st;
+	int fd = open (filename, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat (fd, &st) == 0 && st.st_size > 0) {
+		void * p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			r->fd = fd;
+			r->data = p;
+			r->size = st.st_size;
+			r->mapped = 1;
+			return 1;
+		}
+	}
+	close (fd);
+#endif
+	{
+		STREAM * s = stream_load_from_file ((char *)filename);
+		if (!s)
+			return 0;
+		r->size = s->size;
+		r->data = (unsigned char *)stream_take_buffer (s);
+		r->mapped = 0;
+		r->fd = -1;
+		return r->data != NULL;
+	}
+}
+
+/* format, tracks and division from the 6 bytes of a header chunk */
+static void header_fields (MIDI_FILE * mf, const unsigned char * p)
+{
+	unsigned int divisions;
+	mf->format = read16 (p);
+	mf->tracks = read16 (p+2);
+	divisions = read16 (p+4);
+	if (divisions & 0x8000) {
+		mf->division = DIVISION_TPF;
+		mf->tpf = divisions & 0xFF;
+		mf->fps = 0x100 - ((divisions>>8) & 0xFF);
+	} else {
+		mf->division = DIVISION_TQN;
+		mf->tpqn = divisions;
+	}
+}
+
+/* read the header and list the chunks, without looking inside any but
+ * the header. Chunks of types other than MThd and MTrk are kept in the
+ * directory and skipped */
+static int reader_index (MIDI_READER * r)
+{
+	const unsigned char * p = r->data, * end = r->data + r->size;
+	size_t i, capacity = 16;
+
+	if (r->size < 14 || memcmp (p, "MThd", 4) || (unsigned long)(read32 (p+4)) < 6) {
+		printe ("Header chunk expected but not found\n");
+		return 0;
+	}
+	r->header.buffer = r->header.data = (char *)r->data;
+	r->header.size = r->size;
+	r->header.pos = 0;
+	header_fields (&r->header, p+8);
+
+	r->chunks = xmalloc (capacity*sizeof(MIDI_CHUNK_ENTRY));
+	r->chunk_count = 0;
+	r->track_count = 0;
+	while (end - p >= 8) {
+		MIDI_CHUNK_ENTRY * c;
+		unsigned long len = read32 (p+4);
+		if (r->chunk_count == capacity) {
+			capacity *= 2;
+			r->chunks = xrealloc (r->chunks, capacity*sizeof(MIDI_CHUNK_ENTRY));
+		}
+		c = r->chunks + r->chunk_count++;
+		c->type = !memcmp (p, "MTrk", 4) ? TRACK_CHUNK : !memcmp (p, "MThd", 4) ? HEADER_CHUNK : UNKNOWN_CHUNK;
+		c->offset = p + 8 - r->data;
+		/* a chunk cut short is decoded as far as it goes */
+		if (len > (unsigned long)(end - p - 8))
+			len = end - p - 8;
+		c->length = len;
+		if (c->type == TRACK_CHUNK)
+			r->track_count++;
+		p += 8 + len;
+	}
+	r->index = NULL;
+	r->track_chunks = xmalloc ((r->track_count + 1)*sizeof(size_t));
+	r->events = xmalloc ((r->track_count + 1)*sizeof(MIDI_EVENTS *));
+	r->track_count = 0;
+	for (i=0;i<r->chunk_count;i++)
+		if (r->chunks[i].type == TRACK_CHUNK) {
+			r->events[r->track_count] = NULL;
+			r->track_chunks[r->track_count++] = i;
+		}
+	return 1;
+}
+
+static void reader_unload (MIDI_READER * r)
+{
+#ifdef HAVE_MMAP
+	if (r->mapped) {
+		munmap ((void *)r->data, r->size);
+		close (r->fd);
+		return;
+	}
+#endif
+	free ((void *)r->data);
+}
+
+/* Open a midi file and list its chunks. Nothing is decoded until
+ * midi_reader_track asks for a track. Returns NULL if the file can't
+ * be read or isn't a midi file */
+MIDI_READER * midi_reader_open (const char * filename)
+{
+	MIDI_READER * r = xmalloc (sizeof(MIDI_READER));
+	if (!reader_load (r, filename)) {
+		xfree (r);
+		return NULL;
+	}
+	if (!reader_index (r)) {
+		reader_unload (r);
+		xfree (r);
+		return NULL;
+	}
+	return r;
+}
+
+/* the events of a track, decoded the first time they are asked for.
+ * Anything that went wrong decoding it is in the events' error */
+MIDI_EVENTS * midi_reader_track (MIDI_READER * r, size_t track)
+{
+	MIDI_CHUNK_ENTRY * c;
+	if (track >= r->track_count)
+		return NULL;
+	if (!r->events[track]) {
+		c = r->chunks + r->track_chunks[track];
+		r->events[track] = midi_events_create (c->length/4);
+		midi_decode_events (r->events[track], r->data + c->offset, c->length);
+	}
+	return r->events[track];
+}
+
+/* the index of the whole file, decoding every track that isn't yet */
+MIDI_INDEX * midi_reader_index (MIDI_READER * r)
+{
+	size_t i;
+	if (!r->index) {
+		for (i=0;i<r->track_count;i++)
+			midi_reader_track (r, i);
+		r->index = midi_index_create (&r->header, r->events, r->track_count);
+	}
+	return r->index;
+}
+
+void midi_reader_close (MIDI_READER * r)
+{
+	size_t i;
+	if (r->index)
+		midi_index_free (r->index);
+	for (i=0;i<r->track_count;i++)
+		if (r->events[i])
+			midi_events_free (r->events[i]);
+	xfree (r->events);
+	xfree (r->track_chunks);
+	xfree (r->chunks);
+	reader_unload (r);
+	xfree (r);
+}
+
+/* what a MIDI_PUSH is waiting for */
+#define PUSH_HEADER 0
+#define PUSH_CHUNK  1  /* the type and length of a chunk */
+#define PUSH_TRACK  2  /* events of a track chunk */
+#define PUSH_SKIP   3  /* the rest of a chunk that isn't decoded */
+#define PUSH_FAILED 4
+
+/* A decoder for a midi file that comes in pieces, off a pipe or a
+ * socket. Only the event or chunk header cut in two by the end of a
+ * piece is kept, so it needs no more memory than the biggest event */
+MIDI_PUSH * midi_push_create (const MIDI_VISITOR * v, void * ctx)
+{
+	MIDI_PUSH * p = xmalloc (sizeof(MIDI_PUSH));
+	memset (p, 0, sizeof(MIDI_PUSH));
+	p->visitor = v;
+	p->ctx = ctx;
+	p->state = PUSH_HEADER;
+	p->pending = stream_create (64);
+	return p;
+}
+
+void midi_push_free (MIDI_PUSH * p)
+{
+	stream_free (p->pending);
+	xfree (p);
+}
+
+/* 'size' bytes in a row, from the data if they are all there and from
+ * pending if they come in more than one piece. Returns NULL, with what
+ * there is kept in pending, until all of them are in */
+static const unsigned char * push_gather (MIDI_PUSH * p, const unsigned char ** data,
+                                          const unsigned char * end, size_t size)
+{
+	size_t n = size - p->pending->size;
+	if (!p->pending->size && (size_t)(end - *data) >= size) {
+		*data += size;
+		return *data - size;
+	}
+	if (n > (size_t)(end - *data))
+		n = end - *data;
+	stream_write (p->pending, (const char *)*data, n);
+	*data += n;
+	if (p->pending->size < size)
+		return NULL;
+	stream_write_reset (p->pending);
+	return (const unsigned char *)p->pending->buffer;
+}
+
+static void push_chunk (MIDI_PUSH * p, const unsigned char ** data, const unsigned char * end)
+{
+	const unsigned char * c = push_gather (p, data, end, 8);
+	if (!c)
+		return;
+	p->left = read32 (c+4);
+	if (memcmp (c, "MTrk", 4)) {
+		p->state = PUSH_SKIP;
+		return;
+	}
+	p->state = PUSH_TRACK;
+	p->tracks++;
+	p->tick = 0;
+	p->status = 0;
+	p->need = 0;
+}
+
+/* finish the event kept in pending with as few of the new bytes as it
+ * takes, moving *q past the ones used */
+static int push_pending (MIDI_PUSH * p, const unsigned char ** q, const unsigned char * limit, int * eot)
+{
+	STREAM * pending = p->pending;
+	size_t have = pending->size, add = p->need ? p->need - have : EVENT_HEAD;
+	const unsigned char * b;
 	int r;
-	FILE *s;
-	if (!fname)
-		return -1;
-	s=fopen(fname,"rb");
-	if (!s)return -1;
- 	fseek(s,0,SEEK_END);
-	r=ftell(s);
- 	fclose(s);
- 	return r;
-}
-char *read_file(char *filename)
-{
-	long i;
-	FILE *stream;
-	char *buffer;
-	i=get_file_size(filename);
- 	printf("file_size:%s:%i\n",filename,i);
-	if (i<=0)
-		return (char *)NULL;
-	stream=fopen(filename,"rb");
-	if (!stream)
-			return (char *)NULL;
-	buffer=(char *)xmalloc(i+1);
-	fread(buffer,1,i,stream);
-	fclose(stream);
-	buffer[i]=0;
-	return buffer;
-}
-int main(int argc, char ** argv)
+	if (add > (size_t)(limit - *q))
+		add = limit - *q;
+	stream_write (pending, (const char *)*q, add);
+	b = (const unsigned char *)pending->buffer;
+	r = decode_event (&b, b + pending->size, &p->tick, &p->status, eot, &p->need, p->visitor, p->ctx);
+	if (r == 1)
+		*q += b - (const unsigned char *)pending->buffer - have;
+	else if (r == 0) {
+		*q += add;
+		return 0;
+	}
+	stream_write_reset (pending);
+	return r;
+}
+
+/* decode what has come of a track chunk, keeping back an event that
+ * isn't all there */
+static void push_track (MIDI_PUSH * p, const unsigned char ** data, const unsigned char * end)
+{
+	const unsigned char * q = *data, * limit = end;
+	int eot = 0, r = 1;
+
+	if ((unsigned long)(end - q) > p->left)
+		limit = q + p->left;
+	if (p->pending->size)
+		r = push_pending (p, &q, limit, &eot);
+	while (r == 1 && !eot && q < limit) {
+		r = decode_event (&q, limit, &p->tick, &p->status, &eot, &p->need, p->visitor, p->ctx);
+		if (r == 0) {
+			stream_write (p->pending, (const char *)q, limit - q);
+			q = limit;
+		}
+	}
+	p->left -= q - *data;
+	*data = q;
+	/* anything after the EOT or an event that can't be decoded is skipped */
+	if (eot || r < 0)
+		p->state = p->left ? PUSH_SKIP : PUSH_CHUNK;
+	else if (!p->left) {
+		decode_error (p->visitor, p->ctx, "EOT marker not found\n");
+		stream_write_reset (p->pending);
+		p->state = PUSH_CHUNK;
+	}
+}
+
+/* Decode the next 'length' bytes of the file, calling the visitor for
+ * every event that is complete. A track that can't be decoded is
+ * reported to on_error and skipped. Returns 0 if the data isn't a midi
+ * file, and then nothing more is decoded */
+int midi_push_feed (MIDI_PUSH * p, const unsigned char * data, size_t length)
+{
+	const unsigned char * end = data + length, * h;
+	while (data < end)
+		switch (p->state) {
+		case PUSH_HEADER:
+			if (!(h = push_gather (p, &data, end, 14)))
+				break;
+			if (memcmp (h, "MThd", 4) || (unsigned long)(read32 (h+4)) < 6) {
+				decode_error (p->visitor, p->ctx, "Header chunk expected but not found\n");
+				p->state = PUSH_FAILED;
+				return 0;
+			}
+			header_fields (&p->header, h+8);
+			p->left = (read32 (h+4)) - 6;
+			p->state = p->left ? PUSH_SKIP : PUSH_CHUNK;
+			break;
+		case PUSH_CHUNK:
+			push_chunk (p, &data, end);
+			break;
+		case PUSH_TRACK:
+			push_track (p, &data, end);
+			break;
+		case PUSH_SKIP:
+			if ((unsigned long)(end - data) < p->left) {
+				p->left -= end - data;
+				data = end;
+			} else {
+				data += p->left;
+				p->left = 0;
+				p->state = PUSH_CHUNK;
+			}
+			break;
+		default:
+			return 0;
+		}
+	return 1;
+}
+
+/* the end of the input. Returns 0 if it came in the middle of the header
+ * or of a track. A chunk that isn't decoded may be cut short */
+int midi_push_end (MIDI_PUSH * p)
+{
+	switch (p->state) {
+	case PUSH_HEADER:
+		decode_error (p->visitor, p->ctx, "Header chunk expected but not found\n");
+		return 0;
+	case PUSH_TRACK:
+		decode_error (p->visitor, p->ctx, "EOT marker not found\n");
+		return 0;
+	case PUSH_FAILED:
+		return 0;
+	}
+	return 1;
+}
+
+/* Find the delta time of every event of a track chunk (MIDI_MAP_DELTAS),
+ * or the note byte of its note events and the velocity of its note ons
+ * (MIDI_MAP_NOTES), or both, in one pass that decodes nothing else.
+ * Notes on the drum channel are left out, moving them would change the
+ * drum. The map ends at the EOT event, or where the track stops making
+ * sense with the reason in 'error' */
+MIDI_MAP * midi_map_track (const unsigned char * data, size_t length, int what)
+{
+	MIDI_MAP * map = xmalloc (sizeof(MIDI_MAP));
+	const unsigned char * p = data, * end = data + length;
+	unsigned long * deltas, * notes, * velocities;
+	unsigned long tick = 0;
+	unsigned char status = 0;
+
+	/* room for the most the track could have, an event to every 2 bytes
+	 * and a note to every 3, so nothing is checked as they are added.
+	 * Only the pages that get used cost anything */
+	map->deltas = deltas = xmalloc ((what & MIDI_MAP_DELTAS ? length/2 + 1 : 1)*sizeof(unsigned long));
+	map->notes = notes = xmalloc ((what & MIDI_MAP_NOTES ? length/3 + 1 : 1)*sizeof(unsigned long));
+	map->velocities = velocities = xmalloc ((what & MIDI_MAP_NOTES ? length/3 + 1 : 1)*sizeof(unsigned long));
+	map->error[0] = '\0';
+	map->eot = length;
+	while (1) {
+		const unsigned char * start = p, * base = p, * q;
+		unsigned char padded[EVENT_HEAD];
+		size_t limit = end - p;
+		unsigned long delta, size;
+		unsigned char b, kind, type = 0;
+		int ok;
+
+		if (p == end) {
+			strcpy (map->error, "EOT marker not found\n");
+			break;
+		}
+		if (limit < EVENT_HEAD) {
+			memset (padded, 0, EVENT_HEAD);
+			memcpy (padded, p, limit);
+			base = padded;
+		}
+		q = base;
+		if (!read_variable (&q, &delta)) {
+			strcpy (map->error, "Error:Bad variable length value\n");
+			break;
+		}
+		b = *q;
+		if (b < 0x80)
+			b = status;
+		else
+			q++;
+		kind = MIDI_STATUS_EVENTS[b][0];
+		if (kind == EVENT_TYPE_VOICE) {
+			unsigned long at = start - data + (q - base);
+			q += MIDI_STATUS_EVENTS[b][1];
+			if ((size_t)(q - base) > limit) {
+				strcpy (map->error, "Track cut short\n");
+				break;
+			}
+			tick += delta;
+			if (what & MIDI_MAP_DELTAS)
+				*deltas++ = start - data;
+			if (what & MIDI_MAP_NOTES) {
+				if (b>>4 >= 0x8 && b>>4 <= 0xA && (b & 0xF) != 9)
+					*notes++ = at;
+				if (b>>4 == 0x9 && data[at+1])
+					*velocities++ = at + 1;
+			}
+			status = b;
+			p = start + (q - base);
+			continue;
+		}
+		if (kind == EVENT_TYPE_UNKNOWN) {
+			sprintf (map->error, "Error:Unknown midi event:%#x\n", *q);
+			break;
+		}
+		if (kind == EVENT_TYPE_META)
+			type = *q++;
+		ok = read_variable (&q, &size);
+		if (!ok || (size_t)(q - base) > limit || size > (unsigned long)(limit - (q - base))) {
+			strcpy (map->error, ok ? "Track cut short\n" : "Error:Bad variable length value\n");
+			break;
+		}
+		tick += delta;
+		if (what & MIDI_MAP_DELTAS)
+			*deltas++ = start - data;
+		p = start + (q - base) + size;
+		status = 0;
+		if (kind == EVENT_TYPE_META && type == 0x2F) {
+			map->eot = start - data;
+			break;
+		}
+	}
+	map->ticks = tick;
+	map->event_count = deltas - map->deltas;
+	map->note_count = notes - map->notes;
+	map->velocity_count = velocities - map->velocities;
+	map->length = p - data;
+	return map;
+}
+
+void midi_map_free (MIDI_MAP * map)
+{
+	xfree (map->deltas);
+	xfree (map->notes);
+	xfree (map->velocities);
+	xfree (map);
+}
+
+/* Move every mapped note by 'semitones', keeping it in range */
+void midi_transpose (unsigned char * data, const MIDI_MAP * map, int semitones)
+{
+	unsigned char table[128];
+	size_t i;
+	for (i=0;i<128;i++) {
+		int n = (int)i + semitones;
+		table[i] = n < 0 ? 0 : n > 0x7F ? 0x7F : n;
+	}
+	for (i=0;i<map->note_count;i++)
+		data[map->notes[i]] = table[data[map->notes[i]] & 0x7F];
+}
+
+/* Scale the velocity of every note on by 'factor'. A note on is never
+ * scaled down to 0, which would make it a note off */
+void midi_scale_velocity (unsigned char * data, const MIDI_MAP * map, double factor)
+{
+	unsigned char table[128];
+	size_t i;
+	for (i=0;i<128;i++) {
+		double v = i*factor + 0.5;
+		table[i] = v < 1 ? 1 : v >= 0x80 ? 0x7F : (unsigned char)v;
+	}
+	for (i=0;i<map->velocity_count;i++)
+		data[map->velocities[i]] = table[data[map->velocities[i]] & 0x7F];
+}
+
+static int variable_width (unsigned long value)
+{
+	int width = 1;
+	while (value >>= 7)
+		width++;
+	return width;
+}
+
+static void put_variable (unsigned char * p, unsigned long value, int width)
 {
-	char * buffer;
-	MIDI_FILE mf;
-	MIDI_CHUNK mc;
-	MIDI_TRACK mt;
-	MIDI_EVENT * event;
-	MIDI_EVENT ** events;
 	int i;
-	if (!argv[1])
-		return 0;
-	buffer = read_file(argv[1]);
-	mf.buffer = mf.data = buffer;
-	mf.pos =0;
-	mf.size = get_file_size (argv[1]);
-	if (!parse_header_chunk (&mf))
-		return 0;
-	events = xmalloc(sizeof(MIDI_EVENT *)*mf.tracks+1);
-	if (!events) return 0;
-	i=13;
-	for (i=0;i<mf.tracks;i++) {
-		mc.data = NULL;
-		if (!read_chunk (&mf, &mc)) {
-			printf ("Unable to read track chunk\n");
+	for (i=width-1;i>=0;i--) {
+		p[i] = (value & 0x7F) | (i == width - 1 ? 0 : 0x80);
+		value >>= 7;
+	}
+}
+
+/* Scale the delta times of a mapped track of *length bytes by 'ratio'.
+ * The ticks are scaled from the start of the track, so rounding doesn't
+ * add up. When no delta changes width they are rewritten where they
+ * are. Otherwise the track is compacted in one pass: in place if it
+ * never gets ahead of itself, which is the case when it only shrinks,
+ * or into a new block. Returns the track, 'data' or the new block, with
+ * its length in *length; the map is of the track as it was. Returns
+ * NULL if a delta would not fit in 4 bytes */
+unsigned char * midi_stretch (unsigned char * data, size_t * length, const MIDI_MAP * map, double ratio)
+{
+	unsigned long * scaled = xmalloc ((map->event_count + 1)*sizeof(unsigned long));
+	unsigned char * widths = xmalloc (map->event_count + 1);
+	unsigned char * out = data;
+	unsigned long tick = 0, before = 0;
+	long growth = 0, most = 0;
+	size_t i, w;
+
+	for (i=0;i<map->event_count;i++) {
+		const unsigned char * p = data + map->deltas[i];
+		unsigned long delta, at;
+		read_variable (&p, &delta);
+		widths[i] = p - (data + map->deltas[i]);
+		tick += delta;
+		at = (unsigned long)(tick*ratio + 0.5);
+		scaled[i] = at - before;
+		before = at;
+		if (scaled[i] > 0x0FFFFFFF) {
+			xfree (scaled);
+			xfree (widths);
+			return NULL;
+		}
+		growth += variable_width (scaled[i]) - widths[i];
+		if (growth > most)
+			most = growth;
+	}
+	if (!most && !growth) {
+		for (i=0;i<map->event_count;i++)
+			if (variable_width (scaled[i]) != widths[i])
+				break;
+		if (i == map->event_count) {
+			for (i=0;i<map->event_count;i++)
+				put_variable (data + map->deltas[i], scaled[i], widths[i]);
+			xfree (scaled);
+			xfree (widths);
+			return data;
+		}
+	}
+	if (most > 0)
+		out = xmalloc (*length + growth);
+	for (i=0,w=0;i<map->event_count;i++) {
+		unsigned long from = map->deltas[i] + widths[i];
+		unsigned long to = i + 1 < map->event_count ? map->deltas[i+1] : *length;
+		int width = variable_width (scaled[i]);
+		put_variable (out + w, scaled[i], width);
+		w += width;
+		memmove (out + w, data + from, to - from);
+		w += to - from;
+	}
+	*length = w;
+	xfree (scaled);
+	xfree (widths);
+	return out;
+}
+
+static int write_all (int fd, const unsigned char * data, size_t length)
+{
+	while (length) {
+		ssize_t n = write (fd, data, length);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			return 0;
 		}
-		mt.stream = NULL;
-		printf ("Parsing track %i\n",i+1);
-		event = parse_track_chunk (&mc, &mt);
-		events[i] = event;
-		printf ("Track %i sucessfully decoded\n",i+1);
-	}
-	events[mf.tracks]=NULL;
-	doit(&mf,events);
-	print_midi_file(&mf);
-	printf(mf.buffer);
+		data += n;
+		length -= n;
+	}
 	return 1;
 }
-#endif /* DO_MAIN */
+
+/* Copy bytes of a reader's file to 'fd'. The kernel copies them from
+ * file to file where it can, which lets filesystems that support it
+ * share the blocks, and they are written from memory where it can't */
+static int reader_copy (int fd, const MIDI_READER * r, unsigned long offset, unsigned long length)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	if (r->fd >= 0) {
+		loff_t at = offset;
+		while (length) {
+			ssize_t n = copy_file_range (r->fd, &at, fd, NULL, length, 0);
+			if (n <= 0)
+				break;
+			length -= n;
+		}
+		offset = at;
+	}
+#endif
+	return write_all (fd, r->data + offset, length);
+}
+
+static int write_header (int fd, const MIDI_FILE * header, unsigned int format, size_t tracks)
+{
+	MIDI_FILE mf = *header;
+	MIDI_CHUNK chunk;
+	char buffer[14];
+	int ok;
+	if (tracks > 0xFFFF) {
+		printe ("Too many tracks:%lu\n", (unsigned long)tracks);
+		return 0;
+	}
+	mf.format = format;
+	mf.tracks = tracks;
+	if (!make_header_chunk (&mf, &chunk))
+		return 0;
+	ok = write_chunk (buffer, &chunk) && write_all (fd, (unsigned char *)buffer, sizeof(buffer));
+	xfree (chunk.data);
+	return ok;
+}
+
+static int write_track_head (int fd, unsigned long length)
+{
+	char buffer[8];
+	memcpy (buffer, "MTrk", 4);
+	write_int_reverse (buffer+4, length, 4);
+	return write_all (fd, (unsigned char *)buffer, 8);
+}
+
+/* the header chunk is in the directory, a chunk cut short by the end of
+ * the file has the length it really has there */
+static int chunk_whole (const MIDI_READER * r, const MIDI_CHUNK_ENTRY * c)
+{
+	if ((unsigned long)(read32 (r->data + c->offset - 4)) != c->length) {
+		printe ("Chunk cut short\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int same_division (MIDI_READER ** songs, size_t count)
+{
+	size_t i;
+	const MIDI_FILE * a = &songs[0]->header;
+	for (i=1;i<count;i++) {
+		const MIDI_FILE * b = &songs[i]->header;
+		if (a->division != b->division || (a->division == DIVISION_TQN ?
+		    a->tpqn != b->tpqn : a->tpf != b->tpf || a->fps != b->fps)) {
+			printe ("Songs of different divisions can't be put together\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Write the tracks of all the songs, song after song, as a format 1
+ * file. Only the header chunk is written anew, every other chunk is
+ * copied as it is, with the chunks next to each other in a file
+ * copied together. Returns 0 if they can't be merged */
+int midi_merge (int fd, MIDI_READER ** songs, size_t count)
+{
+	size_t i, k, tracks = 0;
+	if (!count || !same_division (songs, count))
+		return 0;
+	for (i=0;i<count;i++)
+		tracks += songs[i]->track_count;
+	if (!write_header (fd, &songs[0]->header, 1, tracks))
+		return 0;
+	for (i=0;i<count;i++) {
+		MIDI_READER * r = songs[i];
+		unsigned long from = 0, to = 0;
+		for (k=0;k<r->chunk_count;k++) {
+			MIDI_CHUNK_ENTRY * c = r->chunks + k;
+			if (c->type == HEADER_CHUNK)
+				continue;
+			if (!chunk_whole (r, c))
+				return 0;
+			if (c->offset - 8 != to) {
+				if (to > from && !reader_copy (fd, r, from, to - from))
+					return 0;
+				from = c->offset - 8;
+			}
+			to = c->offset + c->length;
+		}
+		if (to > from && !reader_copy (fd, r, from, to - from))
+			return 0;
+	}
+	return 1;
+}
+
+/* where a track joins the next song, from a map of it */
+struct joint_t
+{
+	unsigned long first;       /* delta of the first event */
+	int width;                 /* bytes it takes */
+	unsigned long eot;         /* offset of the EOT event */
+	unsigned long last;        /* tick of the event before it */
+};
+
+/* where every track of every song ends, and where the longest track of
+ * every song ends */
+static int find_joints (MIDI_READER ** songs, size_t count, size_t tracks,
+                        struct joint_t * joints, unsigned long * ends)
+{
+	size_t i, k;
+	for (i=0;i<count;i++) {
+		MIDI_READER * r = songs[i];
+		ends[i] = 0;
+		for (k=0;k<r->track_count;k++) {
+			MIDI_CHUNK_ENTRY * c = r->chunks + r->track_chunks[k];
+			struct joint_t * j = joints + i*tracks + k;
+			const unsigned char * p = r->data + c->offset;
+			MIDI_MAP * map = midi_map_track (p, c->length, 0);
+			unsigned long eot_delta;
+			if (map->error[0]) {
+				printe ("Track %lu of song %lu:%s", (unsigned long)k + 1, (unsigned long)i + 1,
+				        map->error);
+				midi_map_free (map);
+				return 0;
+			}
+			j->eot = map->eot;
+			read_variable (&p, &j->first);
+			j->width = p - (r->data + c->offset);
+			p = r->data + c->offset + map->eot;
+			read_variable (&p, &eot_delta);
+			j->last = map->ticks - eot_delta;
+			if (map->ticks > ends[i])
+				ends[i] = map->ticks;
+			midi_map_free (map);
+		}
+	}
+	return 1;
+}
+
+/* Write track 'k' of the joined songs: its length is worked out on the
+ * first pass and the chunk written on the second. 'pending' is the ticks
+ * from the last event written to where the next one goes */
+static int write_joined_track (int fd, MIDI_READER ** songs, size_t count, size_t tracks,
+                               size_t k, const struct joint_t * joints, const unsigned long * ends)
+{
+	unsigned long length = 0, pending = 0;
+	unsigned char head[8];
+	size_t i;
+	int pass, width;
+	for (pass=0;pass<2;pass++) {
+		if (pass && !write_track_head (fd, length))
+			return 0;
+		pending = 0;
+		for (i=0;i<count;i++) {
+			const struct joint_t * j = joints + i*tracks + k;
+			unsigned long delta;
+			if (k >= songs[i]->track_count || !j->eot) {
+				pending += ends[i];
+				continue;
+			}
+			delta = j->first + pending;
+			if (delta > 0x0FFFFFFF) {
+				printe ("Songs too long to join\n");
+				return 0;
+			}
+			width = variable_width (delta);
+			if (!pass)
+				length += width + j->eot - j->width;
+			else {
+				put_variable (head, delta, width);
+				if (!write_all (fd, head, width)
+				    || !reader_copy (fd, songs[i], songs[i]->chunks[songs[i]->track_chunks[k]].offset
+				                     + j->width, j->eot - j->width))
+					return 0;
+			}
+			pending = ends[i] - j->last;
+		}
+		if (pending > 0x0FFFFFFF) {
+			printe ("Songs too long to join\n");
+			return 0;
+		}
+		length += variable_width (pending) + 3;
+	}
+	width = variable_width (pending);
+	put_variable (head, pending, width);
+	memcpy (head + width, "\xFF\x2F\x00", 3);
+	return write_all (fd, head, width + 3);
+}
+
+/* Write the songs one after the other: every track of the file plays
+ * the same track of each song in turn, the next starting where the
+ * longest track of the song before ends. Track events are copied as they
+ * are, but for the delta of the first event of each song, and the EOT
+ * events between songs are dropped. Returns 0 if they can't be joined */
+int midi_concat (int fd, MIDI_READER ** songs, size_t count)
+{
+	struct joint_t * joints;
+	unsigned long * ends;
+	size_t i, k, tracks = 0;
+	int ok;
+
+	if (!count || !same_division (songs, count))
+		return 0;
+	for (i=0;i<count;i++)
+		if (songs[i]->track_count > tracks)
+			tracks = songs[i]->track_count;
+	joints = xmalloc ((count*tracks + 1)*sizeof(struct joint_t));
+	ends = xmalloc (count*sizeof(unsigned long));
+	ok = find_joints (songs, count, tracks, joints, ends)
+	     && write_header (fd, &songs[0]->header, tracks > 1 ? 1 : songs[0]->header.format, tracks);
+	for (k=0;ok && k<tracks;k++)
+		ok = write_joined_track (fd, songs, count, tracks, k, joints, ends);
+	xfree (joints);
+	xfree (ends);
+	return ok;
+}
+
+/* Write a track of a song as a file of its own, format 0 */
+int midi_split (int fd, MIDI_READER * r, size_t track)
+{
+	MIDI_CHUNK_ENTRY * c;
+	if (track >= r->track_count)
+		return 0;
+	c = r->chunks + r->track_chunks[track];
+	return chunk_whole (r, c) && write_header (fd, &r->header, 0, 1)
+	       && reader_copy (fd, r, c->offset - 8, c->length + 8);
+}
@@ -65,7 +65,7 @@
 #define CONTROLLER_RPN_LSB               0x64
 #define CONTROLLER_RPN_MSG               0x65
 
-extern const unsigned char  MIDI_VOICE_EVENTS[][];
+extern const unsigned char  MIDI_VOICE_EVENTS[][4];
 
 /* channel mode events */
 #define MODE_EVENT_SOUND_OFF           0
@@ -80,7 +80,7 @@ extern const unsigned char  MIDI_VOICE_EVENTS[][];
 #define MODE_EVENT_COUNT 8
 #define MODE_EVENT_UNKNOWN MODE_EVENT_COUNT
 
-extern const unsigned char  MIDI_MODE_EVENTS[][];
+extern const unsigned char  MIDI_MODE_EVENTS[][2];
 
 /* meta text events -- the values assigned are specifically chosen */
 
@@ -103,7 +103,11 @@ extern const unsigned char  MIDI_MODE_EVENTS[][];
 
 #define META_EVENT_COUNT 15
 
-extern const unsigned char MIDI_META_EVENTS[][];
+extern const unsigned char MIDI_META_EVENTS[][2];
+
+/* {EVENT_TYPE_*, bytes of data} of every status byte, 0xFF bytes of
+ * data for a length that comes first */
+extern const unsigned char MIDI_STATUS_EVENTS[][2];
 
 /* MIDI error messages */
 #define MIDI_ERROR_UNKNOWN_META_EVENT  0x1 /* an unknown meta event was encountered */
@@ -199,12 +203,177 @@ struct miditrack_t
 {
 	STREAM * stream; /* arbitrary data written using one of the encode_event functions */
 	struct miditrack_t * next; /* TODO: this is not actually used */
+
+	/* for decoding, set up by midi_track_init. Every track keeps its own
+	 * running status, so tracks can be decoded at the same time */
+	int running;
+	unsigned char status;
+	void (*error) (void * ctx, const char * message); /* NULL for printe */
+	void * error_ctx;
+};
+
+/* A track decoded into arrays, an entry for every event, all of them in
+ * one block. 'tick' counts from the start of the track. The data of
+ * meta and sysex events is in 'payload', 'length' bytes at 'offset'.
+ * 'type' is one of VOICE_EVENT_*, MODE_EVENT_* or META_EVENT_* going by
+ * 'kind', or the status byte of a sysex event. data1 is the data byte of
+ * a mode event and the type byte of an unknown meta event */
+struct midievents_t
+{
+	size_t count;
+	size_t capacity;
+	unsigned long * tick;
+	unsigned long * offset;
+	unsigned long * length;
+	unsigned char * kind;      /* EVENT_TYPE_* */
+	unsigned char * type;
+	unsigned char * channel;
+	unsigned char * data1;
+	unsigned char * data2;
+	STREAM * payload;
+	char * block;
+	char error[128];           /* why the decoding stopped, empty if it didn't */
 };
 
+/* the callbacks of midi_decode_track. 'tick' counts from the start of
+ * the track. on_note has the note ons and offs, on_voice the other
+ * voice events. Meta and sysex data points into the track */
+struct midivisitor_t
+{
+	void (*on_note)       (void * ctx, unsigned long tick, unsigned char channel,
+	                       unsigned char type, unsigned char note, unsigned char velocity);
+	void (*on_controller) (void * ctx, unsigned long tick, unsigned char channel,
+	                       unsigned char controller, unsigned char value);
+	void (*on_voice)      (void * ctx, unsigned long tick, unsigned char channel,
+	                       unsigned char type, unsigned char data1, unsigned char data2);
+	void (*on_meta)       (void * ctx, unsigned long tick, unsigned char type,
+	                       unsigned char raw_type, const unsigned char * data, unsigned long length);
+	void (*on_sysex)      (void * ctx, unsigned long tick, unsigned char type,
+	                       const unsigned char * data, unsigned long length);
+	void (*on_mode)       (void * ctx, unsigned long tick, unsigned char channel,
+	                       unsigned char type, unsigned char data);
+	void (*on_error)      (void * ctx, const char * message); /* NULL for printe */
+};
+
+/* what a channel is set to at some point of a track */
+struct midichannelstate_t
+{
+	unsigned char program;
+	unsigned char volume;
+	unsigned char pan;
+	unsigned char held[16];    /* a bit for every note that is on */
+};
+
+/* the state of every channel from before an event of a track */
+struct midicheckpoint_t
+{
+	size_t event;
+	struct midichannelstate_t channels[16];
+};
+
+/* a tempo change, with the time it happens at */
+struct miditempo_t
+{
+	unsigned long tick;
+	double usec;               /* from the start of the song */
+	unsigned long tempo;       /* microseconds per quarter note */
+};
+
+/* Where the ticks of a song fall in time, and checkpoints of the
+ * channels every MIDI_CHECKPOINT_EVENTS events of each track, so
+ * a track can be picked up at any tick without replaying it from the
+ * start. The events are the caller's */
+struct midiindex_t
+{
+	unsigned int division;     /* of the header */
+	unsigned int tpqn;
+	double usec_per_frame_tick;   /* for DIVISION_TPF */
+	struct miditempo_t * tempo;   /* sorted by tick, the first at tick 0 */
+	size_t tempo_count;
+	struct midievents_t ** tracks;
+	struct midicheckpoint_t ** checkpoints;
+	size_t track_count;
+};
+
+#define MIDI_CHECKPOINT_EVENTS 1024
+
+/* a chunk of a file opened with midi_reader_open */
+struct midichunkentry_t
+{
+	int type;                  /* HEADER_CHUNK, TRACK_CHUNK or UNKNOWN_CHUNK */
+	unsigned long offset;      /* of the chunk's data in the file */
+	unsigned long length;
+};
+
+/* A midi file mapped into memory with a directory of its chunks. A
+ * track is only decoded the first time it is asked for, straight from
+ * the mapped bytes */
+struct midireader_t
+{
+	const unsigned char * data;
+	size_t size;
+	int mapped;                /* data is mmap'ed rather than read in */
+	int fd;                    /* the file, kept open to copy chunks out of, -1 if not */
+	struct midifile_t header;  /* format, division and the tracks the header says */
+	struct midichunkentry_t * chunks;
+	size_t chunk_count;
+	size_t * track_chunks;     /* the chunk of every track */
+	size_t track_count;
+	struct midievents_t ** events; /* NULL until decoded */
+	struct midiindex_t * index;    /* NULL until midi_reader_index */
+};
+
+/* a midi file decoded as it is fed in, see midi_push_create */
+struct midipush_t
+{
+	const struct midivisitor_t * visitor;
+	void * ctx;
+	int state;
+	struct midifile_t header;  /* once the header chunk is in */
+	size_t tracks;             /* track chunks begun, the one being decoded is the last */
+	unsigned long left;        /* bytes of the chunk still to come */
+	unsigned long tick;
+	unsigned char status;      /* for running status */
+	size_t need;               /* bytes the pending event takes, 0 if not known yet */
+	STREAM * pending;          /* an event or chunk header cut in two */
+};
+
+/* Where the bytes the transforms rewrite are in a track chunk: the
+ * delta time of every event, the note byte of every note event (but
+ * those of the drum channel) and the velocity of every note on, those
+ * that were asked for. Each is an offset into the chunk's data */
+struct midimap_t
+{
+	unsigned long * deltas;
+	size_t event_count;
+	unsigned long * notes;
+	size_t note_count;
+	unsigned long * velocities;
+	size_t velocity_count;
+	unsigned long length;      /* bytes mapped, up to the end of the EOT event */
+	unsigned long eot;         /* offset of the EOT event, 'length' if there is none */
+	unsigned long ticks;       /* the tick the last event mapped is at */
+	char error[128];           /* why the mapping stopped short, empty if it didn't */
+};
+
+/* what midi_map_track looks for */
+#define MIDI_MAP_DELTAS 1
+#define MIDI_MAP_NOTES  2
+
 typedef struct midichunk_t   MIDI_CHUNK;
 typedef struct midifile_t    MIDI_FILE;
 typedef struct miditrack_t   MIDI_TRACK;
 typedef struct midievent_t	 MIDI_EVENT;
+typedef struct midievents_t  MIDI_EVENTS;
+typedef struct midivisitor_t MIDI_VISITOR;
+typedef struct midichunkentry_t MIDI_CHUNK_ENTRY;
+typedef struct midireader_t  MIDI_READER;
+typedef struct midipush_t    MIDI_PUSH;
+typedef struct midichannelstate_t MIDI_CHANNEL_STATE;
+typedef struct midicheckpoint_t   MIDI_CHECKPOINT;
+typedef struct miditempo_t   MIDI_TEMPO;
+typedef struct midiindex_t   MIDI_INDEX;
+typedef struct midimap_t     MIDI_MAP;
 
 
 /* Macros to read and write ints in BIG-ENDIAN format
@@ -222,6 +391,8 @@ typedef struct midievent_t	 MIDI_EVENT;
 /* function prototypes */
 int  validate_chunk             (MIDI_CHUNK * mc);
 void free_event_list            (MIDI_EVENT * event);
+void midi_track_init            (MIDI_TRACK * mt, void (*error) (void * ctx, const char * message),
+                                 void * ctx);
 
 void encode_event_voice         (MIDI_TRACK * mt, VOICE_EVENT * event);
 void encode_event_mode          (MIDI_TRACK * mt, MODE_EVENT  * event);
@@ -252,6 +423,44 @@ MIDI_EVENT * parse_track_events (MIDI_TRACK * mt);
 MIDI_EVENT * parse_track_chunk  (MIDI_CHUNK * chunk, MIDI_TRACK * mt);
 int parse_header_chunk          (MIDI_FILE * mf);
 
+int  midi_decode_track          (const unsigned char * data, size_t length,
+                                 const MIDI_VISITOR * v, void * ctx);
+
+MIDI_EVENTS * midi_events_create (size_t capacity);
+void midi_events_reset          (MIDI_EVENTS * events);
+void midi_events_free           (MIDI_EVENTS * events);
+int  midi_decode_events         (MIDI_EVENTS * events, const unsigned char * data, size_t length);
+size_t midi_decode_file         (const unsigned char * data, size_t length, MIDI_EVENTS ** tracks,
+                                 size_t max_tracks, size_t workers);
+
+MIDI_READER * midi_reader_open  (const char * filename);
+MIDI_EVENTS * midi_reader_track (MIDI_READER * r, size_t track);
+MIDI_INDEX * midi_reader_index  (MIDI_READER * r);
+void midi_reader_close          (MIDI_READER * r);
+
+MIDI_INDEX * midi_index_create  (const MIDI_FILE * header, MIDI_EVENTS ** tracks, size_t count);
+void midi_index_free            (MIDI_INDEX * index);
+double midi_index_usec          (const MIDI_INDEX * index, unsigned long tick);
+unsigned long midi_index_tick   (const MIDI_INDEX * index, double usec);
+size_t midi_index_seek          (const MIDI_INDEX * index, size_t track, unsigned long tick,
+                                 MIDI_CHANNEL_STATE * channels);
+
+MIDI_PUSH * midi_push_create    (const MIDI_VISITOR * v, void * ctx);
+int  midi_push_feed             (MIDI_PUSH * p, const unsigned char * data, size_t length);
+int  midi_push_end              (MIDI_PUSH * p);
+void midi_push_free             (MIDI_PUSH * p);
+
+MIDI_MAP * midi_map_track       (const unsigned char * data, size_t length, int what);
+void midi_map_free              (MIDI_MAP * map);
+void midi_transpose             (unsigned char * data, const MIDI_MAP * map, int semitones);
+void midi_scale_velocity        (unsigned char * data, const MIDI_MAP * map, double factor);
+unsigned char * midi_stretch    (unsigned char * data, size_t * length, const MIDI_MAP * map,
+                                 double ratio);
+
+int  midi_merge                 (int fd, MIDI_READER ** songs, size_t count);
+int  midi_concat                (int fd, MIDI_READER ** songs, size_t count);
+int  midi_split                 (int fd, MIDI_READER * r, size_t track);
+
 int make_header_chunk           (MIDI_FILE * mf, MIDI_CHUNK * chunk);
 int make_track_chunk            (MIDI_TRACK * mt, MIDI_CHUNK * chunk);
 int write_chunk                 (char * buffer, MIDI_CHUNK * chunk);
@@ -260,4 +469,5 @@ int read_chunk                  (MIDI_FILE * mf, MIDI_CHUNK * chunk);
 /* these functions require the use of a STREAM object */
 int write_header_chunk          (STREAM * stream, MIDI_FILE * mf);
 int write_track_chunk           (STREAM * stream, MIDI_TRACK * mt);
+int stream_write_variable       (STREAM * stream, unsigned int i);
 #endif /* _MIDI_H_ */
@@ -0,0 +1,656 @@
+/*
+ * Midi to notation decompiler - HS
+ * midi2notes turns midi files back into notation cmc can compile. Each
+ * file is decoded in a single pass as it is read, keeping only what the
+ * notation can say: where notes start, program, volume and pan changes
+ * and lyrics. Once the file is in, the length of a comma is worked out
+ * from the tick resolution and the note onsets, and every channel that
+ * plays notes is written out as a notes file of its own. Files are
+ * decompiled on a pool of threads, a file to a thread at a time.
+ */
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "midi.h"
+#include "stream.h"
+#include "util.h"
+
+#define PROG_MIDI2NOTES "midi2notes"
+#define READ_SIZE (64*1024)
+
+#define LYRICS 16              /* the channel lyrics are kept under */
+#define PERCUSSION 9           /* General MIDI drums, which have no swaras */
+
+#define MARK_NOTE    0
+#define MARK_PROGRAM 1
+#define MARK_VOLUME  2
+#define MARK_PAN     3
+#define MARK_LYRIC   4
+
+/* the tempo and divisions cmc plays a comma of 'speed' ticks at */
+#define CMC_TEMPO     500000.0
+#define CMC_DIVISIONS 96.0
+
+struct mark_t
+{
+	unsigned long tick;
+	unsigned int text;         /* offset of a lyric in the text of the file */
+	unsigned char what;
+	unsigned char value;
+};
+
+struct voice_t
+{
+	size_t track;
+	int channel;
+	struct mark_t * marks;
+	size_t count;
+	size_t capacity;
+	size_t notes;
+	struct voice_t * lyrics;   /* the lyrics written with it */
+};
+
+struct decompile_t
+{
+	const char * path;
+	MIDI_PUSH * push;
+	unsigned long events;
+	struct voice_t * voices;
+	size_t voice_count;
+	size_t voice_capacity;
+	size_t track;              /* the track 'channels' is for */
+	int channels[LYRICS+1];    /* voice of every channel in it, -1 if none yet */
+	STREAM * text;
+	unsigned long tempo;       /* the first one, 0 if there is none */
+	unsigned long tempo_tick;
+	unsigned long onsets;      /* greatest common divisor of the note onsets */
+	int errors;
+};
+
+struct pool_t
+{
+	char ** paths;
+	size_t count;
+	size_t next;
+	const char * output_dir;
+	pthread_mutex_t lock;
+	unsigned long events;
+	int failed;
+};
+
+typedef struct mark_t       MARK;
+typedef struct voice_t      VOICE;
+typedef struct decompile_t  DECOMPILE;
+typedef struct pool_t       POOL;
+
+static const char * swaras[12] = {"S","r","R","g","G","m","M","P","d","D","n","N"};
+
+/* grids tried when the onsets don't share a usable divisor, in parts of a quarter note */
+static const int grids[] = {1, 2, 3, 4, 6, 8, 12, 16};
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static unsigned long gcd (unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static VOICE * voice (DECOMPILE * d, int channel)
+{
+	int i;
+	VOICE * v;
+	if (d->push->tracks != d->track) {
+		d->track = d->push->tracks;
+		for (i=0;i<=LYRICS;i++)
+			d->channels[i] = -1;
+	}
+	if (d->channels[channel] >= 0)
+		return d->voices + d->channels[channel];
+	if (d->voice_count == d->voice_capacity) {
+		d->voice_capacity *= 2;
+		d->voices = xrealloc (d->voices, d->voice_capacity*sizeof(VOICE));
+	}
+	d->channels[channel] = d->voice_count;
+	v = d->voices + d->voice_count++;
+	v->track = d->track;
+	v->channel = channel;
+	v->capacity = 256;
+	v->marks = xmalloc (v->capacity*sizeof(MARK));
+	v->count = 0;
+	v->notes = 0;
+	v->lyrics = NULL;
+	return v;
+}
+
+static MARK * mark (DECOMPILE * d, int channel, unsigned long tick, int what, unsigned char value)
+{
+	VOICE * v = voice (d, channel);
+	MARK * m;
+	if (v->count == v->capacity) {
+		v->capacity *= 2;
+		v->marks = xrealloc (v->marks, v->capacity*sizeof(MARK));
+	}
+	m = v->marks + v->count++;
+	m->tick = tick;
+	m->what = what;
+	m->value = value;
+	return m;
+}
+
+static void on_note (void * ctx, unsigned long tick, unsigned char channel,
+                     unsigned char type, unsigned char note, unsigned char velocity)
+{
+	DECOMPILE * d = ctx;
+	d->events++;
+	/* the decoder turns away data bytes past 127, but a note that isn't
+	 * one has no swara to be written as */
+	if (type != VOICE_EVENT_NOTE_ON || !velocity || channel == PERCUSSION || note > 0x7F)
+		return;
+	mark (d, channel, tick, MARK_NOTE, note);
+	d->voices[d->channels[channel]].notes++;
+	d->onsets = gcd (d->onsets, tick);
+}
+
+static void on_controller (void * ctx, unsigned long tick, unsigned char channel,
+                           unsigned char controller, unsigned char value)
+{
+	DECOMPILE * d = ctx;
+	d->events++;
+	if (controller == CONTROLLER_CHANNEL_VOLUME)
+		mark (d, channel, tick, MARK_VOLUME, value);
+	else if (controller == CONTROLLER_PAN)
+		mark (d, channel, tick, MARK_PAN, value);
+}
+
+static void on_voice (void * ctx, unsigned long tick, unsigned char channel,
+                      unsigned char type, unsigned char data1, unsigned char data2)
+{
+	DECOMPILE * d = ctx;
+	d->events++;
+	if (type == VOICE_EVENT_PROGRAM)
+		mark (d, channel, tick, MARK_PROGRAM, data1);
+}
+
+static void on_meta (void * ctx, unsigned long tick, unsigned char type,
+                     unsigned char raw_type, const unsigned char * data, unsigned long length)
+{
+	DECOMPILE * d = ctx;
+	d->events++;
+	if (type == META_EVENT_LYRIC && length) {
+		mark (d, LYRICS, tick, MARK_LYRIC, 0)->text = d->text->size;
+		stream_write (d->text, (char *)data, length);
+		stream_add_char (d->text, '\0');
+	} else if (type == META_EVENT_SET_TEMPO && length == 3 && (!d->tempo || tick < d->tempo_tick)) {
+		d->tempo = ((unsigned long)data[0] << 16) | (data[1] << 8) | data[2];
+		d->tempo_tick = tick;
+	}
+}
+
+static void on_sysex (void * ctx, unsigned long tick, unsigned char type,
+                      const unsigned char * data, unsigned long length)
+{
+	((DECOMPILE *)ctx)->events++;
+}
+
+static void on_mode (void * ctx, unsigned long tick, unsigned char channel,
+                     unsigned char type, unsigned char data)
+{
+	((DECOMPILE *)ctx)->events++;
+}
+
+static void on_error (void * ctx, const char * message)
+{
+	DECOMPILE * d = ctx;
+	if (d->push->tracks)
+		fprintf (stderr, "%s: %s: track %lu: %s", PROG_MIDI2NOTES, d->path,
+		         (unsigned long)d->push->tracks, message);
+	else
+		fprintf (stderr, "%s: %s: %s", PROG_MIDI2NOTES, d->path, message);
+	d->errors++;
+}
+
+static const MIDI_VISITOR visitor = {
+	on_note, on_controller, on_voice, on_meta, on_sysex, on_mode, on_error
+};
+
+/* ticks in a quarter note and microseconds in a tick. Files timed in
+ * frames have no quarter notes, half a second is taken for one */
+static void resolution (DECOMPILE * d, double * quarter, double * usec)
+{
+	MIDI_FILE * mf = &d->push->header;
+	if (mf->division == DIVISION_TQN) {
+		*quarter = mf->tpqn ? mf->tpqn : CMC_DIVISIONS;
+		*usec = (d->tempo ? d->tempo : CMC_TEMPO) / *quarter;
+	} else {
+		double per_second = (double)mf->fps*mf->tpf;
+		*usec = 1e6/per_second;
+		*quarter = per_second/2;
+	}
+}
+
+/* The length of a comma in ticks. If the onsets share a divisor no finer
+ * than a sixteenth of a quarter note that is it, played back exactly.
+ * Otherwise the onsets are off a grid, say from being played live, and
+ * the coarsest grid most of them are close to is taken instead */
+static double comma_ticks (DECOMPILE * d, double quarter)
+{
+	size_t i, j, k, notes = 0;
+	if (!d->onsets)
+		return quarter;
+	if (d->onsets >= quarter/16)
+		return d->onsets;
+	for (i=0;i<d->voice_count;i++)
+		notes += d->voices[i].notes;
+	for (k=0;k<sizeof(grids)/sizeof(grids[0]);k++) {
+		double grid = quarter/grids[k];
+		size_t close = 0;
+		for (i=0;i<d->voice_count;i++) {
+			VOICE * v = d->voices + i;
+			for (j=0;j<v->count;j++) {
+				double at = v->marks[j].tick/grid;
+				if (v->marks[j].what == MARK_NOTE && fabs (at - floor (at + 0.5)) <= 0.125)
+					close++;
+			}
+		}
+		if (close >= notes - notes/20)
+			return grid;
+	}
+	return quarter/16;
+}
+
+/* the comma a tick falls on. The first comma of the notation is played
+ * a comma in, so 'shift' is 1 when a note has to start before that */
+static unsigned long slot (unsigned long tick, double comma, int shift)
+{
+	unsigned long s = (unsigned long)floor (tick/comma + 0.5);
+	return s + shift ? s + shift - 1 : 0;
+}
+
+static int needs_shift (DECOMPILE * d, double comma)
+{
+	size_t i, j;
+	for (i=0;i<d->voice_count;i++) {
+		VOICE * v = d->voices + i;
+		for (j=0;j<v->count && v->marks[j].tick < comma;j++)
+			if (v->marks[j].what == MARK_NOTE && floor (v->marks[j].tick/comma + 0.5) == 0)
+				return 1;
+	}
+	return 0;
+}
+
+/* A token is a note or a comma, written in columns like the examples */
+static void put_token (STREAM * out, const char * token, unsigned long * count, int per_line)
+{
+	size_t n = strlen (token);
+	stream_add_str (out, token);
+	if (++*count % per_line == 0) {
+		stream_add_char (out, '\n');
+		return;
+	}
+	do
+		stream_add_char (out, ' ');
+	while (++n < 5);
+}
+
+static void put_note (STREAM * out, int note, unsigned long * count, int per_line)
+{
+	char token[8];
+	int octave = note/12 - 5;
+	strcpy (token, swaras[note % 12]);
+	for (;octave>0;octave--)
+		strcat (token, "+");
+	for (;octave<0;octave++)
+		strcat (token, "-");
+	put_token (out, token, count, per_line);
+}
+
+static void put_lyric (STREAM * out, const char * text)
+{
+	stream_add_char (out, ':');
+	for (;*text;text++) {
+		switch (*text) {
+		case ':':  stream_add_str (out, "\\:");  break;
+		case '\\': stream_add_str (out, "\\\\"); break;
+		case '\n': stream_add_str (out, "\\n");  break;
+		case '\r': stream_add_str (out, "\\r");  break;
+		case '\t': stream_add_str (out, "\\t");  break;
+		default:   stream_add_char (out, *text);
+		}
+	}
+	stream_add_str (out, ": ");
+}
+
+/* on a line of their own at the start of one, like the examples */
+static void put_directive (STREAM * out, int what, int value, int own_line)
+{
+	char line[64];
+	if (what == MARK_PROGRAM)
+		sprintf (line, "{instrument = \"%s\"}", instruments[value & 0x7F]);
+	else
+		sprintf (line, "{%s = %d}", what == MARK_VOLUME ? "volume" : "pan", value);
+	stream_add_str (out, line);
+	stream_add_char (out, own_line ? '\n' : ' ');
+}
+
+/* the token of a comma once everything on it is in, after the settings
+ * it changes and before its lyrics: cmc puts a lyric where the last note
+ * started, so they go after it. Lyrics from 'from' up to 'lead' come
+ * before any note has, and are written first to stay there */
+static void close_slot (DECOMPILE * d, STREAM * out, int best, int * set, int * last,
+                        VOICE * lyrics, size_t from, size_t lead, size_t to,
+                        unsigned long * count, int per_line)
+{
+	int k;
+	for (;from<lead;from++)
+		put_lyric (out, d->text->buffer + lyrics->marks[from].text);
+	for (k=MARK_PROGRAM;k<MARK_LYRIC;k++)
+		if (set[k] >= 0 && set[k] != last[k]) {
+			put_directive (out, k, set[k], *count % per_line == 0);
+			last[k] = set[k];
+		}
+	if (best < 0)
+		put_token (out, ",", count, per_line);
+	else
+		put_note (out, best, count, per_line);
+	for (;from<to;from++)
+		put_lyric (out, d->text->buffer + lyrics->marks[from].text);
+}
+
+/* Writes a voice as notation, with the lyrics of its track merged in.
+ * Notes are legato in cmc, so a note lasts until the next one starts:
+ * rests are folded into the note before them, and of the notes
+ * starting on the same comma only the highest, the melody, is kept */
+static void write_voice (DECOMPILE * d, VOICE * v, VOICE * lyrics, STREAM * out,
+                         double comma, int shift, int per_line)
+{
+	unsigned long count = 0, open = 0;
+	size_t i = 0, j = 0, from = 0, lead = 0;
+	size_t lyric_count = lyrics ? lyrics->count : 0;
+	int is_open = 0, started = 0, best = -1;
+	int set[MARK_LYRIC], last[MARK_LYRIC];
+	int k;
+
+	for (k=0;k<MARK_LYRIC;k++)
+		set[k] = last[k] = -1;
+	while (i < v->count || j < lyric_count) {
+		MARK * m;
+		unsigned long s;
+		int is_lyric = j < lyric_count && (i == v->count || lyrics->marks[j].tick < v->marks[i].tick);
+		m = is_lyric ? lyrics->marks + j : v->marks + i;
+		s = slot (m->tick, comma, shift);
+		if (!is_open || s != open) {
+			if (is_open) {
+				close_slot (d, out, best, set, last, lyrics, from, started ? from : lead, j,
+				            &count, per_line);
+				started |= best >= 0;
+			}
+			while (count < s)
+				put_token (out, ",", &count, per_line);
+			open = s;
+			is_open = 1;
+			best = -1;
+			for (k=0;k<MARK_LYRIC;k++)
+				set[k] = -1;
+			from = lead = j;
+		}
+		if (is_lyric) {
+			j++;
+			if (best < 0)
+				lead = j;
+			continue;
+		}
+		i++;
+		if (m->what != MARK_NOTE)
+			set[m->what] = m->value;
+		else if (m->value > best)
+			best = m->value;
+	}
+	if (is_open)
+		close_slot (d, out, best, set, last, lyrics, from, started ? from : lead, j,
+		            &count, per_line);
+	if (count % per_line)
+		stream_add_char (out, '\n');
+}
+
+static int compare_voices (const void * a, const void * b)
+{
+	const VOICE * x = a, * y = b;
+	if (x->track != y->track)
+		return x->track < y->track ? -1 : 1;
+	return x->channel - y->channel;
+}
+
+/* where the notation of a voice goes: next to the midi file, or in the
+ * output directory, named after it with the voice counted if it has more */
+static char * notes_path (const char * path, const char * output_dir, size_t number, size_t voices)
+{
+	const char * name = strrchr (path, '/');
+	const char * dot;
+	char * out;
+	name = name ? name + 1 : path;
+	dot = strrchr (name, '.');
+	if (!dot || dot == name)
+		dot = name + strlen (name);
+	out = xmalloc ((output_dir ? strlen (output_dir) : 0) + (dot - path) + 32);
+	if (output_dir)
+		sprintf (out, "%s/%.*s", output_dir, (int)(dot - name), name);
+	else
+		sprintf (out, "%.*s", (int)(dot - path), path);
+	if (voices > 1)
+		sprintf (out + strlen (out), "-%lu", (unsigned long)number);
+	strcat (out, ".notes");
+	return out;
+}
+
+static int write_notes (DECOMPILE * d, const char * output_dir)
+{
+	double quarter, usec, comma;
+	int shift, per_line = 16, speed, failed = 0;
+	size_t i, k, voices = 0, number = 0;
+	STREAM * out = stream_create (4096);
+	char line[128];
+
+	qsort (d->voices, d->voice_count, sizeof(VOICE), compare_voices);
+	for (i=0;i<d->voice_count;i++)
+		if (d->voices[i].notes)
+			voices++;
+	/* the lyrics of a track go with its first voice, or with the first
+	 * voice of the song when they are on a track of their own */
+	for (i=0;i<d->voice_count;i++) {
+		VOICE * lyrics = d->voices + i, * first = NULL;
+		if (lyrics->channel != LYRICS)
+			continue;
+		for (k=0;k<d->voice_count;k++) {
+			VOICE * v = d->voices + k;
+			if (!v->notes)
+				continue;
+			if (!first || v->track == lyrics->track)
+				first = v;
+			if (v->track == lyrics->track)
+				break;
+		}
+		if (first && !first->lyrics)
+			first->lyrics = lyrics;
+	}
+	if (!voices) {
+		fprintf (stderr, "%s: %s: No notes to write\n", PROG_MIDI2NOTES, d->path);
+		stream_free (out);
+		return 0;
+	}
+	resolution (d, &quarter, &usec);
+	comma = comma_ticks (d, quarter);
+	shift = needs_shift (d, comma);
+	for (k=0;k<sizeof(grids)/sizeof(grids[0]);k++)
+		if (fabs (comma*grids[k] - quarter) < 1e-6)
+			per_line = 4*grids[k];
+	speed = (int)floor (comma*usec*CMC_DIVISIONS/CMC_TEMPO + 0.5);
+	if (speed < 1)
+		speed = 1;
+
+	for (i=0;i<d->voice_count;i++) {
+		VOICE * v = d->voices + i;
+		if (!v->notes)
+			continue;
+		number++;
+		stream_write_reset (out);
+		sprintf (line, "# %.60s, track %lu channel %d\n", d->path,
+		         (unsigned long)v->track, v->channel + 1);
+		stream_add_str (out, line);
+		sprintf (line, "# a comma is %g ticks, compile with cmc -s %d\n", comma, speed);
+		stream_add_str (out, line);
+		write_voice (d, v, v->lyrics, out, comma, shift, per_line);
+		if (!strcmp (d->path, "-")) {
+			if (stream_write_to_io (out, stdout) != (int)out->size)
+				failed = 1;
+		} else {
+			char * path = notes_path (d->path, output_dir, number, voices);
+			if (stream_write_to_file (out, path) != (int)out->size) {
+				fprintf (stderr, "%s: Unable to write file:%s\n", PROG_MIDI2NOTES, path);
+				failed = 1;
+			}
+			xfree (path);
+		}
+	}
+	stream_free (out);
+	return !failed;
+}
+
+/* Returns the number of events, or -1 if the file can't be decompiled */
+static long decompile (const char * path, const char * output_dir, unsigned char * buffer)
+{
+	DECOMPILE d;
+	ssize_t n;
+	size_t i;
+	int fd = strcmp (path, "-") ? open (path, O_RDONLY) : 0;
+	if (fd < 0) {
+		fprintf (stderr, "%s: Unable to open file:%s\n", PROG_MIDI2NOTES, path);
+		return -1;
+	}
+	memset (&d, 0, sizeof(d));
+	d.path = path;
+	d.push = midi_push_create (&visitor, &d);
+	d.voice_capacity = 8;
+	d.voices = xmalloc (d.voice_capacity*sizeof(VOICE));
+	d.text = stream_create (256);
+	while ((n = read (fd, buffer, READ_SIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "%s: Unable to read file:%s\n", PROG_MIDI2NOTES, path);
+			d.errors++;
+			break;
+		}
+		if (!midi_push_feed (d.push, buffer, n))
+			break;
+	}
+	if (n == 0)
+		midi_push_end (d.push);
+	if (fd)
+		close (fd);
+	if (!d.errors && !write_notes (&d, output_dir))
+		d.errors++;
+	for (i=0;i<d.voice_count;i++)
+		xfree (d.voices[i].marks);
+	xfree (d.voices);
+	stream_free (d.text);
+	midi_push_free (d.push);
+	return d.errors ? -1 : (long)d.events;
+}
+
+static void * worker (void * arg)
+{
+	POOL * pool = arg;
+	unsigned char * buffer = xmalloc (READ_SIZE);
+	while (1) {
+		size_t i;
+		long events;
+		pthread_mutex_lock (&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock (&pool->lock);
+		if (i >= pool->count)
+			break;
+		events = decompile (pool->paths[i], pool->output_dir, buffer);
+		pthread_mutex_lock (&pool->lock);
+		if (events < 0)
+			pool->failed = 1;
+		else
+			pool->events += events;
+		pthread_mutex_unlock (&pool->lock);
+	}
+	xfree (buffer);
+	return NULL;
+}
+
+static void usage (void)
+{
+	fprintf (stderr, "%s: usage %s [-j threads] [-o directory] file.mid ... ('-' reads standard input)\n",
+	         PROG_MIDI2NOTES, PROG_MIDI2NOTES);
+	exit (1);
+}
+
+int main (int argc, char ** argv)
+{
+	POOL pool;
+	pthread_t * threads;
+	long thread_count = 0;
+	size_t i;
+	double start, elapsed;
+
+	memset (&pool, 0, sizeof(pool));
+	argv++;
+	while (*argv && **argv == '-' && (*argv)[1]) {
+		if (!strcmp (*argv, "-j") && argv[1])
+			thread_count = atol (argv[1]);
+		else if (!strcmp (*argv, "-o") && argv[1])
+			pool.output_dir = argv[1];
+		else
+			usage ();
+		argv += 2;
+	}
+	if (!*argv)
+		usage ();
+	pool.paths = argv;
+	while (argv[pool.count])
+		pool.count++;
+	if (thread_count <= 0)
+		thread_count = sysconf (_SC_NPROCESSORS_ONLN);
+	if (thread_count <= 0)
+		thread_count = 1;
+	if ((size_t)thread_count > pool.count)
+		thread_count = pool.count;
+	pthread_mutex_init (&pool.lock, NULL);
+	threads = xmalloc (thread_count*sizeof(pthread_t));
+
+	start = now ();
+	for (i=0;i<(size_t)thread_count;i++)
+		if (pthread_create (threads + i, NULL, worker, &pool)) {
+			fprintf (stderr, "%s: Unable to start a thread\n", PROG_MIDI2NOTES);
+			return 1;
+		}
+	for (i=0;i<(size_t)thread_count;i++)
+		pthread_join (threads[i], NULL);
+	elapsed = now () - start;
+	fprintf (stderr, "%lu events in %.3fs, %.0f events/s\n", pool.events, elapsed,
+	         elapsed > 0 ? pool.events/elapsed : 0);
+	pthread_mutex_destroy (&pool.lock);
+	xfree (threads);
+	return pool.failed;
+}
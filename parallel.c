@@ -0,0 +1,211 @@
+/*
+ * Parallel track encoding - HS
+ * cmc --parallel encodes every track of the song on a thread of its
+ * own. Once all of them are encoded the size of each track is known,
+ * and so is where it goes in the midi file: after the header and the
+ * tracks before it. The file is allocated at its full size up front and
+ * each thread writes its track straight into place, so there is no
+ * copying the song together and writing it out on one thread. The file
+ * is written under a temporary name and renamed over the output once it
+ * is whole, so a track that fails leaves the last good output alone.
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "stream.h"
+#include "util.h"
+#include "cmc.h"
+
+struct part_t
+{
+	pthread_t thread;
+	struct song_t * song;
+	size_t index;
+	char * text;
+	STREAM * chunk;
+	unsigned long ticks;
+	off_t at;              /* where the chunk goes in the file */
+	int failed;
+	BAIL_HANDLER handler;
+};
+
+struct song_t
+{
+	OPTIONS * opt;
+	unsigned long tempo;
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t encoded;        /* tracks done encoding */
+	int placed;            /* the offsets are known, or the song has failed */
+	int failed;
+	struct part_t parts[MAX_TRACK_COUNT];
+	size_t count;
+};
+
+typedef struct part_t PART;
+typedef struct song_t SONG;
+
+static int write_at (int fd, STREAM * data, off_t at)
+{
+	char * p = data->buffer;
+	size_t len = data->size;
+	while (len) {
+		ssize_t n = pwrite (fd, p, len, at);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+		at += n;
+	}
+	return 1;
+}
+
+static void * encode_part (void * arg)
+{
+	PART * part = arg;
+	SONG * s = part->song;
+	int failed;
+	if (setjmp (part->handler.env)) {
+		bail_catch (NULL);
+		part->failed = 1;
+	} else {
+		bail_catch (&part->handler);
+		part->ticks = encode_track_chunk (s->opt, part->text, part->index, s->tempo, part->chunk);
+		bail_catch (NULL);
+	}
+	pthread_mutex_lock (&s->lock);
+	s->encoded++;
+	s->failed |= part->failed;
+	pthread_cond_broadcast (&s->cond);
+	while (!s->placed)
+		pthread_cond_wait (&s->cond, &s->lock);
+	failed = s->failed;
+	pthread_mutex_unlock (&s->lock);
+	if (!failed && !write_at (s->fd, part->chunk, part->at)) {
+		sprintf (part->handler.message, "Unable to write file:%.200s\n", s->opt->output_file);
+		part->failed = 1;
+	}
+	return NULL;
+}
+
+/* the space is only reserved, so a system that can't do that is fine */
+static void allocate_file (int fd, off_t size)
+{
+#ifdef HAVE_FALLOCATE
+	if (!posix_fallocate (fd, 0, size))
+		return;
+#endif
+	ftruncate (fd, size);
+}
+
+void write_parallel (OPTIONS * opt, char ** track_text, size_t track_count)
+{
+	SONG s;
+	STREAM * header = stream_create (64);
+	STREAM * thalam = stream_create (64);
+	BAIL_HANDLER handler;
+	char * message = NULL;
+	char * temp;
+	off_t at = 0;
+	size_t i;
+
+	if (!opt->output_file || !strcmp (opt->output_file, "-"))
+		bail ("--parallel needs an output file\n");
+	s.opt = opt;
+	s.tempo = encode_header (opt, track_text, track_count, header);
+	temp = xmalloc (strlen (opt->output_file) + 8);
+	sprintf (temp, "%s.XXXXXX", opt->output_file);
+	s.fd = mkstemp (temp);
+	if (s.fd < 0)
+		bail ("Unable to write file:%s\n",opt->output_file);
+	fchmod (s.fd, 0644);
+	pthread_mutex_init (&s.lock, NULL);
+	pthread_cond_init (&s.cond, NULL);
+	s.encoded = 0;
+	s.placed = 0;
+	s.failed = 0;
+	s.count = track_count;
+	for (i=0;i<s.count;i++) {
+		PART * part = s.parts + i;
+		part->song = &s;
+		part->index = i;
+		part->text = track_text[i];
+		part->chunk = stream_create (4096);
+		part->failed = 0;
+		part->handler.message[0] = '\0';
+		if (pthread_create (&part->thread, NULL, encode_part, part))
+			bail ("Unable to start a thread\n");
+	}
+
+	pthread_mutex_lock (&s.lock);
+	while (s.encoded < s.count)
+		pthread_cond_wait (&s.cond, &s.lock);
+	if (!s.failed) {
+		if (setjmp (handler.env))
+			s.failed = 1;
+		else {
+			/* the thalam needs the length of the last track */
+			bail_catch (&handler);
+			if (opt->include_thalam) {
+				STREAM * scratch = stream_create (4096);
+				encode_thalam (opt, thalam, scratch, s.parts[s.count-1].ticks);
+				stream_free (scratch);
+			}
+		}
+		bail_catch (NULL);
+	}
+	if (!s.failed) {
+		at = header->size;
+		for (i=0;i<s.count;i++) {
+			s.parts[i].at = at;
+			at += s.parts[i].chunk->size;
+		}
+		allocate_file (s.fd, at + thalam->size);
+	}
+	s.placed = 1;
+	pthread_cond_broadcast (&s.cond);
+	pthread_mutex_unlock (&s.lock);
+
+	if (!s.failed && (!write_at (s.fd, header, 0) || !write_at (s.fd, thalam, at))) {
+		sprintf (handler.message, "Unable to write file:%.200s\n", opt->output_file);
+		s.failed = 1;
+	}
+	for (i=0;i<s.count;i++) {
+		PART * part = s.parts + i;
+		pthread_join (part->thread, NULL);
+		fputs (part->handler.warnings, stderr);
+		if (!message && part->failed)
+			message = part->handler.message;
+		stream_free (part->chunk);
+	}
+	if (!message && s.failed)
+		message = handler.message;
+	if (close (s.fd) < 0 && !message) {
+		sprintf (handler.message, "Unable to write file:%.200s\n", opt->output_file);
+		message = handler.message;
+	}
+	if (!message && rename (temp, opt->output_file) < 0) {
+		sprintf (handler.message, "Unable to write file:%.200s\n", opt->output_file);
+		message = handler.message;
+	}
+	pthread_mutex_destroy (&s.lock);
+	pthread_cond_destroy (&s.cond);
+	stream_free (header);
+	stream_free (thalam);
+	if (message)
+		unlink (temp);
+	xfree (temp);
+	if (message)
+		bail ("%s", message);
+}
@@ -0,0 +1,593 @@
+/*
+ * Pipelined compiles - HS
+ * cmc --pipeline compiles a song on four threads: the reader reads the
+ * notation in blocks, the scanner turns the blocks into tokens, the
+ * encoder turns the tokens into midi events and the writer writes the
+ * events out, so the reading and writing happen while the song is being
+ * encoded. Two stages next to each other share a ring of batches. Only
+ * one thread puts batches into a ring and only one takes them out, so
+ * each end just publishes a counter and no locks are needed while
+ * batches keep coming. A stage that has waited a while sleeps on the
+ * ring until the other end moves it on. The batches are allocated once
+ * and go round and round.
+ *
+ * Tracks are written with a zero length that is filled in when the
+ * track ends, so the song has to go to a file. The divisions can't be
+ * fitted to the song (-d auto) since the notation isn't all there when
+ * encoding starts.
+ */
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "stream.h"
+#include "util.h"
+#include "midi.h"
+#include "scanner.h"
+#include "cmc.h"
+
+#define RING_SLOTS  8            /* batches in flight between two stages */
+#define BLOCK_SIZE  (64*1024)    /* bytes read at a time */
+#define TOKEN_BATCH 1024         /* tokens handed over at a time */
+#define KEEP_TEXT   (256*1024)   /* scanned text is dropped past this much */
+#define SPINS       100          /* tries before a waiting stage sleeps */
+
+#define TRACK_START 1            /* the batch starts with a track header */
+#define TRACK_END   2            /* the track's length can be filled in */
+#define SONG_END    4
+
+#define load_acquire(x)    __atomic_load_n (&(x), __ATOMIC_ACQUIRE)
+#define store_release(x,v) __atomic_store_n (&(x), (v), __ATOMIC_RELEASE)
+#define full_fence()       __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+enum stage_id_t
+{
+	READER, SCANNER_STAGE, ENCODER, WRITER, STAGE_COUNT
+};
+
+struct ring_t
+{
+	void * slots[RING_SLOTS];
+	unsigned long head;    /* batches put in, written by the producer only */
+	char pad[64];          /* keeps the two ends off each other's cache line */
+	unsigned long tail;    /* batches taken out, written by the consumer only */
+	char pad2[64];
+	pthread_mutex_t lock;  /* only taken to sleep or to wake a sleeper */
+	pthread_cond_t wake;
+	int sleeping[2];       /* the consumer [0] or the producer [1] is asleep */
+};
+
+struct block_t
+{
+	size_t len;
+	int last;              /* the end of the file */
+	char data[BLOCK_SIZE];
+};
+
+struct scanned_t
+{
+	TOKEN_TYPE id;
+	int line;
+	int ahead_count;       /* scanner_count_ahead for a BRACEOPEN */
+	size_t at;             /* where the text of the token is in the batch */
+	size_t len;
+};
+
+struct tokens_t
+{
+	size_t count;
+	STREAM * text;
+	struct scanned_t token[TOKEN_BATCH];
+};
+
+struct bytes_t
+{
+	STREAM * data;
+	int flags;
+};
+
+struct stage_t
+{
+	const char * name;
+	pthread_t thread;
+	struct pipeline_t * p;
+	void (*run) (struct pipeline_t * p, struct stage_t * s);
+	double start;
+	double end;
+	double starved;        /* seconds spent waiting for input */
+	double blocked;        /* seconds spent waiting for room to put output */
+	BAIL_HANDLER handler;
+};
+
+struct pipeline_t
+{
+	OPTIONS * opt;
+	char * names[MAX_TRACK_COUNT];
+	int files[MAX_TRACK_COUNT];
+	size_t count;
+	int out;
+	struct ring_t blocks;
+	struct ring_t tokens;
+	struct ring_t bytes;
+	struct stage_t stages[STAGE_COUNT];
+	int failed;
+
+	/* the encoder's end of the token ring */
+	struct tokens_t * batch;
+	size_t next;
+	int ended;             /* the track's NONE has been handed out */
+	STREAM token;          /* points into the batch */
+	MIDI_TRACK mt;
+	int flags;             /* for the next bytes handed to the writer */
+
+	unsigned long bytes_in;
+	unsigned long token_count;
+	unsigned long bytes_out;
+};
+
+typedef struct ring_t      RING;
+typedef struct block_t     BLOCK;
+typedef struct tokens_t    TOKENS;
+typedef struct bytes_t     BYTES;
+typedef struct stage_t     STAGE;
+typedef struct pipeline_t  PIPELINE;
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static int ring_ready (RING * r, int put)
+{
+	if (put)
+		return r->head - load_acquire (r->tail) < RING_SLOTS;
+	return load_acquire (r->head) != r->tail;
+}
+
+static void ring_wake (RING * r)
+{
+	pthread_mutex_lock (&r->lock);
+	pthread_cond_broadcast (&r->wake);
+	pthread_mutex_unlock (&r->lock);
+}
+
+/* the slot to fill next (put) or to use next (!put), once there is one.
+ * A stage that has spun for a while sleeps until the other end puts or
+ * takes a batch. A stage waiting on another that has failed gives up */
+static void * ring_slot (STAGE * s, RING * r, int put)
+{
+	double start;
+	int spins = 0;
+	if (!ring_ready (r, put)) {
+		start = now ();
+		while (!ring_ready (r, put)) {
+			if (load_acquire (s->p->failed))
+				longjmp (s->handler.env, 1);
+			if (++spins <= SPINS)
+				continue;
+			/* the other end looks for a sleeper on this end after it
+			 * moves its counter, so one of the two sees the other.
+			 * Each end has a flag of its own, so neither can clear
+			 * the other's */
+			pthread_mutex_lock (&r->lock);
+			store_release (r->sleeping[put], 1);
+			full_fence ();
+			while (!ring_ready (r, put) && !load_acquire (s->p->failed))
+				pthread_cond_wait (&r->wake, &r->lock);
+			store_release (r->sleeping[put], 0);
+			pthread_mutex_unlock (&r->lock);
+		}
+		*(put ? &s->blocked : &s->starved) += now () - start;
+	}
+	return r->slots[(put ? r->head : r->tail) % RING_SLOTS];
+}
+
+static void ring_put (RING * r)
+{
+	store_release (r->head, r->head + 1);
+	full_fence ();
+	if (load_acquire (r->sleeping[0]))
+		ring_wake (r);
+}
+
+static void ring_take (RING * r)
+{
+	store_release (r->tail, r->tail + 1);
+	full_fence ();
+	if (load_acquire (r->sleeping[1]))
+		ring_wake (r);
+}
+
+static void read_stage (PIPELINE * p, STAGE * s)
+{
+	size_t i;
+	for (i=0;i<p->count;i++) {
+		BLOCK * b;
+		do {
+			ssize_t n;
+			b = ring_slot (s, &p->blocks, 1);
+			while ((n = read (p->files[i], b->data, BLOCK_SIZE)) < 0 && errno == EINTR)
+				;
+			if (n < 0)
+				bail ("Unable to read file:%s\n",p->names[i]);
+			b->len = n;
+			b->last = !n;
+			p->bytes_in += n;
+			ring_put (&p->blocks);
+		} while (!b->last);
+	}
+}
+
+/* add the next block to the end of the text being scanned. The text up
+ * to the character ahead has been scanned and can go */
+static void more_text (PIPELINE * p, STAGE * s, SCANNER * sc, int * text_end, int * file_end)
+{
+	STREAM * text = sc->text;
+	BLOCK * b = ring_slot (s, &p->blocks, 0);
+	size_t len = b->len;
+	char * nul = memchr (b->data, '\0', len);
+	if (text->r_offset > KEEP_TEXT) {
+		size_t drop = text->r_offset - 1;
+		memmove (text->buffer, text->buffer + drop, text->size - drop);
+		text->size -= drop;
+		text->r_offset -= drop;
+	}
+	/* the notation stops at a '\0', as it does when it is read whole */
+	if (nul) {
+		len = nul - b->data;
+		*text_end = 1;
+	}
+	if (b->last)
+		*text_end = *file_end = 1;
+	text->size--;
+	text->offset = text->size;
+	stream_write (text, b->data, len);
+	stream_add_char (text, '\0');
+	ring_take (&p->blocks);
+	sc->ahead = text->buffer[text->r_offset - 1];
+}
+
+static void put_tokens (PIPELINE * p, TOKENS ** batch)
+{
+	if (*batch) {
+		ring_put (&p->tokens);
+		*batch = NULL;
+	}
+}
+
+/* A token is only handed on once the scanner has seen the text after
+ * it. Otherwise more text is read and the token is scanned again */
+static void scan_track (PIPELINE * p, STAGE * s, TOKENS ** batch)
+{
+	SCANNER sc;
+	int text_end = 0, file_end = 0;
+	/* a blank to start with, the scanner can't start out empty */
+	scanner_init (&sc, " ");
+	while (1) {
+		SCANNER saved = sc;
+		int r_offset = sc.text->r_offset;
+		int complete = 1, ran_out;
+		int ahead_count = 0;
+		struct scanned_t * t;
+		TOKENS * b;
+		nexttoken (&sc);
+		if (!text_end && sc.text->r_offset >= (int)sc.text->size - 1)
+			complete = 0;
+		else if (sc.tokenid == BRACEOPEN) {
+			ahead_count = scanner_count_ahead_end (&sc, &ran_out);
+			complete = text_end || !ran_out;
+		}
+		if (!complete) {
+			sc = saved;
+			sc.text->r_offset = r_offset;
+			/* don't keep the encoder waiting on the tokens so far */
+			put_tokens (p, batch);
+			more_text (p, s, &sc, &text_end, &file_end);
+			continue;
+		}
+		if (!*batch) {
+			*batch = ring_slot (s, &p->tokens, 1);
+			(*batch)->count = 0;
+			stream_write_reset ((*batch)->text);
+		}
+		b = *batch;
+		t = b->token + b->count++;
+		t->id = sc.tokenid;
+		t->line = sc.linecount;
+		t->ahead_count = ahead_count;
+		t->at = b->text->size;
+		t->len = sc.token->size;
+		stream_write (b->text, sc.token->buffer, sc.token->size);
+		p->token_count++;
+		if (b->count == TOKEN_BATCH)
+			put_tokens (p, batch);
+		if (sc.tokenid == NONE)
+			break;
+	}
+	/* whatever follows a '\0' */
+	while (!file_end) {
+		BLOCK * b = ring_slot (s, &p->blocks, 0);
+		file_end = b->last;
+		ring_take (&p->blocks);
+	}
+	stream_free (sc.token);
+	stream_free (sc.text);
+}
+
+static void scan_stage (PIPELINE * p, STAGE * s)
+{
+	TOKENS * batch = NULL;
+	size_t i;
+	for (i=0;i<p->count;i++)
+		scan_track (p, s, &batch);
+	put_tokens (p, &batch);
+}
+
+/* hand what the encoder has written so far to the writer */
+static void put_bytes (PIPELINE * p, STAGE * s, int flags)
+{
+	BYTES * b;
+	STREAM * data;
+	flags |= p->flags;
+	if (!p->mt.stream->size && !flags)
+		return;
+	b = ring_slot (s, &p->bytes, 1);
+	data = b->data;
+	b->data = p->mt.stream;
+	b->flags = flags;
+	p->mt.stream = data;
+	p->flags = 0;
+	stream_write_reset (data);
+	ring_put (&p->bytes);
+}
+
+/* how the encoder's scanner gets its tokens. The end of a track is
+ * given out until the next track starts */
+static void feed (SCANNER * sc)
+{
+	PIPELINE * p = sc->source;
+	STAGE * s = p->stages + ENCODER;
+	struct scanned_t * t;
+	if (p->ended)
+		return;
+	if (!p->batch || p->next == p->batch->count) {
+		if (p->batch) {
+			ring_take (&p->tokens);
+			put_bytes (p, s, 0);
+		}
+		p->batch = ring_slot (s, &p->tokens, 0);
+		p->next = 0;
+	}
+	t = p->batch->token + p->next++;
+	sc->tokenid = t->id;
+	sc->linecount = t->line;
+	if (t->id == BRACEOPEN)
+		sc->ahead_count = t->ahead_count;
+	p->token.buffer = p->batch->text->buffer + t->at;
+	p->token.size = p->token.capacity = p->token.offset = t->len;
+	p->token.spill = NULL;
+	p->token.window = 0;
+	p->ended = t->id == NONE;
+}
+
+static void encode_stage (PIPELINE * p, STAGE * s)
+{
+	SCANNER sc;
+	unsigned long ticks = 0;
+	size_t i;
+	sc.feed = feed;
+	sc.source = p;
+	sc.token = &p->token;
+	sc.text = NULL;
+	sc.tokenid = NONE;
+	sc.state = STATE_NOTATION;
+	sc.linecount = 1;
+	sc.ahead_count = 0;
+	encode_header (p->opt, NULL, p->count, p->mt.stream);
+	put_bytes (p, s, 0);
+	for (i=0;i<p->count;i++) {
+		stream_write (p->mt.stream, "MTrk\0\0\0\0", 8);
+		p->flags |= TRACK_START;
+		p->ended = 0;
+		ticks = encode_scanned_track (p->opt, &p->mt, &sc, (unsigned char)i);
+		put_bytes (p, s, TRACK_END);
+	}
+	if (p->batch)
+		ring_take (&p->tokens);
+	if (p->opt->include_thalam) {
+		STREAM * scratch = stream_create (4096);
+		encode_thalam (p->opt, p->mt.stream, scratch, ticks);
+		stream_free (scratch);
+	}
+	put_bytes (p, s, SONG_END);
+}
+
+static void write_all (PIPELINE * p, char * data, size_t len)
+{
+	while (len) {
+		ssize_t n = write (p->out, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			bail ("Unable to write file:%s\n",p->opt->output_file);
+		data += n;
+		len -= n;
+	}
+}
+
+static void write_stage (PIPELINE * p, STAGE * s)
+{
+	unsigned long track_at = 0;
+	int flags;
+	do {
+		BYTES * b = ring_slot (s, &p->bytes, 0);
+		flags = b->flags;
+		if (flags & TRACK_START)
+			track_at = p->bytes_out;
+		write_all (p, b->data->buffer, b->data->size);
+		p->bytes_out += b->data->size;
+		if (flags & TRACK_END) {
+			unsigned long len = p->bytes_out - track_at - 8;
+			unsigned char length[4];
+			length[0] = (unsigned char)(len>>24);
+			length[1] = (unsigned char)(len>>16);
+			length[2] = (unsigned char)(len>>8);
+			length[3] = (unsigned char)len;
+			if (pwrite (p->out, length, 4, track_at + 4) != 4)
+				bail ("Unable to write file:%s\n",p->opt->output_file);
+		}
+		ring_take (&p->bytes);
+	} while (!(flags & SONG_END));
+}
+
+static void * run_stage (void * arg)
+{
+	STAGE * s = arg;
+	s->handler.message[0] = '\0';
+	if (setjmp (s->handler.env)) {
+		bail_catch (NULL);
+		store_release (s->p->failed, 1);
+		ring_wake (&s->p->blocks);
+		ring_wake (&s->p->tokens);
+		ring_wake (&s->p->bytes);
+		s->end = now ();
+		return NULL;
+	}
+	bail_catch (&s->handler);
+	s->start = now ();
+	s->run (s->p, s);
+	bail_catch (NULL);
+	s->end = now ();
+	return NULL;
+}
+
+static void ring_init (RING * r, size_t size)
+{
+	size_t i;
+	r->head = r->tail = 0;
+	r->sleeping[0] = r->sleeping[1] = 0;
+	pthread_mutex_init (&r->lock, NULL);
+	pthread_cond_init (&r->wake, NULL);
+	for (i=0;i<RING_SLOTS;i++)
+		r->slots[i] = xmalloc (size);
+}
+
+static void ring_free (RING * r)
+{
+	size_t i;
+	for (i=0;i<RING_SLOTS;i++)
+		xfree (r->slots[i]);
+	pthread_mutex_destroy (&r->lock);
+	pthread_cond_destroy (&r->wake);
+}
+
+/* where the time of each stage went. The stage busy for the most time
+ * is the one holding the others up */
+static void report (PIPELINE * p, double elapsed)
+{
+	size_t i;
+	fprintf (stderr, "%s: pipeline read %lu bytes, %lu tokens, wrote %lu bytes in %.3fms\n",
+	         PROG_NAME, p->bytes_in, p->token_count, p->bytes_out, elapsed*1000);
+	for (i=0;i<STAGE_COUNT;i++) {
+		STAGE * s = p->stages + i;
+		double busy = s->end - s->start - s->starved - s->blocked;
+		fprintf (stderr, "%s:   %-8s busy %5.1f%%  waiting for input %5.1f%%  for room %5.1f%%\n",
+		         PROG_NAME, s->name, busy*100/elapsed, s->starved*100/elapsed, s->blocked*100/elapsed);
+	}
+}
+
+int run_pipeline (OPTIONS * opt)
+{
+	static const char * names[STAGE_COUNT] = {"reader", "scanner", "encoder", "writer"};
+	static void (*runs[STAGE_COUNT]) (PIPELINE *, STAGE *) = {
+		read_stage, scan_stage, encode_stage, write_stage
+	};
+	PIPELINE p;
+	char * temp;
+	char * message = NULL;
+	double start;
+	size_t i;
+
+	if (!opt->output_file || !strcmp (opt->output_file, "-"))
+		bail ("--pipeline needs an output file\n");
+	if (opt->auto_divisions)
+		bail ("--pipeline can't fit the divisions to the song, give them with -d\n");
+	memset (&p, 0, sizeof(p));
+	p.opt = opt;
+	/* the tracks go in the same order as load_tracks puts them */
+	p.count = opt->file_count;
+	if (!p.count) {
+		p.names[0] = "stdin";
+		p.files[0] = STDIN_FILENO;
+		p.count = 1;
+	}
+	for (i=0;i<opt->file_count;i++) {
+		p.names[i] = opt->in_files[p.count-1-i];
+		p.files[i] = open (p.names[i], O_RDONLY);
+		if (p.files[i] < 0)
+			bail ("Unable to open file:%s\n",p.names[i]);
+	}
+	temp = xmalloc (strlen (opt->output_file) + 8);
+	sprintf (temp, "%s.XXXXXX", opt->output_file);
+	p.out = mkstemp (temp);
+	if (p.out < 0)
+		bail ("Unable to write file:%s\n",opt->output_file);
+	fchmod (p.out, 0644);
+
+	ring_init (&p.blocks, sizeof(BLOCK));
+	ring_init (&p.tokens, sizeof(TOKENS));
+	ring_init (&p.bytes, sizeof(BYTES));
+	for (i=0;i<RING_SLOTS;i++) {
+		((TOKENS *)p.tokens.slots[i])->text = stream_create (4096);
+		((BYTES *)p.bytes.slots[i])->data = stream_create (4096);
+	}
+	p.mt.stream = stream_create (4096);
+
+	start = now ();
+	for (i=0;i<STAGE_COUNT;i++) {
+		p.stages[i].name = names[i];
+		p.stages[i].p = &p;
+		p.stages[i].run = runs[i];
+		if (pthread_create (&p.stages[i].thread, NULL, run_stage, p.stages + i))
+			bail ("Unable to start a thread\n");
+	}
+	for (i=0;i<STAGE_COUNT;i++) {
+		pthread_join (p.stages[i].thread, NULL);
+		fputs (p.stages[i].handler.warnings, stderr);
+		if (!message && p.stages[i].handler.message[0])
+			message = p.stages[i].handler.message;
+	}
+	if (p.failed || close (p.out) < 0) {
+		unlink (temp);
+		if (message)
+			bail ("%s", message);
+		bail ("Unable to write file:%s\n",opt->output_file);
+	}
+	if (rename (temp, opt->output_file) < 0) {
+		unlink (temp);
+		bail ("Unable to write file:%s\n",opt->output_file);
+	}
+	report (&p, now () - start);
+
+	for (i=0;i<opt->file_count;i++)
+		close (p.files[i]);
+	for (i=0;i<RING_SLOTS;i++) {
+		stream_free (((TOKENS *)p.tokens.slots[i])->text);
+		stream_free (((BYTES *)p.bytes.slots[i])->data);
+	}
+	ring_free (&p.blocks);
+	ring_free (&p.tokens);
+	ring_free (&p.bytes);
+	stream_free (p.mt.stream);
+	xfree (temp);
+	return 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * Raga tuning tables - HS
+ * The swaras of a raga are tuned to the just ratios they are sung at
+ * instead of the equal tempered notes of a keyboard.
+ */
+#include <stdio.h>
+#include <strings.h>
+
+#include "raga.h"
+#include "curve.h"
+
+/*                      S    r    R    g    G    m    M    P    d    D    n    N */
+const RAGA_TABLE ragas[] = {
+	{"equal",           "SrRgGmMPdDnN",
+	                    {0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0}},
+	{"just",            "SrRgGmMPdDnN",          /* 16/15 9/8 6/5 5/4 4/3 45/32 3/2 8/5 5/3 16/9 15/8 */
+	                    {0,  12,   4,  16, -14,  -2, -10,   2,  14, -16,  -4, -12}},
+	{"shankarabharanam","SRGmPDN",
+	                    {0,   0,   4,   0, -14,  -2,   0,   2,   0, -16,   0, -12}},
+	{"kalyani",         "SRGMPDN",
+	                    {0,   0,   4,   0, -14,   0, -10,   2,   0, -16,   0, -12}},
+	{"kharaharapriya",  "SRgmPDn",
+	                    {0,   0,   4,  16,   0,  -2,   0,   2,   0, -16,  -4,   0}},
+	{"harikambhoji",    "SRGmPDn",
+	                    {0,   0,   4,   0, -14,  -2,   0,   2,   0, -16,  -4,   0}},
+	{"natabhairavi",    "SRgmPdn",
+	                    {0,   0,   4,  16,   0,  -2,   0,   2,  14,   0,  -4,   0}},
+	{"mayamalavagowla", "SrGmPdN",
+	                    {0,  12,   0,   0, -14,  -2,   0,   2,  14,   0,   0, -12}},
+	{"todi",            "SrgmPdn",               /* 256/243 32/27 128/81 */
+	                    {0, -10,   0,  -6,   0,  -2,   0,   2,  -8,   0,  -4,   0}},
+	{NULL, NULL, {0}}
+};
+
+const RAGA_TABLE * raga_find (char * name)
+{
+	const RAGA_TABLE * r;
+	for (r=ragas;r->name;r++)
+		if (!strcasecmp (name, r->name))
+			return r;
+	return NULL;
+}
+
+/* the pitch bend that tunes 'note' to the raga */
+long raga_bend (const RAGA_TABLE * raga, unsigned char note)
+{
+	if (!raga)
+		return PITCH_BEND_CENTER;
+	return PITCH_BEND_CENTER + (long)raga->cents[note%12]*PITCH_BEND_SEMITONE/100;
+}
+
+/* build a real time scale/octave tuning message (1 byte form) for one
+ * channel. Returns the size of the message, without the leading 0xF0 */
+int raga_mts (const RAGA_TABLE * raga, unsigned char channel, unsigned char * data)
+{
+	int i;
+	data[0] = 0x7F;  /* real time */
+	data[1] = 0x7F;  /* all devices */
+	data[2] = 0x08;  /* MIDI tuning standard */
+	data[3] = 0x08;  /* scale/octave tuning, 1 byte form */
+	data[4] = channel >= 14 ? 1<<(channel-14) : 0;
+	data[5] = channel >= 7 && channel < 14 ? 1<<(channel-7) : 0;
+	data[6] = channel < 7 ? 1<<channel : 0;
+	for (i=0;i<12;i++)
+		data[7+i] = (unsigned char)(0x40 + (raga ? raga->cents[i] : 0));
+	data[19] = 0xF7;
+	return RAGA_MTS_SIZE;
+}
@@ -0,0 +1,29 @@
+/* Raga tuning tables
+ * HS
+ */
+#ifndef _RAGA_H_
+#define _RAGA_H_
+
+#define TUNING_BEND 1  /* a pitch bend in front of each note that needs one */
+#define TUNING_MTS  2  /* one MIDI Tuning Standard message per raga */
+
+#define RAGA_MTS_SIZE 20 /* size of a scale/octave tuning message */
+
+/* 'cents' holds the just intonation of each of the 12 swaras (S r R g G
+ * m M P d D n N) as an offset from the equal tempered note */
+struct raga_t
+{
+	char * name;
+	char * swaras;
+	int cents[12];
+};
+
+typedef struct raga_t RAGA_TABLE;
+
+extern const RAGA_TABLE ragas[];
+
+const RAGA_TABLE * raga_find (char * name);
+long raga_bend (const RAGA_TABLE * raga, unsigned char note);
+int  raga_mts  (const RAGA_TABLE * raga, unsigned char channel, unsigned char * data);
+
+#endif /* _RAGA_H_ */
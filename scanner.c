@@ -110,7 +110,7 @@ static void scanstring(SCANNER *scanner)
 				case '"': scanner->ahead = '"' ;/*nextchar (scanner)*/;break;
 				case '\0':break;
 				default:
-					fprintf (stderr,"Unrecognized control character:\\%c\n",scanner->ahead);
+					warn ("Unrecognized control character:\\%c\n",scanner->ahead);
 			}
 			
 		}
@@ -129,8 +129,10 @@ static void scannumber(SCANNER *scanner)
 
 	while (isnum(scanner->ahead))nextchar(scanner);
 	
+	/* only a digit after the '.' makes it a float, so that
+	 * ranges like 40..100 can be scanned */
 	if (scanner->ahead=='.')
-		if (isnum(scanner->text->buffer[0]))
+		if (isnum(scanner->text->buffer[scanner->text->r_offset]))
 		{
 			scanner->tokenid=FLOAT;
 			nextchar (scanner);
@@ -173,7 +175,7 @@ static void scancolon(SCANNER *scanner)
 				case ':': scanner->ahead = ':' ;                       break;
 				case '\0':break;
 				default:
-					fprintf (stderr,"Unrecognized control character:\\%c\n",scanner->ahead);
+					warn ("Unrecognized control character:\\%c\n",scanner->ahead);
 			}
 			
 		}
@@ -232,6 +234,11 @@ static void scanident(SCANNER *scanner)
 	register_ ("base", BASE);
 	register_ ("volume", VOLUME);
 	register_ ("pan", PAN);
+	register_ ("phrase", PHRASE);
+	register_ ("play", PLAY);
+	register_ ("end", END);
+	register_ ("raga", RAGA);
+	register_ ("nadai", NADAI);
     
 }
 static void scancomma(SCANNER *scanner)
@@ -244,11 +251,35 @@ static void scanstar (SCANNER * scanner)
 	scanner->tokenid = STAR;
 	nextchar (scanner);
 }
+static void scantilde (SCANNER * scanner)
+{
+	scanner->tokenid = TILDE;
+	nextchar (scanner);
+}
+/* ".." between the two ends of a range */
+static void scanrange (SCANNER * scanner)
+{
+	scanner->tokenid = ERROR;
+	nextchar (scanner);
+	if (scanner->ahead == '.') {
+		scanner->tokenid = RANGE;
+		nextchar (scanner);
+	}
+}
 static void scanpipe (SCANNER * scanner)
 {
 	scanner->tokenid = PIPE;
 	nextchar (scanner);
 }
+/* the repeat count that follows a closing '|' e.g. x3 */
+static void scanrepeat (SCANNER * scanner)
+{
+	scanner->tokenid = REPEAT;
+	nextchar (scanner);
+	while (isnum (scanner->ahead))
+		nextchar (scanner);
+	stream_add_char (scanner->token, '\0');
+}
 static void scannull(SCANNER *scanner)
 {
 	scanner->tokenid=NONE;
@@ -269,6 +300,7 @@ void _nexttoken(SCANNER *scanner)
 	if (iswhitespace (scanner, scanner->ahead)) eatwhitespace (scanner);
 	if (isnum (scanner->ahead)) scannumber (scanner); else
 	if (scanner->state == STATE_NOTATION && is_valid_note (scanner->ahead)) scan_note (scanner); else
+	if (scanner->state == STATE_NOTATION && scanner->ahead == 'x') scanrepeat (scanner); else
 	if (scanner->state == STATE_DIRECTIVE && isalphanum (scanner->ahead)) scanident (scanner); else
 	switch (scanner->ahead)
 	{
@@ -282,6 +314,8 @@ void _nexttoken(SCANNER *scanner)
 		case ',': scancomma(scanner);		break;
 		case '*': scanstar (scanner);       break;
 		case '|': scanpipe (scanner);       break;
+		case '~': scantilde (scanner);      break;
+		case '.': scanrange (scanner);      break;
 		default:  scandef(scanner);
 	}
 	stream_add_char (scanner->token, '\0');
@@ -289,6 +323,10 @@ void _nexttoken(SCANNER *scanner)
 
 void nexttoken(SCANNER *scanner)
 {
+	if (scanner->feed) {
+		scanner->feed (scanner);
+		return;
+	}
 	_nexttoken(scanner);
 	if (scanner->tokenid==COMMENT)
 		while ((scanner->tokenid==COMMENT)&&(scanner->tokenid!=NONE))
@@ -301,16 +339,63 @@ void scanner_init (SCANNER * scanner, const char * text)
 	scanner->text = stream_create_from_buffer ( text, strlen(text));
 	scanner->linecount = 1;
 	scanner->colcount = 0;
+	scanner->feed = NULL;
+	scanner->source = NULL;
 	stream_add_char (scanner->text, '\0');
 	stream_read_char (scanner->text, &(scanner->ahead));
 }
 
+/* Count the notes and commas from the end of the current directive up
+ * to the next directive or repeat bar, without consuming any input */
+int scanner_count_ahead (SCANNER * scanner)
+{
+	int ended;
+	if (scanner->feed)
+		return scanner->ahead_count;
+	return scanner_count_ahead_end (scanner, &ended);
+}
+
+/* the same, setting 'ended' if the count ran into the end of the text */
+int scanner_count_ahead_end (SCANNER * scanner, int * ended)
+{
+	char * p = scanner->text->buffer + scanner->text->r_offset - 1;
+	int count = 0;
+	if (scanner->tokenid != BRACECLOSE) {
+		while (*p && *p != '}')
+			p++;
+		if (*p)
+			p++;
+	}
+	while (*p && *p != '{' && *p != '|') {
+		if (*p == '#') {
+			while (*p && *p != 10)
+				p++;
+			continue;
+		}
+		if (*p == ':') {
+			p++;
+			while (*p && *p != ':') {
+				if (*p == '\\' && p[1])
+					p++;
+				p++;
+			}
+			if (*p)
+				p++;
+			continue;
+		}
+		if (*p == ',' || *p == '=' || is_valid_note (*p))
+			count++;
+		p++;
+	}
+	*ended = !*p;
+	return count;
+}
+
 /* print an error message and ext */
 static void print_error (SCANNER * scanner)
 {
-	fprintf (stderr, "%s: %i Unexpected token:%s",PROG_NAME,
-		                          scanner->linecount,scanner->token->buffer);
-	exit(0);
+	bail ("%s: %i Unexpected token:%s\n",PROG_NAME,
+	      scanner->linecount,scanner->token->buffer);
 }
 void match (SCANNER * scanner, TOKEN_TYPE token)
 {
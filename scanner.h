@@ -7,8 +7,9 @@ enum token_t
 {
 	NONE, COMMENT, STRING, NOTE, IDENTIFIER, NUMBER, COMMA, COLON,
 	BRACEOPEN, BRACECLOSE, ERROR, LYRIC, FLOAT, EQUAL, STAR, PIPE, 
+	REPEAT, TILDE, RANGE,
 	/* special directives */
-	INSTRUMENT, TEMPO, VOLUME, BASE, PAN
+	INSTRUMENT, TEMPO, VOLUME, BASE, PAN, PHRASE, PLAY, END, RAGA, NADAI
 };
 enum scanner_state_t {
 	STATE_DIRECTIVE,
@@ -25,6 +26,12 @@ struct scanner_t
 	STREAM * token;
 	STREAM * text;
 	char * filename;
+	/* a scanner can be fed tokens scanned somewhere else. 'feed' sets
+	 * the next token and 'ahead_count' is what scanner_count_ahead
+	 * would have counted for the last directive */
+	void (*feed) (struct scanner_t * scanner);
+	void * source;
+	int ahead_count;
 };
 
 typedef enum token_t TOKEN_TYPE;
@@ -35,4 +42,6 @@ void nexttoken (SCANNER *scanner);
 void scanner_init (SCANNER * scanner, const char * text);
 void match (SCANNER * scanner, TOKEN_TYPE token);
 void match_stay (SCANNER * scanner, TOKEN_TYPE token);
+int  scanner_count_ahead (SCANNER * scanner);
+int  scanner_count_ahead_end (SCANNER * scanner, int * ended);
 #endif /* _SCANNER_H_ */
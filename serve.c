@@ -0,0 +1,329 @@
+/*
+ * Compile server - HS
+ * cmc --serve listens on a unix socket and compiles the notation sent
+ * to it. A request is a header line followed by the notation:
+ *
+ *   <length of the notation> [options]\n<notation>
+ *
+ * and is answered with "OK <length>\n<midi file>" or
+ * "ERR <length>\n<message>". Any number of requests can be sent down
+ * one connection.
+ *
+ * Every worker thread runs an epoll loop of its own. The listening
+ * socket is in all of them (EPOLLEXCLUSIVE, so a new connection wakes
+ * one worker) and a connection stays with the worker that accepted it.
+ * A worker keeps its buffers from one request to the next, and every
+ * connection has a session so that sending an edited song again only
+ * encodes the sections that changed. The socket is made so only the
+ * user running the server can connect to it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "stream.h"
+#include "util.h"
+#include "cmc.h"
+
+#define MAX_EVENTS       64
+#define MAX_REQUEST      (16*1024*1024)
+#define MAX_REQUEST_ARGS 64
+#define READ_SIZE        (64*1024)
+
+struct client_t
+{
+	int fd;
+	STREAM * in;           /* bytes of the requests not yet answered */
+	STREAM * out;          /* answers not yet sent */
+	size_t sent;
+	unsigned int events;   /* what the client is registered for */
+	int closing;           /* the client has hung up */
+	SESSION * session;     /* what the last request compiled */
+};
+
+struct server_t;
+
+struct server_worker_t
+{
+	pthread_t thread;
+	struct server_t * server;
+	int epfd;
+	STREAM * notes;        /* the notation of the current request */
+	STREAM * output;
+	STREAM * scratch;
+	BAIL_HANDLER handler;
+	char buffer[READ_SIZE];
+};
+
+struct server_t
+{
+	OPTIONS * opt;         /* the options every request starts out with */
+	int listener;
+};
+
+typedef struct client_t        CLIENT;
+typedef struct server_worker_t SERVER_WORKER;
+typedef struct server_t        SERVER;
+
+static void close_client (SERVER_WORKER * w, CLIENT * c)
+{
+	epoll_ctl (w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close (c->fd);
+	stream_free (c->in);
+	stream_free (c->out);
+	session_free (c->session);
+	xfree (c);
+}
+
+static void accept_clients (SERVER_WORKER * w)
+{
+	int fd;
+	while ((fd = accept4 (w->server->listener, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		struct epoll_event ev;
+		CLIENT * c = xmalloc (sizeof(CLIENT));
+		c->fd = fd;
+		c->in = stream_create (READ_SIZE);
+		c->out = stream_create (1024);
+		c->sent = 0;
+		c->events = EPOLLIN|EPOLLRDHUP;
+		c->closing = 0;
+		c->session = session_create ();
+		ev.events = c->events;
+		ev.data.ptr = c;
+		if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close (fd);
+			stream_free (c->in);
+			stream_free (c->out);
+			session_free (c->session);
+			xfree (c);
+		}
+	}
+}
+
+static void answer (CLIENT * c, char * status, char * data, size_t len)
+{
+	char head[32];
+	sprintf (head, "%s %lu\n", status, (unsigned long)len);
+	stream_add_str (c->out, head);
+	stream_write (c->out, data, len);
+}
+
+/* compile the notation in w->notes with the options in 'args' */
+static void compile (SERVER_WORKER * w, CLIENT * c, char * args)
+{
+	char * argv[MAX_REQUEST_ARGS+1];
+	char * tracks[1];
+	OPTIONS opt;
+	if (setjmp (w->handler.env)) {
+		bail_catch (NULL);
+		answer (c, "ERR", w->handler.message, strlen (w->handler.message));
+		return;
+	}
+	bail_catch (&w->handler);
+	if (split_words (args, NULL) > MAX_REQUEST_ARGS)
+		bail ("Too many options\n");
+	split_words (args, argv);
+	opt = *w->server->opt;
+	if (!parse_args (&opt, argv))
+		bail ("Nothing to compile\n");
+	if (opt.file_count || opt.output_file || opt.batch_file != w->server->opt->batch_file
+	    || opt.serve_path != w->server->opt->serve_path)
+		bail ("Only options can be given with a request\n");
+	tracks[0] = w->notes->buffer;
+	session_encode (c->session, &opt, tracks, 1, w->output, w->scratch);
+	bail_catch (NULL);
+	answer (c, "OK", w->output->buffer, w->output->size);
+}
+
+/* answer every complete request read so far. Returns 0 if the client
+ * sent something that can't be a request */
+static int handle_requests (SERVER_WORKER * w, CLIENT * c)
+{
+	size_t done = 0;
+	while (done < c->in->size) {
+		char * head = c->in->buffer + done;
+		char * eol = memchr (head, '\n', c->in->size - done);
+		char * args;
+		unsigned long len;
+		if (!eol) {
+			if (c->in->size - done > 1024)
+				return 0;
+			break;
+		}
+		len = strtoul (head, &args, 10);
+		if (args == head || len > MAX_REQUEST)
+			return 0;
+		if ((size_t)(eol + 1 - c->in->buffer) + len > c->in->size)
+			break;
+		stream_write_reset (w->notes);
+		stream_write (w->notes, eol + 1, len);
+		stream_add_char (w->notes, '\0');
+		*eol = '\0';
+		compile (w, c, args);
+		done = eol + 1 + len - c->in->buffer;
+	}
+	/* keep what is left of a partly read request */
+	memmove (c->in->buffer, c->in->buffer + done, c->in->size - done);
+	c->in->size -= done;
+	c->in->offset = c->in->size;
+	return 1;
+}
+
+/* send as much of the answers as the socket takes. Returns 0 on error */
+static int flush_client (SERVER_WORKER * w, CLIENT * c)
+{
+	struct epoll_event ev;
+	int writing;
+	unsigned int events;
+	while (c->sent < c->out->size) {
+		ssize_t n = send (c->fd, c->out->buffer + c->sent, c->out->size - c->sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		c->sent += n;
+	}
+	writing = c->sent < c->out->size;
+	if (!writing) {
+		stream_write_reset (c->out);
+		c->sent = 0;
+	}
+	/* only ask for EPOLLOUT while there is something left to send. A
+	 * client that has hung up stays readable, so it is only asked for
+	 * EPOLLOUT until the answers are sent */
+	if (c->closing)
+		events = EPOLLOUT;
+	else
+		events = EPOLLIN|EPOLLRDHUP|(writing ? EPOLLOUT : 0);
+	if (events != c->events) {
+		ev.events = events;
+		ev.data.ptr = c;
+		epoll_ctl (w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->events = events;
+	}
+	return 1;
+}
+
+static void client_event (SERVER_WORKER * w, CLIENT * c, unsigned int events)
+{
+	if (events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP)) {
+		while (1) {
+			ssize_t n = read (c->fd, w->buffer, READ_SIZE);
+			if (n > 0) {
+				stream_write (c->in, w->buffer, n);
+				continue;
+			}
+			if (n == 0)
+				c->closing = 1;
+			else if (errno == EINTR)
+				continue;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->closing = 1;
+			break;
+		}
+		if (!handle_requests (w, c)) {
+			close_client (w, c);
+			return;
+		}
+	}
+	if (events & EPOLLERR || !flush_client (w, c)) {
+		close_client (w, c);
+		return;
+	}
+	if (c->closing && c->sent == c->out->size)
+		close_client (w, c);
+}
+
+static void * server_main (void * arg)
+{
+	SERVER_WORKER * w = arg;
+	struct epoll_event events[MAX_EVENTS];
+	while (1) {
+		int i, n = epoll_wait (w->epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+			bail ("epoll_wait failed:%s\n",strerror (errno));
+		for (i=0;i<n;i++) {
+			if (events[i].data.ptr)
+				client_event (w, events[i].data.ptr, events[i].events);
+			else
+				accept_clients (w);
+		}
+	}
+	return NULL;
+}
+
+int run_server (OPTIONS * opt)
+{
+	SERVER s;
+	SERVER_WORKER * workers;
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	size_t i, count;
+
+	if (opt->file_count || opt->output_file)
+		bail ("Input and output files are sent to the server\n");
+	if (strlen (opt->serve_path) >= sizeof(addr.sun_path))
+		bail ("Socket path too long:%s\n",opt->serve_path);
+	/* a socket left behind by an earlier server */
+	if (!stat (opt->serve_path, &st) && S_ISSOCK (st.st_mode))
+		unlink (opt->serve_path);
+
+	s.opt = opt;
+	s.listener = socket (AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (s.listener < 0)
+		bail ("Unable to create a socket:%s\n",strerror (errno));
+	memset (&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, opt->serve_path);
+	/* only the user running the server can connect to the socket */
+	mask = umask (0177);
+	if (bind (s.listener, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		umask (mask);
+		bail ("Unable to listen on %s:%s\n",opt->serve_path,strerror (errno));
+	}
+	umask (mask);
+	if (listen (s.listener, SOMAXCONN) < 0)
+		bail ("Unable to listen on %s:%s\n",opt->serve_path,strerror (errno));
+
+	count = opt->jobs;
+	if (!count) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		count = cpus > 0 ? (size_t)cpus : 1;
+	}
+	workers = xmalloc (count*sizeof(SERVER_WORKER));
+	for (i=0;i<count;i++) {
+		SERVER_WORKER * w = workers + i;
+		struct epoll_event ev;
+		w->server = &s;
+		w->notes = stream_create (READ_SIZE);
+		w->output = stream_create (READ_SIZE);
+		w->scratch = stream_create (READ_SIZE);
+		w->epfd = epoll_create1 (EPOLL_CLOEXEC);
+		if (w->epfd < 0)
+			bail ("epoll_create1 failed:%s\n",strerror (errno));
+		ev.events = EPOLLIN|EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
+		if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, s.listener, &ev) < 0)
+			bail ("epoll_ctl failed:%s\n",strerror (errno));
+	}
+	fprintf (stderr, "%s: serving on %s with %lu workers\n",PROG_NAME,opt->serve_path,(unsigned long)count);
+	for (i=0;i<count;i++)
+		if (pthread_create (&workers[i].thread, NULL, server_main, workers + i))
+			bail ("Unable to start a worker thread\n");
+	for (i=0;i<count;i++)
+		pthread_join (workers[i].thread, NULL);
+	return 1;
+}
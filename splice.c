@@ -0,0 +1,200 @@
+/*
+ * Midi splicing - HS
+ * cmc-splice puts midi files together and takes them apart a chunk at a
+ * time, without decoding them. merge makes one format 1 file of the
+ * tracks of all of them, concat plays them one after the other, and
+ * split writes every track of a file as a file of its own. The chunks
+ * are copied from file to file by the kernel where it can. A file is
+ * written under a temporary name and renamed into place once it is
+ * whole, so writing over one of the inputs (which are still mapped) or
+ * failing half way leaves the old file as it was.
+ */
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "midi.h"
+#include "stream.h"
+#include "util.h"
+
+#define PROG_SPLICE "cmc-splice"
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/* open a temporary file next to 'path' for the output, or standard
+ * output for '-'. The temporary name is left in 'temp' */
+static int open_output (const char * path, char ** temp)
+{
+	int fd;
+	*temp = NULL;
+	if (!strcmp (path, "-"))
+		return STDOUT_FILENO;
+	*temp = xmalloc (strlen (path) + 8);
+	sprintf (*temp, "%s.XXXXXX", path);
+	fd = mkstemp (*temp);
+	if (fd < 0) {
+		fprintf (stderr, "%s: Unable to write file:%s\n", PROG_SPLICE, path);
+		xfree (*temp);
+		*temp = NULL;
+		return -1;
+	}
+	fchmod (fd, 0644);
+	return fd;
+}
+
+/* the output replaces 'path' only if it was written whole */
+static int close_output (int fd, const char * path, char * temp, int ok)
+{
+	if (fd == STDOUT_FILENO)
+		return ok;
+	if (close (fd) < 0 || !ok || rename (temp, path) < 0) {
+		fprintf (stderr, "%s: Unable to write file:%s\n", PROG_SPLICE, path);
+		unlink (temp);
+		ok = 0;
+	}
+	xfree (temp);
+	return ok;
+}
+
+static MIDI_READER * open_song (const char * path)
+{
+	MIDI_READER * r = midi_reader_open (path);
+	if (!r)
+		fprintf (stderr, "%s: Unable to read midi file:%s\n", PROG_SPLICE, path);
+	return r;
+}
+
+/* merge or concat the songs into 'output'. Returns the bytes written, -1 if it failed */
+static long join (int (*how) (int, MIDI_READER **, size_t), const char * output,
+                  char ** inputs, size_t count)
+{
+	MIDI_READER ** songs = xmalloc (count*sizeof(MIDI_READER *));
+	char * temp;
+	size_t i, opened;
+	long bytes = 0;
+	int fd, ok = 1;
+	for (opened=0;opened<count && ok;opened++) {
+		songs[opened] = open_song (inputs[opened]);
+		ok = songs[opened] != NULL;
+		if (ok)
+			bytes += songs[opened]->size;
+	}
+	if (!ok)
+		opened--;
+	else if ((fd = open_output (output, &temp)) < 0)
+		ok = 0;
+	else
+		ok = close_output (fd, output, temp, how (fd, songs, count));
+	for (i=0;i<opened;i++)
+		midi_reader_close (songs[i]);
+	xfree (songs);
+	return ok ? bytes : -1;
+}
+
+/* every track of 'input' to a file of its own, named after it with the
+ * track counted, next to it or in 'output_dir' */
+static long split (const char * input, const char * output_dir)
+{
+	MIDI_READER * r = open_song (input);
+	const char * name, * dot;
+	char * path, * temp;
+	size_t i;
+	long bytes;
+	int ok = 1;
+	if (!r)
+		return -1;
+	name = strrchr (input, '/');
+	name = name ? name + 1 : input;
+	dot = strrchr (name, '.');
+	if (!dot || dot == name)
+		dot = name + strlen (name);
+	path = xmalloc ((output_dir ? strlen (output_dir) : 0) + (dot - input) + 32);
+	for (i=0;i<r->track_count && ok;i++) {
+		int fd;
+		if (output_dir)
+			sprintf (path, "%s/%.*s-%lu.mid", output_dir, (int)(dot - name), name, (unsigned long)i + 1);
+		else
+			sprintf (path, "%.*s-%lu.mid", (int)(dot - input), input, (unsigned long)i + 1);
+		if ((fd = open_output (path, &temp)) < 0)
+			ok = 0;
+		else
+			ok = close_output (fd, path, temp, midi_split (fd, r, i));
+	}
+	bytes = r->size;
+	xfree (path);
+	midi_reader_close (r);
+	return ok ? bytes : -1;
+}
+
+static void usage (void)
+{
+	fprintf (stderr, "%s: usage %s merge|concat -o output.mid file.mid ...\n", PROG_SPLICE, PROG_SPLICE);
+	fprintf (stderr, "       %s split [-o directory] file.mid ...\n", PROG_SPLICE);
+	fprintf (stderr, "  merge   the tracks of all the files in one format 1 file\n");
+	fprintf (stderr, "  concat  the files played one after the other\n");
+	fprintf (stderr, "  split   every track of each file to a file of its own\n");
+	exit (1);
+}
+
+int main (int argc, char ** argv)
+{
+	const char * command, * output = NULL;
+	unsigned long total = 0;
+	double start, elapsed;
+	int failed = 0;
+
+	if (!argv[1])
+		usage ();
+	command = argv[1];
+	argv += 2;
+	if (*argv && !strcmp (*argv, "-o")) {
+		if (!argv[1])
+			usage ();
+		output = argv[1];
+		argv += 2;
+	}
+	if (!*argv)
+		usage ();
+
+	start = now ();
+	if (!strcmp (command, "split")) {
+		for (;*argv;argv++) {
+			long n = split (*argv, output);
+			if (n < 0)
+				failed = 1;
+			else
+				total += n;
+		}
+	} else {
+		long n;
+		size_t count = 0;
+		if (!output)
+			usage ();
+		while (argv[count])
+			count++;
+		if (!strcmp (command, "merge"))
+			n = join (midi_merge, output, argv, count);
+		else if (!strcmp (command, "concat"))
+			n = join (midi_concat, output, argv, count);
+		else
+			usage ();
+		if (n < 0)
+			failed = 1;
+		else
+			total = n;
+	}
+	elapsed = now () - start;
+	fprintf (stderr, "%lu bytes in %.3fs, %.1f MB/s\n", total, elapsed,
+	         elapsed > 0 ? total/elapsed/1e6 : 0);
+	return failed;
+}
@@ -10,12 +10,124 @@
 #include <stdio.h>
 #include <string.h>
 #include "stream.h"
+#if !defined(__GNUC__) && defined(HAVE_PTHREAD)
+#	include <pthread.h>
+#endif
+
+/* the memory of every stream together. If there is a budget a stream
+ * that would go over it bails */
+static size_t budget = 0;
+static size_t used = 0;
+static size_t peak = 0;
+
+/* The counts are shared by every thread. GCC and Clang have atomic
+ * builtins for them; other compilers take a lock, if there are threads */
+#ifdef __GNUC__
+static size_t count_add (size_t * n, size_t bytes)
+{
+	return __atomic_add_fetch (n, bytes, __ATOMIC_RELAXED);
+}
+
+static void count_sub (size_t * n, size_t bytes)
+{
+	__atomic_sub_fetch (n, bytes, __ATOMIC_RELAXED);
+}
+
+static size_t count_get (size_t * n)
+{
+	return __atomic_load_n (n, __ATOMIC_RELAXED);
+}
+
+/* 'n' goes up to 'value', if that is more */
+static void count_raise (size_t * n, size_t value)
+{
+	size_t high = __atomic_load_n (n, __ATOMIC_RELAXED);
+	while (value > high && !__atomic_compare_exchange_n (n, &high, value, 1,
+	                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+#else
+#	ifdef HAVE_PTHREAD
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+#		define lock_counts()   pthread_mutex_lock (&count_lock)
+#		define unlock_counts() pthread_mutex_unlock (&count_lock)
+#	else
+#		define lock_counts()
+#		define unlock_counts()
+#	endif
+static size_t count_add (size_t * n, size_t bytes)
+{
+	size_t now;
+	lock_counts ();
+	now = *n += bytes;
+	unlock_counts ();
+	return now;
+}
+
+static void count_sub (size_t * n, size_t bytes)
+{
+	lock_counts ();
+	*n -= bytes;
+	unlock_counts ();
+}
+
+static size_t count_get (size_t * n)
+{
+	size_t now;
+	lock_counts ();
+	now = *n;
+	unlock_counts ();
+	return now;
+}
+
+static void count_raise (size_t * n, size_t value)
+{
+	lock_counts ();
+	if (value > *n)
+		*n = value;
+	unlock_counts ();
+}
+#endif
+
+static void charge (size_t bytes)
+{
+	size_t now = count_add (&used, bytes);
+	if (budget && now > budget) {
+		count_sub (&used, bytes);
+		bail ("Out of memory: more than the budget of %luMB is needed\n",
+		      (unsigned long)(budget/(1024*1024)));
+	}
+	count_raise (&peak, now);
+}
+
+static void discharge (size_t bytes)
+{
+	count_sub (&used, bytes);
+}
+
+void stream_set_budget (size_t bytes)
+{
+	budget = bytes;
+}
+
+size_t stream_memory_peak (void)
+{
+	return count_get (&peak);
+}
 
 static int stream_expand(STREAM * stream, size_t new_capacity)
 {
-	char *tmp = (char *)reallocate(stream->buffer, new_capacity);
-	if (!tmp)
+	char *tmp;
+	/* a stream that spills never needs more than its window */
+	if (stream->window && new_capacity > stream->window)
+		new_capacity = stream->window;
+	if (new_capacity > stream->capacity)
+		charge (new_capacity - stream->capacity);
+	tmp = (char *)reallocate(stream->buffer, new_capacity);
+	if (!tmp) {
+		discharge (new_capacity - stream->capacity);
 		return 0;
+	}
 	stream->capacity = new_capacity;
 	stream->buffer = tmp;
 	return 1;
@@ -23,14 +135,57 @@ static int stream_expand(STREAM * stream, size_t new_capacity)
 	
 }
 
+/* move the buffer to the end of the spill file */
+static void spill_write (STREAM * stream, const char * data, size_t len)
+{
+	if (!stream->spill && !(stream->spill = tmpfile ()))
+		bail ("Unable to create a spill file\n");
+	if (fwrite (data, 1, len, stream->spill) != len)
+		bail ("Unable to write a spill file\n");
+	stream->spilled += len;
+}
+
+static void spill_out (STREAM * stream)
+{
+	spill_write (stream, stream->buffer, stream->size);
+	stream->size = 0;
+	stream->offset = 0;
+}
+
+/* A stream that is only ever appended to and then written out can be
+ * let spill: once it would hold more than 'window' bytes what it has
+ * goes to a temporary file. stream_write_to_io and stream_write_stream
+ * write the file and then the buffer; nothing else sees what has
+ * spilled */
+void stream_spill (STREAM * stream, size_t window)
+{
+	stream->window = window;
+}
+
+static void release_stream (void * stream)
+{
+	stream_free (stream);
+}
+
+/* a compile that bails frees the streams it made, and gives their
+ * memory back to the budget */
 STREAM * stream_create (size_t size)
 {
-	STREAM *result = (STREAM *)allocate(sizeof(STREAM));
+	STREAM *result;
+	result = (STREAM *)allocate(sizeof(STREAM));
 	result->size = 0;
-	result->capacity = size;
+	result->capacity = 0;
 	result->offset = 0;
-	result->buffer = (char *)allocate(size);
+	result->buffer = NULL;
 	result->r_offset = 0;
+	result->spill = NULL;
+	result->spilled = 0;
+	result->window = 0;
+	result->wrapped = 0;
+	bail_hold (result, release_stream);
+	charge (size);
+	result->capacity = size;
+	result->buffer = (char *)allocate(size);
 	if (!result->buffer)
 		return NULL;
 	return result;
@@ -40,8 +195,12 @@ STREAM * stream_create (size_t size)
 
 void stream_free(STREAM *stream)
 {
+	bail_drop (stream);
 	if (stream->buffer)
 		deallocate(stream->buffer);
+	if (stream->spill)
+		fclose (stream->spill);
+	discharge (stream->capacity - stream->wrapped);
 	deallocate(stream);
 }
 
@@ -49,6 +208,11 @@ void stream_write_reset (STREAM * stream)
 {
 	stream->size = 0;
 	stream->offset = 0;
+	if (stream->spill) {
+		fclose (stream->spill);
+		stream->spill = NULL;
+		stream->spilled = 0;
+	}
 }
 
 size_t stream_write(STREAM *stream,const char *data,size_t len)
@@ -58,6 +222,15 @@ size_t stream_write(STREAM *stream,const char *data,size_t len)
 	/*check if the internal buffer has enough space for the
 	 * incomming data */
 	final_size  = stream->offset+len;
+	if (stream->window && final_size > stream->window)
+	{
+		spill_out (stream);
+		if (len > stream->capacity) {
+			spill_write (stream, data, len);
+			return len;
+		}
+		final_size = len;
+	}
 	if (final_size > stream->capacity)
 	{
 		/*if we need to expand to more than twice the current size
@@ -127,6 +300,11 @@ int stream_add_char(STREAM *stream,unsigned char ch)
 	/*check if the internal buffer has enough space for the
 	 * incomming data */
 	final_size  = stream->offset+1;
+	if (stream->window && final_size > stream->window)
+	{
+		spill_out (stream);
+		final_size = 1;
+	}
 	if (final_size > stream->capacity)
 	{
 		/*if we need to expand to more than twice the current size
@@ -181,14 +359,48 @@ int stream_write_to_file (STREAM * stream, char * filename)
 	FILE * s;
 	int result;
 	s = fopen (filename, "wb");
-	result = fwrite (stream->buffer, 1, stream->size, s);
+	if (!s)
+		return 0;
+	result = stream_write_to_io (stream, s);
 	fclose(s);
 	return result;
 }
 
 int stream_write_to_io (STREAM * stream, FILE * io)
 {
-	return fwrite (stream->buffer, 1, stream->size, io);
+	int total = 0;
+	if (stream->spill) {
+		char buffer[4096];
+		size_t size;
+		rewind (stream->spill);
+		while ((size = fread (buffer, 1, sizeof(buffer), stream->spill))) {
+			if (fwrite (buffer, 1, size, io) != size)
+				return total;
+			total += size;
+		}
+		fseek (stream->spill, 0, SEEK_END);
+	}
+	return total + fwrite (stream->buffer, 1, stream->size, io);
+}
+
+/* the bytes written to the stream, spilled or not */
+size_t stream_length (STREAM * stream)
+{
+	return stream->spilled + stream->size;
+}
+
+/* write everything written to 'from', spilled or not, to 'stream' */
+void stream_write_stream (STREAM * stream, STREAM * from)
+{
+	if (from->spill) {
+		char buffer[4096];
+		size_t size;
+		rewind (from->spill);
+		while ((size = fread (buffer, 1, sizeof(buffer), from->spill)))
+			stream_write (stream, buffer, size);
+		fseek (from->spill, 0, SEEK_END);
+	}
+	stream_write (stream, from->buffer, from->size);
 }
 
 /* read data from a FILE stream into the STREAM object */
@@ -216,6 +428,39 @@ STREAM * stream_load_from_file (char * filename)
 	
 }
 
+/* A stream over a buffer that belongs to someone else, 'capacity' bytes
+ * of it, who takes it back with stream_unwrap. Only what the stream
+ * grows it by counts against the budget, and only until then */
+void stream_wrap (STREAM * stream, char * buffer, size_t capacity)
+{
+	stream->buffer = buffer;
+	stream->capacity = buffer ? capacity : 0;
+	stream->size = 0;
+	stream->offset = 0;
+	stream->r_offset = 0;
+	stream->spill = NULL;
+	stream->spilled = 0;
+	stream->window = 0;
+	stream->wrapped = stream->capacity;
+}
+
+/* the buffer, grown or not, for its owner to free */
+char * stream_unwrap (STREAM * stream)
+{
+	discharge (stream->capacity - stream->wrapped);
+	stream->wrapped = stream->capacity;
+	return stream->buffer;
+}
+
+/* free the stream but keep its buffer, which is the caller's to free */
+char * stream_take_buffer (STREAM * stream)
+{
+	char * r = stream->buffer;
+	stream->buffer = NULL;
+	stream_free (stream);
+	return r;
+}
+
 #ifdef DO_TEST
 int main(int argc, char **argv)
 {
@@ -52,6 +52,10 @@ typedef struct _STREAM
 	int offset; /* current write offset into the buffer */
 	char * buffer; /* actual data buffer */
 	int r_offset; /* current read offset into the buffer */
+	FILE * spill; /* what was written before the buffer, NULL if nothing */
+	size_t spilled; /* bytes in the spill file */
+	size_t window; /* most the buffer holds before it spills, 0 to never spill */
+	size_t wrapped; /* what a wrapped buffer held, which the budget doesn't count */
 }STREAM;
 
 /* stream manipulation functions */
@@ -71,6 +75,14 @@ int    stream_write_to_file     (STREAM * stream, char * filename);
 int    stream_write_to_io       (STREAM * stream, FILE * io);
 int    stream_copy_from_io      (STREAM * stream, FILE * io);
 STREAM * stream_load_from_file  (char * filename);
+char * stream_take_buffer       (STREAM * stream);
+void   stream_wrap              (STREAM * stream, char * buffer, size_t capacity);
+char * stream_unwrap            (STREAM * stream);
+size_t stream_length            (STREAM * stream);
+void   stream_write_stream      (STREAM * stream, STREAM * from);
+void   stream_spill             (STREAM * stream, size_t window);
+void   stream_set_budget        (size_t bytes);
+size_t stream_memory_peak       (void);
 #define stream_add_str(stream,data) stream_write(stream,data,strlen(data))
 
 #define stream_end(s) (s->r_offset >= s->size)
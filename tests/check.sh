@@ -0,0 +1,159 @@
+#!/bin/sh
+# Regression checks - HS
+# Every check compiles a little notation with ./cmc (or $CMC) and looks
+# at the midi file that comes out. Run with 'make check'.
+
+CMC=${CMC:-./cmc}
+MIDI2NOTES=${MIDI2NOTES:-$(dirname $CMC)/midi2notes}
+failed=0
+tmp=$(mktemp -d)
+
+# the bytes of the midi file of some notation, one space between each
+midi ()
+{
+	printf '%s\n' "$1" | $CMC $2 | od -An -tx1 -v | tr -s ' \n' '  '
+}
+
+# same <what> <notation> <notation it has to compile the same as> [options]
+same ()
+{
+	if [ "$(midi "$2" "$4")" != "$(midi "$3" "$4")" ]; then
+		echo "FAILED: $1"
+		failed=1
+	fi
+}
+
+# session <what> <notation>: --watch encodes the song a section at a
+# time and has to come out with what cmc writes in one go
+session ()
+{
+	printf '%s\n' "$2" > $tmp/song.notes
+	rm -f $tmp/watch.mid
+	$CMC --watch $tmp/song.notes -o $tmp/watch.mid 2>/dev/null &
+	pid=$!
+	n=0
+	while [ ! -f $tmp/watch.mid ] && [ $n -lt 100 ]; do
+		sleep 0.1
+		n=$((n+1))
+	done
+	kill $pid
+	wait $pid 2>/dev/null
+	if [ "$(od -An -tx1 -v $tmp/watch.mid | tr -s ' \n' '  ')" != "$(midi "$2")" ]; then
+		echo "FAILED: $1"
+		failed=1
+	fi
+}
+
+# has <what> <notation> <bytes the midi file has to hold> [options]
+has ()
+{
+	case "$(midi "$2" "$4")" in
+		*" $3 "*) ;;
+		*) echo "FAILED: $1"; failed=1 ;;
+	esac
+}
+
+same "a phrase keeps the nadai it is played in" \
+     '{nadai=3}{phrase="a"}S R G{end}{nadai=4}{play="a"} M P' \
+     '{nadai=3}S R G S R G{nadai=4} M P'
+same "a phrase sets the nadai it has a directive for" \
+     '{phrase="a"}{nadai=3}S R G{end} M P {play="a"} D' \
+     '{nadai=3}S R G M P S R G D'
+same "a repeat block sets the nadai it has a directive for" \
+     '|{nadai=3}S R| G' \
+     '{nadai=3}S R S R G'
+same "a phrase keeps the raga it is played in" \
+     '{raga="kalyani"}{phrase="a"}S R G{end}{raga="todi"}{play="a"} G m P' \
+     '{raga="kalyani"}S R G S R G{raga="todi"} G m P'
+same "a ~ before a repeat block is a kampita on its first note" \
+     '~|S R| G' \
+     '~S R S R G'
+same "a ~ before a repeat block played once" \
+     'S ~|R G|x1' \
+     'S ~R G'
+same "a ~ before a phrase is a kampita on its first note" \
+     '~{phrase="a"}S R{end} G' \
+     '~S R G'
+same "a ~ before a phrase played again" \
+     'S R {phrase="a"}G M{end} ~{play="a"} P' \
+     'S R G M ~G M P'
+session "a ~ before a section is a kampita on its first note" \
+        ':A
+:S R ~
+:B
+:G M'
+session "a kampita sounding into a section lasts past its ramp" \
+        ':P
+:S R ~G
+:A
+:{volume=10..100}M P D'
+session "a kampita left by a phrase lasts past the ramp of the next section" \
+        '{phrase="a"}S ~R{end}
+:P
+:S {play="a"}
+:A
+:{volume=10..100}, M P D'
+
+has "S++ is two octaves above S" 'S++' '90 54 40'
+has "S-- is two octaves below S" 'S--' '90 24 40'
+has "N-- is two octaves below N" 'N--' '90 2f 40'
+has "S+++++ is the top C" 'S+++++' '90 78 40'
+
+# a song long enough to keep every stage of the pipeline waiting on the
+# others many times over
+awk 'BEGIN {
+	split ("S R G M P D N", n, " ");
+	for (i = 0; i < 60000; i++) {
+		if (i % 500 == 0)
+			printf ":Section %d\n:\n", i;
+		if (i % 97 == 0)
+			printf "{volume=10..100} ";
+		for (j = 0; j < 6; j++)
+			printf "%s%s ", (i % 53 == 0 && !j) ? "~" : "", n[(i*7 + j*3) % 7 + 1];
+		printf "\n";
+	}
+}' > $tmp/big.notes
+run=
+command -v timeout >/dev/null && run="timeout 60"
+$CMC -t -d 96 $tmp/big.notes -o $tmp/serial.mid
+$run $CMC -t -d 96 --pipeline $tmp/big.notes -o $tmp/pipeline.mid 2>/dev/null
+if ! cmp -s $tmp/serial.mid $tmp/pipeline.mid; then
+	echo "FAILED: a long song compiles the same with --pipeline"
+	failed=1
+fi
+# a file over the memory budget fails its own job in a batch, and only that
+awk 'BEGIN { for (i = 0; i < 40000; i++) print "S R G m P D N S R G m P D N" }' > $tmp/huge.notes
+printf 'S R G\n' > $tmp/small.notes
+printf '%s -o %s\n' $tmp/small.notes $tmp/a.mid $tmp/huge.notes $tmp/huge.mid $tmp/small.notes $tmp/b.mid > $tmp/batch
+for io in threads uring; do
+	rm -f $tmp/a.mid $tmp/b.mid
+	$CMC --batch $tmp/batch --io $io --jobs 1 --max-memory 1 > /dev/null 2>&1
+	if [ ! -f $tmp/a.mid ] || [ ! -f $tmp/b.mid ]; then
+		echo "FAILED: a file over the budget fails only its own job (--io $io)"
+		failed=1
+	fi
+done
+
+# the ways of writing the midi file don't mix
+for mix in "--pipeline --cache $tmp/cache" "--pipeline --parallel" "--parallel --cache $tmp/cache"; do
+	if ! $CMC $mix $tmp/small.notes -o $tmp/mix.mid 2>&1 | grep -q "can't be used with"; then
+		echo "FAILED: $mix is turned away"
+		failed=1
+	fi
+done
+
+# a note byte past 127, and the same file cut short
+printf 'MThd\000\000\000\006\000\000\000\001\000\140MTrk\000\000\000\014\000\220\374\100\000\200\374\100\000\377\057\000' > $tmp/bad.mid
+head -c 27 $tmp/bad.mid > $tmp/short.mid
+if ! $MIDI2NOTES - < $tmp/bad.mid 2>&1 >/dev/null | grep -q "Bad data byte"; then
+	echo "FAILED: midi2notes turns away a note past 127"
+	failed=1
+fi
+$MIDI2NOTES - < $tmp/short.mid > /dev/null 2>&1
+if [ $? -ne 1 ]; then
+	echo "FAILED: midi2notes turns away a file cut short"
+	failed=1
+fi
+rm -rf $tmp
+
+exit $failed
@@ -0,0 +1,128 @@
+/*
+ * Thalam track generation - HS
+ * One cycle of the thalam is encoded into a byte template the first
+ * time round.  The track is then built by copying that template once
+ * per cycle; only the delta in front of the very first strike differs
+ * from the template.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "thalam.h"
+#include "util.h"
+
+/* notes struck on the thalam channel */
+#define NOTE_S        0x3C
+#define NOTE_P        0x43
+#define NOTE_S_UPPER  0x48
+
+/* The suladi talams are given in chatusra jathi (a laghu of 4 beats)
+ * except where another jathi is the one commonly used */
+const THALAM_CYCLE thalam_cycles[] = {
+	{"adi",          "XfffXwXw"},        /* laghu, dhrutam, dhrutam */
+	{"rupaka",       "XwXfff"},          /* dhrutam, laghu */
+	{"misra-chapu",  "XffXfXf"},         /* 3+2+2 */
+	{"khanda-chapu", "XfXff"},           /* 2+3 */
+	{"tisra-triputa","XffXwXw"},         /* tisra laghu, dhrutam, dhrutam */
+	{"jhampa",       "XffffffXXw"},      /* misra laghu, anudhrutam, dhrutam */
+	{"ata",          "XffffXffffXwXw"},  /* khanda laghu x2, dhrutam x2 */
+	{"dhruva",       "XfffXwXfffXfff"},  /* laghu, dhrutam, laghu, laghu */
+	{"matya",        "XfffXwXfff"},      /* laghu, dhrutam, laghu */
+	{"eka",          "Xfff"},            /* laghu */
+	{NULL, NULL}
+};
+
+const THALAM_CYCLE * thalam_cycle (char * name)
+{
+	const THALAM_CYCLE * c;
+	for (c=thalam_cycles;c->name;c++)
+		if (!strcasecmp (name, c->name))
+			return c;
+	return NULL;
+}
+
+static void encode_strike (MIDI_TRACK * mt, unsigned long delta, unsigned long gate,
+                           unsigned char channel, char kind)
+{
+	unsigned char notes[3];
+	unsigned char velocity;
+	int count, i;
+	switch (kind) {
+		case 'X':
+			notes[0] = NOTE_S; notes[1] = NOTE_P; notes[2] = NOTE_S_UPPER;
+			count = 3; velocity = 0x40;
+			break;
+		case 'w':
+			notes[0] = NOTE_P; notes[1] = NOTE_S_UPPER;
+			count = 2; velocity = 0x30;
+			break;
+		default:
+			notes[0] = NOTE_S;
+			count = 1; velocity = 0x28;
+	}
+	for (i=0;i<count;i++)
+		encode_voice (mt, i?0:delta, channel, VOICE_EVENT_NOTE_ON, notes[i], velocity);
+	for (i=0;i<count;i++)
+		encode_voice (mt, i?0:gate, channel, VOICE_EVENT_NOTE_OFF, notes[i], 0x40);
+}
+
+/* encode one cycle of the thalam into the template.
+ * Every strike is held for one akshara (a quarter of the beat) */
+int thalam_init (THALAM * t, const THALAM_CYCLE * cycle, unsigned long beat_ticks,
+                 unsigned char channel, unsigned char instrument)
+{
+	MIDI_TRACK mt;
+	size_t i;
+	t->cycle = cycle;
+	t->beats = strlen (cycle->beats);
+	assert (t->beats && t->beats <= THALAM_MAX_BEATS);
+	t->gate = beat_ticks/4;
+	if (!t->gate)
+		return 0;
+	t->beat_ticks = beat_ticks;
+	t->channel = channel;
+	t->instrument = instrument;
+
+	mt.stream = stream_create (16*t->beats);
+	encode_voice (&mt, t->beat_ticks - t->gate, channel, VOICE_EVENT_NOTE_ON, NOTE_S, 0);
+	t->lead_size = mt.stream->size - 3;
+	stream_write_reset (mt.stream);
+	for (i=0;i<t->beats;i++) {
+		encode_strike (&mt, t->beat_ticks - t->gate, t->gate, channel, cycle->beats[i]);
+		t->beat_end[i] = mt.stream->size;
+	}
+	t->pattern = mt.stream;
+	return 1;
+}
+
+/* generate a thalam track that covers 'ticks' worth of music */
+void thalam_encode (THALAM * t, MIDI_TRACK * mt, unsigned long ticks)
+{
+	unsigned long beats, left, end = 0;
+	char * pattern = t->pattern->buffer;
+
+	encode_voice (mt, 0, t->channel, VOICE_EVENT_PROGRAM, t->instrument, 0);
+	encode_voice (mt, 0, t->channel, VOICE_EVENT_CONTROLLER, CONTROLLER_CHANNEL_VOLUME, THALAM_VOLUME);
+
+	beats = (ticks + t->beat_ticks - 1)/t->beat_ticks;
+	if (beats) {
+		/* the first strike starts right away */
+		left = beats < t->beats ? beats : t->beats;
+		stream_add_char (mt->stream, 0);
+		stream_write (mt->stream, pattern + t->lead_size, t->beat_end[left-1] - t->lead_size);
+		for (left = beats - left; left >= t->beats; left -= t->beats)
+			stream_write (mt->stream, pattern, t->beat_end[t->beats-1]);
+		if (left)
+			stream_write (mt->stream, pattern, t->beat_end[left-1]);
+		end = (beats-1)*t->beat_ticks + t->gate;
+	}
+	encode_meta (mt, ticks > end ? ticks - end : 0, META_EVENT_EOT, 0, 0, NULL);
+}
+
+void thalam_free (THALAM * t)
+{
+	stream_free (t->pattern);
+	t->pattern = NULL;
+}
@@ -0,0 +1,45 @@
+/* Thalam (rhythm cycle) track generation
+ * HS
+ */
+#ifndef _THALAM_H_
+#define _THALAM_H_
+
+#include "stream.h"
+#include "midi.h"
+
+#define THALAM_MAX_BEATS 32
+#define THALAM_VOLUME    45
+
+/* A cycle is described by one character per beat:
+ * 'X' is a clap, 'w' a wave and 'f' a finger count */
+struct thalam_cycle_t
+{
+	char * name;
+	char * beats;
+};
+
+struct thalam_t
+{
+	const struct thalam_cycle_t * cycle;
+	size_t beats;              /* number of beats in one cycle */
+	unsigned long beat_ticks;  /* length of a beat */
+	unsigned long gate;        /* how long each strike is held */
+	unsigned char channel;
+	unsigned char instrument;
+	STREAM * pattern;          /* one encoded cycle, led by the inter-beat delta */
+	size_t lead_size;          /* size of that leading delta */
+	size_t beat_end[THALAM_MAX_BEATS]; /* offset just past the events of each beat */
+};
+
+typedef struct thalam_cycle_t THALAM_CYCLE;
+typedef struct thalam_t       THALAM;
+
+extern const THALAM_CYCLE thalam_cycles[];
+
+const THALAM_CYCLE * thalam_cycle (char * name);
+int  thalam_init   (THALAM * t, const THALAM_CYCLE * cycle, unsigned long beat_ticks,
+                    unsigned char channel, unsigned char instrument);
+void thalam_encode (THALAM * t, MIDI_TRACK * mt, unsigned long ticks);
+void thalam_free   (THALAM * t);
+
+#endif /* _THALAM_H_ */
@@ -0,0 +1,258 @@
+/*
+ * Midi transforms - HS
+ * cmc-transform transposes, scales the velocities of and stretches midi
+ * files without decoding them. Every track chunk is mapped once for the
+ * offsets of the bytes the transforms touch, its notes and velocities or
+ * its delta times, and those bytes are rewritten where they are. Only a
+ * stretch that changes the width of a delta moves anything, and then a
+ * track is compacted in one pass.
+ */
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "midi.h"
+#include "stream.h"
+#include "util.h"
+
+#define PROG_TRANSFORM "cmc-transform"
+
+struct transform_t
+{
+	int transpose;             /* semitones */
+	double velocity;           /* 1 leaves them */
+	double stretch;            /* 1 leaves the timing */
+	const char * output_dir;   /* NULL to rewrite the files themselves */
+};
+
+/* a chunk of the file, where it is now and how long */
+struct piece_t
+{
+	unsigned char * data;
+	size_t length;
+	const unsigned char * type;
+	int moved;                 /* compacted into a block of its own */
+};
+
+typedef struct transform_t TRANSFORM;
+typedef struct piece_t     PIECE;
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static unsigned char * load (const char * path, size_t * size)
+{
+	struct stat st;
+	unsigned char * data;
+	size_t got = 0;
+	int fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat (fd, &st) < 0) {
+		close (fd);
+		return NULL;
+	}
+	data = xmalloc (st.st_size + 1);
+	while (got < (size_t)st.st_size) {
+		ssize_t n = read (fd, data + got, st.st_size - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	close (fd);
+	*size = got;
+	return data;
+}
+
+static int save (const char * path, STREAM * out, const unsigned char * data, size_t size)
+{
+	FILE * io = fopen (path, "wb");
+	int ok;
+	if (!io)
+		return 0;
+	if (out)
+		ok = stream_write_to_io (out, io) == (int)out->size;
+	else
+		ok = fwrite (data, 1, size, io) == size;
+	return fclose (io) == 0 && ok;
+}
+
+/* Returns the bytes transformed, or -1 if the file is left alone */
+static long transform (const char * path, const TRANSFORM * t)
+{
+	unsigned char * data, * p, * end;
+	PIECE * pieces;
+	size_t size, count = 0, capacity = 16, i;
+	STREAM * out = NULL;
+	char * target;
+	int resized = 0, failed = 0;
+
+	if (!(data = load (path, &size))) {
+		fprintf (stderr, "%s: Unable to read file:%s\n", PROG_TRANSFORM, path);
+		return -1;
+	}
+	if (size < 14 || memcmp (data, "MThd", 4)) {
+		fprintf (stderr, "%s: %s: Header chunk expected but not found\n", PROG_TRANSFORM, path);
+		xfree (data);
+		return -1;
+	}
+	pieces = xmalloc (capacity*sizeof(PIECE));
+	for (p=data,end=data+size;end-p >= 8;) {
+		PIECE * c;
+		unsigned long length = read32 (p+4);
+		if (length > (unsigned long)(end - p - 8)) {
+			fprintf (stderr, "%s: %s: chunk %lu cut short\n", PROG_TRANSFORM, path,
+			         (unsigned long)count + 1);
+			failed = 1;
+			break;
+		}
+		if (count == capacity) {
+			capacity *= 2;
+			pieces = xrealloc (pieces, capacity*sizeof(PIECE));
+		}
+		c = pieces + count++;
+		c->type = p;
+		c->data = p + 8;
+		c->length = length;
+		c->moved = 0;
+		p += 8 + length;
+		if (!memcmp (c->type, "MTrk", 4)) {
+			MIDI_MAP * map = midi_map_track (c->data, c->length,
+			                                 (t->transpose || t->velocity != 1 ? MIDI_MAP_NOTES : 0) |
+			                                 (t->stretch != 1 ? MIDI_MAP_DELTAS : 0));
+			if (map->error[0]) {
+				fprintf (stderr, "%s: %s: chunk %lu: %s", PROG_TRANSFORM, path,
+				         (unsigned long)count, map->error);
+				failed = 1;
+			} else {
+				if (t->transpose)
+					midi_transpose (c->data, map, t->transpose);
+				if (t->velocity != 1)
+					midi_scale_velocity (c->data, map, t->velocity);
+				if (t->stretch != 1) {
+					unsigned char * track = midi_stretch (c->data, &c->length, map, t->stretch);
+					if (!track) {
+						fprintf (stderr, "%s: %s: chunk %lu: stretched too far\n", PROG_TRANSFORM,
+						         path, (unsigned long)count);
+						failed = 1;
+					} else {
+						c->moved = track != c->data;
+						c->data = track;
+						resized |= c->length != length;
+					}
+				}
+			}
+			midi_map_free (map);
+		}
+		if (failed)
+			break;
+	}
+
+	if (!failed && resized) {
+		out = stream_create (size + size/8);
+		for (i=0;i<count;i++) {
+			stream_write (out, (const char *)pieces[i].type, 4);
+			stream_write_int_reverse (out, pieces[i].length, 4);
+			stream_write (out, (const char *)pieces[i].data, pieces[i].length);
+		}
+		/* anything after the last chunk stays */
+		stream_write (out, (const char *)p, end - p);
+	}
+	if (!failed) {
+		const char * name = strrchr (path, '/');
+		name = name ? name + 1 : path;
+		target = xmalloc (strlen (t->output_dir ? t->output_dir : path) + strlen (name) + 8);
+		if (t->output_dir)
+			sprintf (target, "%s/%s", t->output_dir, name);
+		else
+			sprintf (target, "%s.tmp", path);
+		if (!save (target, out, data, size) || (!t->output_dir && rename (target, path) < 0)) {
+			fprintf (stderr, "%s: Unable to write file:%s\n", PROG_TRANSFORM, target);
+			unlink (target);
+			failed = 1;
+		}
+		xfree (target);
+	}
+	for (i=0;i<count;i++)
+		if (pieces[i].moved)
+			xfree (pieces[i].data);
+	xfree (pieces);
+	if (out)
+		stream_free (out);
+	xfree (data);
+	return failed ? -1 : (long)size;
+}
+
+static void usage (void)
+{
+	fprintf (stderr, "%s: usage %s [-t semitones] [-v factor] [-s ratio] (-i | -o directory) file.mid ...\n",
+	         PROG_TRANSFORM, PROG_TRANSFORM);
+	fprintf (stderr, "  -t  move every note (but the drums) by this many semitones\n");
+	fprintf (stderr, "  -v  scale the velocity of every note by this\n");
+	fprintf (stderr, "  -s  scale every delta time by this, 2 plays it half as fast\n");
+	fprintf (stderr, "  -i  rewrite the files themselves, -o writes them to a directory\n");
+	exit (1);
+}
+
+int main (int argc, char ** argv)
+{
+	TRANSFORM t;
+	unsigned long bytes = 0, files = 0;
+	int in_place = 0, failed = 0;
+	double start, elapsed;
+
+	t.transpose = 0;
+	t.velocity = 1;
+	t.stretch = 1;
+	t.output_dir = NULL;
+	argv++;
+	while (*argv && **argv == '-') {
+		if (!strcmp (*argv, "-i")) {
+			in_place = 1;
+			argv++;
+			continue;
+		}
+		if (!argv[1])
+			usage ();
+		if (!strcmp (*argv, "-t"))
+			t.transpose = atoi (argv[1]);
+		else if (!strcmp (*argv, "-v"))
+			t.velocity = atof (argv[1]);
+		else if (!strcmp (*argv, "-s"))
+			t.stretch = atof (argv[1]);
+		else if (!strcmp (*argv, "-o"))
+			t.output_dir = argv[1];
+		else
+			usage ();
+		argv += 2;
+	}
+	if (!*argv || in_place == (t.output_dir != NULL) || t.velocity <= 0 || t.stretch <= 0)
+		usage ();
+
+	start = now ();
+	for (;*argv;argv++) {
+		long n = transform (*argv, &t);
+		if (n < 0)
+			failed = 1;
+		else {
+			bytes += n;
+			files++;
+		}
+	}
+	elapsed = now () - start;
+	fprintf (stderr, "%lu files, %lu bytes in %.3fs, %.1f MB/s\n", files, bytes, elapsed,
+	         elapsed > 0 ? bytes/elapsed/1e6 : 0);
+	return failed;
+}
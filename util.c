@@ -1,8 +1,23 @@
+#define _XOPEN_SOURCE 500 /* vsnprintf */
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include "util.h"
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+static BAIL_HANDLER * bail_handler (void);
+
+/* allocations that fail are told apart from other errors */
+static void no_memory (const char * text)
+{
+	BAIL_HANDLER * handler = bail_handler ();
+	if (handler)
+		handler->out_of_memory = 1;
+	bail ("%s", text);
+}
 
 void * xmalloc (size_t size)
 {
@@ -11,7 +26,7 @@ void * xmalloc (size_t size)
 		bail ("Zero byte allocation requested\n");
 	result = malloc(size);
 	if (!result)
-		bail ("Memory allocation failed\n");
+		no_memory ("Memory allocation failed\n");
 	return result;
 }
 
@@ -22,7 +37,7 @@ void * xrealloc (void * ptr, size_t size)
 		bail ("Zero byte realloction requested\n");
 	result = realloc (ptr, size);
 	if (!result)
-		bail ("Reallocation failed\n");
+		no_memory ("Reallocation failed\n");
 	return result;
 }
 
@@ -43,16 +58,178 @@ char * xstrdup (char * str)
 	return result;
 }
 
+static int is_blank (char c)
+{
+	return c==' ' || c=='\t' || c=='\r';
+}
+
+/* split a line into words in place, up to a '#' or the end of the
+ * line. 'words' may be NULL to just count them; otherwise it is ended
+ * with a NULL */
+size_t split_words (char * p, char ** words)
+{
+	size_t n = 0;
+	while (*p && *p != '#' && *p != '\n') {
+		if (is_blank (*p)) {
+			p++;
+			continue;
+		}
+		if (words)
+			words[n] = p;
+		n++;
+		while (*p && *p != '#' && *p != '\n' && !is_blank (*p))
+			p++;
+		if (words && *p) {
+			int end = *p == '#' || *p == '\n';
+			*p++ = '\0';
+			if (end)
+				break;
+		}
+	}
+	if (words)
+		words[n] = NULL;
+	return n;
+}
+
+#ifdef HAVE_PTHREAD
+/* every thread has a handler of its own */
+static pthread_key_t bail_key;
+static pthread_once_t bail_once = PTHREAD_ONCE_INIT;
+
+static void bail_key_create (void)
+{
+	pthread_key_create (&bail_key, NULL);
+}
+
+static BAIL_HANDLER * bail_handler (void)
+{
+	pthread_once (&bail_once, bail_key_create);
+	return pthread_getspecific (bail_key);
+}
+
+static void bail_set (BAIL_HANDLER * handler)
+{
+	pthread_once (&bail_once, bail_key_create);
+	pthread_setspecific (bail_key, handler);
+}
+#else
+static BAIL_HANDLER * current_handler = NULL;
+
+static BAIL_HANDLER * bail_handler (void)
+{
+	return current_handler;
+}
+
+static void bail_set (BAIL_HANDLER * handler)
+{
+	current_handler = handler;
+}
+#endif
+
+/* errors on this thread go to 'handler' from now on. NULL goes back to
+ * ending the program; whatever the last handler still held has found
+ * an owner by then */
+void bail_catch (BAIL_HANDLER * handler)
+{
+	BAIL_HANDLER * last = bail_handler ();
+	if (last && last->held) {
+		free (last->held);
+		last->held = NULL;
+		last->held_count = 0;
+	}
+	bail_set (handler);
+	if (handler) {
+		handler->warnings[0] = '\0';
+		handler->out_of_memory = 0;
+		handler->held = NULL;
+		handler->held_count = 0;
+		handler->held_size = 0;
+	}
+}
+
+/* 'data' is released with 'release' if the compile bails before it is
+ * dropped. Without a handler there is nothing to go back to, so
+ * nothing is held */
+void bail_hold (void * data, void (*release) (void *))
+{
+	BAIL_HANDLER * handler = bail_handler ();
+	if (!handler)
+		return;
+	if (handler->held_count == handler->held_size) {
+		size_t size = handler->held_size ? handler->held_size*2 : 16;
+		struct bail_hold_t * held = realloc (handler->held, size*sizeof(struct bail_hold_t));
+		if (!held) {
+			release (data);
+			no_memory ("Memory allocation failed\n");
+		}
+		handler->held = held;
+		handler->held_size = size;
+	}
+	handler->held[handler->held_count].release = release;
+	handler->held[handler->held_count].data = data;
+	handler->held_count++;
+}
+
+/* 'data' is freed or has an owner that outlives the compile. What was
+ * held last is usually dropped first */
+void bail_drop (void * data)
+{
+	BAIL_HANDLER * handler = bail_handler ();
+	size_t i;
+	if (!handler)
+		return;
+	for (i=handler->held_count;i--;)
+		if (handler->held[i].data == data) {
+			handler->held_count--;
+			memmove (handler->held + i, handler->held + i + 1,
+			         (handler->held_count - i)*sizeof(struct bail_hold_t));
+			return;
+		}
+}
+
+/* each is taken off before it is released, so releasing one that
+ * drops others is fine */
+static void release_held (BAIL_HANDLER * handler)
+{
+	while (handler->held_count) {
+		struct bail_hold_t * h = handler->held + --handler->held_count;
+		h->release (h->data);
+	}
+	free (handler->held);
+	handler->held = NULL;
+	handler->held_size = 0;
+}
 
 void bail(const char * text,...)
 {
 	va_list args;
+	BAIL_HANDLER * handler = bail_handler ();
 	va_start (args, text);
+	if (handler) {
+		vsnprintf (handler->message, BAIL_MESSAGE_SIZE, text, args);
+		va_end (args);
+		release_held (handler);
+		longjmp (handler->env, 1);
+	}
 	vfprintf (stderr, text, args);
 	va_end (args);
 	exit(1);
 }
 
+/* warnings that don't fit in the handler are dropped */
+void warn(const char * text,...)
+{
+	va_list args;
+	BAIL_HANDLER * handler = bail_handler ();
+	va_start (args, text);
+	if (handler) {
+		size_t used = strlen (handler->warnings);
+		vsnprintf (handler->warnings + used, BAIL_MESSAGE_SIZE - used, text, args);
+	} else
+		vfprintf (stderr, text, args);
+	va_end (args);
+}
+
 
 
 char * instruments[INSTRUMENT_COUNT] = {
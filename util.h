@@ -1,12 +1,44 @@
 #ifndef UTIL_H_
 
 #define UTIL_H_
+#include <stddef.h>
+#include <setjmp.h>
 #define INSTRUMENT_COUNT 0x80
+#define BAIL_MESSAGE_SIZE 256
+
+/* something a compile is using, and how to get rid of it */
+struct bail_hold_t
+{
+	void (*release) (void *);
+	void * data;
+};
+
+/* Where bail() goes instead of ending the program. The message is
+ * kept and the handler's jump buffer is longjmp'ed to. Warnings are
+ * collected here too rather than printed. What is held with bail_hold
+ * is released, last first, before the jump */
+struct bail_handler_t
+{
+	jmp_buf env;
+	char message[BAIL_MESSAGE_SIZE];
+	char warnings[BAIL_MESSAGE_SIZE];
+	int out_of_memory;     /* the error was an allocation failing */
+	struct bail_hold_t * held;
+	size_t held_count;
+	size_t held_size;
+};
+typedef struct bail_handler_t BAIL_HANDLER;
+
 void bail(const char * text,...);
+void warn(const char * text,...);
+void bail_catch (BAIL_HANDLER * handler);
+void bail_hold (void * data, void (*release) (void *));
+void bail_drop (void * data);
 void * xmalloc (size_t size);
 void * xrealloc (void * ptr, size_t size);
 void xfree (void * ptr);
 char * xstrdup (char * str);
+size_t split_words (char * p, char ** words);
 extern char * instruments[INSTRUMENT_COUNT];
 unsigned char instrument_number (char * instrument);
 
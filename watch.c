@@ -0,0 +1,213 @@
+/*
+ * Watch mode - HS
+ * cmc --watch compiles the song, then waits for its notation files to
+ * be saved and compiles it again. The directories of the files are
+ * watched rather than the files themselves, so editors that save by
+ * writing a new file and renaming it over the old one are seen too.
+ * Events that arrive within a few milliseconds of each other are taken
+ * as one save. Only the files that changed are read again, the song is
+ * encoded with a session (only the sections that changed are encoded)
+ * into buffers kept from the last build, and the midi file is replaced
+ * in one rename so a player never sees half of it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "stream.h"
+#include "util.h"
+#include "cmc.h"
+
+#define EVENT_BUFFER (64*1024)
+
+struct watch_file_t
+{
+	char * path;
+	char * name;           /* the last part of the path */
+	int wd;
+	STREAM * text;
+	int changed;
+};
+
+struct watch_t
+{
+	OPTIONS * opt;
+	int fd;
+	struct watch_file_t files[MAX_TRACK_COUNT];
+	size_t count;
+	char * tracks[MAX_TRACK_COUNT];
+	SESSION * session;
+	STREAM * output;
+	STREAM * scratch;
+	BAIL_HANDLER handler;
+};
+
+typedef struct watch_file_t WATCH_FILE;
+typedef struct watch_t      WATCH;
+
+static double now (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/* read a file that changed. Returns 0 if it can't be read (it may be
+ * in the middle of being replaced) */
+static int reload (WATCH_FILE * f)
+{
+	FILE * io = fopen (f->path, "rb");
+	if (!io)
+		return 0;
+	stream_write_reset (f->text);
+	stream_copy_from_io (f->text, io);
+	fclose (io);
+	stream_add_char (f->text, '\0');
+	f->changed = 0;
+	return 1;
+}
+
+static void write_output (WATCH * w)
+{
+	char * output_file = w->opt->output_file;
+	char * temp = xmalloc (strlen (output_file) + 8);
+	FILE * io;
+	int fd;
+	sprintf (temp, "%s.XXXXXX", output_file);
+	fd = mkstemp (temp);
+	if (fd < 0 || !(io = fdopen (fd, "wb"))) {
+		xfree (temp);
+		bail ("Unable to write file:%s\n",output_file);
+	}
+	fchmod (fd, 0644);
+	if (stream_write_to_io (w->output, io) != (int)w->output->size || fclose (io)
+	    || rename (temp, output_file) < 0) {
+		unlink (temp);
+		xfree (temp);
+		bail ("Unable to write file:%s\n",output_file);
+	}
+	xfree (temp);
+}
+
+/* compile the song if every file can be read. 'start' is when the first
+ * event of the save came in */
+static void rebuild (WATCH * w, double start)
+{
+	OPTIONS opt;
+	unsigned long encoded, reused;
+	size_t i;
+	for (i=0;i<w->count;i++) {
+		if (w->files[i].changed && !reload (w->files + i))
+			return;
+		w->tracks[i] = w->files[i].text->buffer;
+	}
+	if (setjmp (w->handler.env)) {
+		bail_catch (NULL);
+		fprintf (stderr, "%s%s", w->handler.warnings, w->handler.message);
+		return;
+	}
+	bail_catch (&w->handler);
+	opt = *w->opt;
+	session_encode (w->session, &opt, w->tracks, w->count, w->output, w->scratch);
+	write_output (w);
+	bail_catch (NULL);
+	session_counts (w->session, &encoded, &reused);
+	fprintf (stderr, "%s%s: wrote %s in %.3fms (%lu of %lu sections encoded)\n",
+	         w->handler.warnings, PROG_NAME, w->opt->output_file, (now () - start)*1000,
+	         encoded, encoded + reused);
+}
+
+/* mark the files an event is about. Returns 1 if it is about any */
+static int file_event (WATCH * w, struct inotify_event * ev)
+{
+	int found = 0;
+	size_t i;
+	if (!ev->len)
+		return 0;
+	for (i=0;i<w->count;i++)
+		if (w->files[i].wd == ev->wd && !strcmp (w->files[i].name, ev->name)) {
+			w->files[i].changed = 1;
+			found = 1;
+		}
+	return found;
+}
+
+/* read the events waiting. Returns 1 if any of them are about the song */
+static int read_events (WATCH * w, char * buffer)
+{
+	int found = 0;
+	ssize_t n = read (w->fd, buffer, EVENT_BUFFER);
+	char * p;
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		bail ("Unable to read file events:%s\n",strerror (errno));
+	}
+	for (p=buffer;p<buffer+n;p+=sizeof(struct inotify_event)+((struct inotify_event *)p)->len)
+		found |= file_event (w, (struct inotify_event *)p);
+	return found;
+}
+
+int run_watch (OPTIONS * opt)
+{
+	WATCH w;
+	char * buffer;
+	size_t i;
+
+	if (!opt->file_count)
+		bail ("--watch needs the notation files to watch\n");
+	if (!opt->output_file || !strcmp (opt->output_file, "-"))
+		bail ("--watch needs an output file\n");
+	w.opt = opt;
+	w.fd = inotify_init1 (IN_CLOEXEC);
+	if (w.fd < 0)
+		bail ("Unable to watch files:%s\n",strerror (errno));
+	/* the tracks go in the same order as load_tracks puts them */
+	w.count = opt->file_count;
+	for (i=0;i<w.count;i++) {
+		WATCH_FILE * f = w.files + i;
+		char * slash, * dir;
+		f->path = opt->in_files[w.count-1-i];
+		slash = strrchr (f->path, '/');
+		f->name = slash ? slash + 1 : f->path;
+		dir = slash ? xstrdup (f->path) : xstrdup (".");
+		if (slash)
+			dir[slash - f->path + (slash == f->path)] = '\0';
+		f->wd = inotify_add_watch (w.fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE);
+		if (f->wd < 0)
+			bail ("Unable to watch %s:%s\n",dir,strerror (errno));
+		xfree (dir);
+		f->text = stream_create (4096);
+		f->changed = 1;
+		if (!reload (f))
+			bail ("Unable to open file:%s\n",f->path);
+	}
+	w.session = session_create ();
+	w.output = stream_create (4096);
+	w.scratch = stream_create (4096);
+	buffer = xmalloc (EVENT_BUFFER);
+
+	rebuild (&w, now ());
+	fprintf (stderr, "%s: watching %lu files, ^C to stop\n",PROG_NAME,(unsigned long)w.count);
+	while (1) {
+		struct pollfd pfd;
+		double start;
+		if (!read_events (&w, buffer))
+			continue;
+		start = now ();
+		/* wait for the rest of the save */
+		pfd.fd = w.fd;
+		pfd.events = POLLIN;
+		while (poll (&pfd, 1, opt->watch_delay) > 0)
+			read_events (&w, buffer);
+		rebuild (&w, start);
+	}
+	return 1;
+}